@@ -14,25 +14,43 @@ QMAKE_CXXFLAGS += -std=c++11
 
 HEADERS += \
     src/roi.h \
+    src/roipool.h \
+    src/spotestimator.h \
+    src/resulttable.h \
     src/qtfiles.h \
     src/estimator.h \
+    src/framepool.h \
+    src/localizationrun.h \
+    src/ImageStack/img_kernels.hpp \
     src/ImageStack/img_stack.hpp \
     src/imagedrawer.h \
     src/imagerender.h \
     src/lokalizationthread.h \
     src/stackoverview.h \
-    src/threadsavequeue.h
+    src/lockfreequeue.h \
+    src/orderedframequeue.h \
+    src/taskpipeline.h \
+    src/threadsavequeue.h \
+    src/workstealingpool.h
 
 SOURCES += \
     src/roi.cpp \
+    src/roipool.cpp \
+    src/spotestimator.cpp \
+    src/resulttable.cpp \
     src/main.cpp \
     src/estimator.cpp \
+    src/framepool.cpp \
+    src/localizationrun.cpp \
+    src/ImageStack/img_kernels.cpp \
     src/ImageStack/img_stack.cpp \
     src/imagedrawer.cpp \
     src/imagerender.cpp \
     src/lokalizationthread.cpp \
     src/stackoverview.cpp \
-    src/threadsavequeue.cpp
+    src/taskpipeline.cpp \
+    src/threadsavequeue.cpp \
+    src/workstealingpool.cpp
 
 
 
@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "ImageStack/img_kernels.hpp"
+#include "roi.h"
+#include "spotestimator.h"
+
+/// Frames that look like camera frames: a flat background with noise and a few bright spots
+static std::vector<uint16_t> make_frames(int size, int count, unsigned seed)
+{
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> noise(0, 12);
+  std::uniform_int_distribution<int> spot(0, size*size-1);
+
+  std::vector<uint16_t> frames((size_t) size*size*count);
+  for(auto & px : frames){
+    px = (uint16_t) std::max(0.0f, 400 + noise(gen));
+  }
+  for(int frame = 0; frame < count; frame++){
+    for(int n = 0; n < size; n++){
+      frames[(size_t) frame*size*size + spot(gen)] += 3000;
+    }
+  }
+  return frames;
+}
+
+/// Mean time in microseconds a kernel takes for one frame
+/** @param kernel Gets the frame number, its result is kept to compare the versions
+**/
+static double time_frames(int size, int count, std::function<void(int)> const& kernel)
+{
+  const int repeats = (size > 1024)? 4 : 64;
+  double total = 0;
+
+  for(int rep = 0; rep < repeats; rep++){
+    for(int frame = 0; frame < count; frame++){
+      auto start = std::chrono::steady_clock::now();
+      kernel(frame);
+      total += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+  return total / (repeats*count);
+}
+
+static void print_time(int size, char const* version, double us, double reference_us, bool identical)
+{
+  std::printf("  %4dx%-4d %-9s %10.1f us  %6.2fx  %s\n", size, size, version,
+              us, reference_us/us, identical? "identical" : "DIFFERENT");
+}
+
+static void bench_bg(int size, std::vector<uint16_t> const& frames, int count)
+{
+  const size_t pixels = (size_t) size*size;
+  std::vector<uint16_t> reference;
+  double scalar_us = 0;
+
+  for(int level = simd_scalar; level <= cpu_simd_level(); level++){
+    limit_simd_level((simd_level) level);
+
+    std::vector<uint16_t> bg(frames.begin(), frames.begin() + pixels);
+    std::vector<uint16_t> img(pixels);
+    uint32_t checksum = 0;
+
+    const double us = time_frames(size, count, [&](int frame){
+      std::copy(frames.begin() + frame*pixels, frames.begin() + (frame+1)*pixels, img.begin());
+      for(int row = 0; row < size; row++){
+        checksum += subtr_and_update_bg_row(&img[(size_t) row*size], &bg[(size_t) row*size], size, 1.0f/16);
+      }
+    });
+
+    bg.push_back((uint16_t) checksum);
+    if(level == simd_scalar){
+      reference = bg;
+      scalar_us = us;
+    }
+    print_time(size, simd_level_name((simd_level) level), us, scalar_us, bg == reference);
+  }
+}
+
+/// The high-pass filter as image16_ref did it before, summing up the window of every pixel
+static void highpass_by_halo(uint16_t const* img, int size, int radius, uint16_t *out)
+{
+  for(int row = 0; row < size; row++){
+    for(int col = 0; col < size; col++){
+      int acc = 0;
+      int count = 0;
+      for(int r = row - radius; r < row + radius + 1; r++){
+        for(int c = col - radius; c < col + radius + 1; c++){
+          if(r > 0 && r < size && c > 0 && c < size){
+            acc += img[r*size + c];
+            count++;
+          }
+        }
+      }
+      out[row*size + col] = acc/count;
+    }
+  }
+}
+
+/// The high-pass filter the way image16_highpass runs it
+static void highpass_by_col_sums(uint16_t const* img, int size, int radius, uint16_t *out)
+{
+  std::vector<uint32_t> col_sums(size);
+  std::vector<uint32_t> prefix(size + 1);
+  int first = 1;
+  int last = 0;
+
+  for(int row = 0; row < size; row++){
+    while(last < std::min(row + radius, size - 1)){
+      last++;
+      add_row(col_sums.data(), img + last*size, size);
+    }
+    while(first < row - radius){
+      sub_row(col_sums.data(), img + first*size, size);
+      first++;
+    }
+    box_mean_row(col_sums.data(), size, radius, last - first + 1, prefix.data(), out + row*size);
+  }
+}
+
+static void bench_highpass(int size, std::vector<uint16_t> const& frames, int count, int radius)
+{
+  const size_t pixels = (size_t) size*size;
+  std::vector<uint16_t> reference(pixels*count);
+  std::vector<uint16_t> out(pixels*count);
+
+  const int halo_count = (radius > 3)? 1 : count;
+  const double halo_us = time_frames(size, halo_count, [&](int frame){
+    highpass_by_halo(&frames[frame*pixels], size, radius, &reference[frame*pixels]);
+  });
+  print_time(size, "halo", halo_us, halo_us, true);
+
+  for(int level = simd_scalar; level <= cpu_simd_level(); level++){
+    limit_simd_level((simd_level) level);
+
+    const double us = time_frames(size, count, [&](int frame){
+      highpass_by_col_sums(&frames[frame*pixels], size, radius, &out[frame*pixels]);
+    });
+    const bool identical = std::equal(out.begin(), out.begin() + pixels*halo_count, reference.begin());
+    print_time(size, simd_level_name((simd_level) level), us, halo_us, identical);
+  }
+}
+
+/// The 3x3 maximum test as Estimator::isMax did it, pixel by pixel
+static bool is_max(uint16_t const* img, int size, int col, int row, double threshold)
+{
+  const int mid = img[row*size + col];
+  if(mid < threshold || mid == img[(row-1)*size + col] || mid == img[row*size + col-1]){
+    return false;
+  }
+  for(int r = row-1; r <= row+1; r++){
+    for(int c = col-1; c <= col+1; c++){
+      if(mid < img[r*size + c]){
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void bench_maxima(int size, std::vector<uint16_t> const& frames, int count)
+{
+  const size_t pixels = (size_t) size*size;
+  const int padding = 3;
+  const uint16_t threshold = 420;
+
+  // the search runs on filtered frames
+  std::vector<uint16_t> filtered(pixels*count);
+  for(int frame = 0; frame < count; frame++){
+    highpass_by_col_sums(&frames[frame*pixels], size, 1, &filtered[frame*pixels]);
+  }
+
+  std::vector<int> reference;
+  const double pixel_us = time_frames(size, count, [&](int frame){
+    reference.clear();
+    for(int row = padding; row < size-padding; row++){
+      for(int col = padding; col < size-padding; col++){
+        if(is_max(&filtered[frame*pixels], size, col, row, threshold)){
+          reference.push_back(row*size + col);
+        }
+      }
+    }
+  });
+  print_time(size, "isMax", pixel_us, pixel_us, true);
+
+  for(int level = simd_scalar; level <= cpu_simd_level(); level++){
+    limit_simd_level((simd_level) level);
+
+    std::vector<int> maxima;
+    std::vector<int> cols(size);
+    const double us = time_frames(size, count, [&](int frame){
+      maxima.clear();
+      for(int row = padding; row < size-padding; row++){
+        uint16_t const* rows[3];
+        for(int i = 0; i < 3; i++){
+          rows[i] = &filtered[frame*pixels + (row-1+i)*size];
+        }
+        const int found = local_max_row(rows, padding, size-padding, threshold, cols.data());
+        for(int i = 0; i < found; i++){
+          maxima.push_back(row*size + cols[i]);
+        }
+      }
+    });
+    print_time(size, simd_level_name((simd_level) level), us, pixel_us, maxima == reference);
+  }
+}
+
+/// The sums of a spot the way Roi::calc took them, with double coordinates
+static spot_sums sums_like_calc(uint16_t const* block, int size, int lane)
+{
+  spot_sums sums = spot_sums();
+  for(double y = 0; y < size; y++){
+    for(double x = 0; x < size; x++){
+      const int value = block[((int) y*size + (int) x)*spot_lanes + lane];
+      if(value > 0){
+        sums.n++;
+        sums.x2 += x*x;
+        sums.y2 += y*y;
+        sums.x  += x;
+        sums.y  += y;
+        sums.q  += value;
+        sums.q_max = std::max(sums.q_max, value);
+        const int xval = value*x;
+        sums.mx += xval;
+        sums.sx += x*xval;
+        const int yval = value*y;
+        sums.my += yval;
+        sums.sy += y*yval;
+      }
+    }
+  }
+  return sums;
+}
+
+static bool operator ==(spot_sums const& a, spot_sums const& b)
+{
+  return std::memcmp(&a, &b, sizeof(spot_sums)) == 0;
+}
+
+static void bench_moments(int size, std::vector<uint16_t> const& frames)
+{
+  // spots of separated candidates: cut off at the border, bright in the middle
+  const int spots = 1 << 16;
+  const int pixels = size*size;
+  const int cut = size*size/8;
+  std::vector<uint16_t> blocks((size_t) spots*pixels);
+  for(size_t i = 0; i < blocks.size(); i++){
+    const int p = (i / spot_lanes) % pixels;
+    const int x = p % size - size/2;
+    const int y = p / size - size/2;
+    blocks[i] = (x*x + y*y > cut)? 0 : frames[i % frames.size()] * (cut + 4 - x*x - y*y) / (cut + 4);
+  }
+
+  std::vector<spot_sums> reference(spots);
+  const double calc_us = time_frames(size, 1, [&](int){
+    for(int spot = 0; spot < spots; spot++){
+      reference[spot] = sums_like_calc(&blocks[(size_t) (spot/spot_lanes)*pixels*spot_lanes], size, spot%spot_lanes);
+    }
+  });
+  print_time(size, "calc", calc_us, calc_us, true);
+
+  for(int level = simd_scalar; level <= cpu_simd_level(); level++){
+    limit_simd_level((simd_level) level);
+
+    std::vector<spot_sums> sums(spots);
+    const double us = time_frames(size, 1, [&](int){
+      spot_sums_block(blocks.data(), size, spots, sums.data());
+    });
+    print_time(size, simd_level_name((simd_level) level), us, calc_us, sums == reference);
+  }
+}
+
+/// Roi::cutEdges() on one spot at a time against spot_cut_edges_block(), both on fresh copies of the spots
+static void bench_cut_edges(int size, std::vector<uint16_t> const& frames)
+{
+  // spots around maxima of a dense frame: a bright middle on a noisy background
+  const int spots = 1 << 14;
+  const int pixels = size*size;
+  std::vector<uint16_t> blocks((size_t) spots*pixels);
+  for(size_t i = 0; i < blocks.size(); i++){
+    const int p = (i / spot_lanes) % pixels;
+    const int x = p % size - size/2;
+    const int y = p / size - size/2;
+    const int background = frames[i % frames.size()] - 380;
+    blocks[i] = std::max(0, background) + 2000 / (1 + x*x + y*y);
+  }
+
+  std::vector<Roi> rois(spots, Roi(0, 0, 0, 0, size, size));
+  std::vector<int32_t> reference(spots);
+  const double roi_us = time_frames(size, 1, [&](int){
+    for(int spot = 0; spot < spots; spot++){
+      uint16_t const* block = &blocks[(size_t) (spot/spot_lanes)*pixels*spot_lanes];
+      for(int p = 0; p < pixels; p++){
+        rois[spot].setValue(block[p*spot_lanes + spot%spot_lanes], p % size, p / size);
+      }
+      reference[spot] = rois[spot].cutEdges();
+    }
+  });
+  print_time(size, "Roi", roi_us, roi_us, true);
+
+  for(int level = simd_scalar; level <= cpu_simd_level(); level++){
+    limit_simd_level((simd_level) level);
+
+    std::vector<uint16_t> cut(blocks.size());
+    std::vector<int32_t> sums(spots);
+    const double us = time_frames(size, 1, [&](int){
+      std::memcpy(cut.data(), blocks.data(), blocks.size()*sizeof(uint16_t));
+      for(int first = 0; first < spots; first += spot_lanes){
+        spot_cut_edges_block(&cut[(size_t) first*pixels], size, &sums[first]);
+      }
+    });
+
+    bool identical = (sums == reference);
+    for(int spot = 0; spot < spots && identical; spot++){
+      uint16_t const* block = &cut[(size_t) (spot/spot_lanes)*pixels*spot_lanes];
+      for(int p = 0; p < pixels; p++){
+        identical &= block[p*spot_lanes + spot%spot_lanes] == rois[spot].val(p % size, p / size);
+      }
+    }
+    print_time(size, simd_level_name((simd_level) level), us, roi_us, identical);
+  }
+}
+
+/// Throughput and accuracy of every SpotEstimator on spots with a known position
+/** The spots are Gaussians of photons photons with sigma 1.2 pixels on a flat
+    background, with Poisson noise, like separated spots of a dim dye.
+**/
+static void bench_estimators(double photons, double background)
+{
+  const int spots = 1 << 14;
+  const int spot_size = 7;
+  const double sigma = 1.2;
+
+  std::mt19937 gen(17);
+  std::uniform_real_distribution<double> offset(-0.5, 0.5);
+
+  std::vector<Roi*> rois;
+  std::vector<double> truthX, truthY;
+  for(int spot = 0; spot < spots; spot++){
+    const double x0 = spot_size/2 + offset(gen);
+    const double y0 = spot_size/2 + offset(gen);
+    Roi *roi = new Roi(0, 0, 0, 0, spot_size, spot_size);
+    for(int y = 0; y < spot_size; y++){
+      for(int x = 0; x < spot_size; x++){
+        const double gaussX = 0.5*(std::erf((x+0.5-x0)/(M_SQRT2*sigma)) - std::erf((x-0.5-x0)/(M_SQRT2*sigma)));
+        const double gaussY = 0.5*(std::erf((y+0.5-y0)/(M_SQRT2*sigma)) - std::erf((y-0.5-y0)/(M_SQRT2*sigma)));
+        std::poisson_distribution<int> noise(photons*gaussX*gaussY + background);
+        roi->setValue((quint16) std::min(noise(gen), 65535), x, y);
+      }
+    }
+    rois.push_back(roi);
+    truthX.push_back(x0);
+    truthY.push_back(y0);
+  }
+
+  const SpotEstimator::Method methods[] = {SpotEstimator::Centroid, SpotEstimator::GaussMLE};
+  for(auto method : methods){
+    SpotEstimator *estimator = SpotEstimator::create(method);
+    std::vector<Roi::Result> results(spots);
+
+    const auto start = std::chrono::steady_clock::now();
+    estimator->estimate(rois.data(), spots, results.data());
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double error = 0;
+    for(int spot = 0; spot < spots; spot++){
+      error += (results[spot].mx - truthX[spot])*(results[spot].mx - truthX[spot])
+             + (results[spot].my - truthY[spot])*(results[spot].my - truthY[spot]);
+    }
+    std::printf("  %-9s %12.0f spots/s  position error %.3f px\n", estimator->name(),
+                spots/seconds, std::sqrt(error/(2*spots)));
+    delete estimator;
+  }
+
+  for(auto roi : rois){
+    delete roi;
+  }
+}
+
+int main()
+{
+  const int sizes[] = {512, 2048};
+  const int radii[] = {1, 3, 8};
+  const int count = 8;
+
+  std::printf("CPU supports %s\n", simd_level_name(cpu_simd_level()));
+
+  std::printf("subtr_and_update_bg, time per frame:\n");
+  for(int size : sizes){
+    bench_bg(size, make_frames(size, count, size), count);
+  }
+
+  for(int radius : radii){
+    std::printf("apply_highpass radius %d, time per frame:\n", radius);
+    for(int size : sizes){
+      bench_highpass(size, make_frames(size, count, size), count, radius);
+    }
+  }
+
+  std::printf("local maxima, time per frame:\n");
+  for(int size : sizes){
+    bench_maxima(size, make_frames(size, count, size), count);
+  }
+
+  const int spotSizes[] = {5, 7, 9, 11};
+  std::printf("spot moments, time per %d spots of size x size pixels:\n", 1 << 16);
+  for(int spotSize : spotSizes){
+    bench_moments(spotSize, make_frames(512, 1, 512));
+  }
+
+  std::printf("cutting spot edges, time per %d spots of size x size pixels:\n", 1 << 14);
+  for(int spotSize : spotSizes){
+    bench_cut_edges(spotSize, make_frames(512, 1, 512));
+  }
+
+  limit_simd_level(cpu_simd_level());
+
+  const double photons[] = {300, 3000};
+  for(double spotPhotons : photons){
+    std::printf("spot estimators, %.0f photons on 2 per pixel, one thread:\n", spotPhotons);
+    bench_estimators(spotPhotons, 2);
+  }
+
+  return 0;
+}
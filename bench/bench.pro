@@ -0,0 +1,25 @@
+# Micro-benchmarks of the image kernels and spot estimators, needs QtCore but no libtiff:
+#   qmake bench/bench.pro && make && ./bench
+
+TARGET   = bench
+TEMPLATE = app
+CONFIG  += console c++11 release
+CONFIG  -= app_bundle
+QT       = core
+
+DEFINES += HEADLESS
+
+QMAKE_CXXFLAGS += -std=c++11
+
+INCLUDEPATH += ../src
+
+HEADERS += \
+    ../src/ImageStack/img_kernels.hpp \
+    ../src/roi.h \
+    ../src/spotestimator.h
+
+SOURCES += \
+    bench.cpp \
+    ../src/ImageStack/img_kernels.cpp \
+    ../src/roi.cpp \
+    ../src/spotestimator.cpp
@@ -0,0 +1,52 @@
+QT += core
+QT -= gui
+
+
+TARGET   = sfp-localize
+TEMPLATE = app
+CONFIG  += console
+CONFIG  -= app_bundle
+CONFIG  += c++11
+
+QMAKE_CXXFLAGS += -std=c++11
+
+DEFINES += HEADLESS
+
+unix: LIBS += -ltiff -lpthread
+
+
+HEADERS += \
+    src/roi.h \
+    src/roipool.h \
+    src/spotestimator.h \
+    src/resulttable.h \
+    src/qtfiles.h \
+    src/estimator.h \
+    src/framepool.h \
+    src/ImageStack/img_kernels.hpp \
+    src/ImageStack/img_stack.hpp \
+    src/batchscheduler.h \
+    src/localizationrun.h \
+    src/pipelinerunner.h \
+    src/lockfreequeue.h \
+    src/orderedframequeue.h \
+    src/taskpipeline.h \
+    src/threadsavequeue.h \
+    src/workstealingpool.h
+
+SOURCES += \
+    src/roi.cpp \
+    src/roipool.cpp \
+    src/spotestimator.cpp \
+    src/resulttable.cpp \
+    src/sfplocalize.cpp \
+    src/estimator.cpp \
+    src/framepool.cpp \
+    src/ImageStack/img_kernels.cpp \
+    src/ImageStack/img_stack.cpp \
+    src/batchscheduler.cpp \
+    src/localizationrun.cpp \
+    src/pipelinerunner.cpp \
+    src/taskpipeline.cpp \
+    src/threadsavequeue.cpp \
+    src/workstealingpool.cpp
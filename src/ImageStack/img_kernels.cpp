@@ -0,0 +1,936 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "img_kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMG_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+
+/// Widest instruction set of this CPU the kernels have a version for
+simd_level cpu_simd_level()
+{
+#ifdef IMG_KERNELS_X86
+  static const simd_level level = __builtin_cpu_supports("avx2")   ? simd_avx2
+                                : __builtin_cpu_supports("sse4.1") ? simd_sse41
+                                                                   : simd_scalar;
+  return level;
+#else
+  return simd_scalar;
+#endif
+}
+
+static std::atomic<int> simd_limit(simd_avx2);
+
+/// Instruction set the kernels use
+simd_level active_simd_level()
+{
+  return (simd_level) std::min<int>(cpu_simd_level(), simd_limit);
+}
+
+/// Keep the kernels from using more than the given instruction set, to compare the versions
+void limit_simd_level(simd_level level)
+{
+  simd_limit = level;
+}
+
+const char *simd_level_name(simd_level level)
+{
+  switch(level){
+    case simd_avx2:  return "AVX2";
+    case simd_sse41: return "SSE4.1";
+    default:         return "scalar";
+  }
+}
+
+
+/// Background subtraction of one pixel, the reference for the vector versions
+static inline void subtr_and_update_bg_px(uint16_t & img, uint16_t & bg, float img_weight)
+{
+  uint16_t img_data = img;
+  uint16_t bg_data = bg;
+  int diff_data = std::min<int>( (img_data - bg_data) , (int)sqrt((double)img_data) ) ; // subtract background and test if change is bigger than sigma of noise
+  img = std::max( img_data - bg_data , 0 );
+
+  bg = (uint16_t) (bg_data  + diff_data * img_weight);      // update background
+}
+
+static uint32_t subtr_and_update_bg_row_scalar(uint16_t *img, uint16_t *bg, int width, float img_weight)
+{
+  uint32_t sum = 0;
+  for(int col = 0; col < width; col++) {
+    sum += img[col];
+    subtr_and_update_bg_px(img[col], bg[col], img_weight);
+  }
+  return sum;
+}
+
+/*
+  The vector versions work on 32 bit lanes and take the same steps as the
+  scalar one: the square root is taken in float, which truncates to the same
+  integer for every 16 bit value. The update is a float multiply and a
+  separate float add, these functions are compiled without FMA so the two
+  are never contracted. The background is truncated to int and cut to its
+  low 16 bits like the scalar conversion does.
+*/
+
+#ifdef IMG_KERNELS_X86
+
+__attribute__((target("sse4.1")))
+static inline __m128i subtr_and_update_bg_4(__m128i img, __m128i bg, __m128 weight, __m128i & diff)
+{
+  const __m128i d = _mm_sub_epi32(img, bg);
+  const __m128i sigma = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(img)));
+  const __m128i change = _mm_min_epi32(d, sigma);
+  const __m128 updated = _mm_add_ps(_mm_cvtepi32_ps(bg), _mm_mul_ps(_mm_cvtepi32_ps(change), weight));
+
+  diff = _mm_max_epi32(d, _mm_setzero_si128());
+  return _mm_and_si128(_mm_cvttps_epi32(updated), _mm_set1_epi32(0xFFFF));
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t subtr_and_update_bg_row_sse41(uint16_t *img, uint16_t *bg, int width, float img_weight)
+{
+  const __m128 weight = _mm_set1_ps(img_weight);
+  __m128i sums = _mm_setzero_si128();
+
+  int col = 0;
+  for(; col + 8 <= width; col += 8) {
+    const __m128i img16 = _mm_loadu_si128((const __m128i*) (img + col));
+    const __m128i bg16  = _mm_loadu_si128((const __m128i*) (bg + col));
+    const __m128i imgLo = _mm_cvtepu16_epi32(img16);
+    const __m128i imgHi = _mm_cvtepu16_epi32(_mm_srli_si128(img16, 8));
+    const __m128i bgLo  = _mm_cvtepu16_epi32(bg16);
+    const __m128i bgHi  = _mm_cvtepu16_epi32(_mm_srli_si128(bg16, 8));
+
+    __m128i diffLo, diffHi;
+    const __m128i newBgLo = subtr_and_update_bg_4(imgLo, bgLo, weight, diffLo);
+    const __m128i newBgHi = subtr_and_update_bg_4(imgHi, bgHi, weight, diffHi);
+
+    _mm_storeu_si128((__m128i*) (img + col), _mm_packus_epi32(diffLo, diffHi));
+    _mm_storeu_si128((__m128i*) (bg + col), _mm_packus_epi32(newBgLo, newBgHi));
+    sums = _mm_add_epi32(sums, _mm_add_epi32(imgLo, imgHi));
+  }
+
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i*) lanes, sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+         + subtr_and_update_bg_row_scalar(img + col, bg + col, width - col, img_weight);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i subtr_and_update_bg_8(__m256i img, __m256i bg, __m256 weight, __m256i & diff)
+{
+  const __m256i d = _mm256_sub_epi32(img, bg);
+  const __m256i sigma = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(img)));
+  const __m256i change = _mm256_min_epi32(d, sigma);
+  const __m256 updated = _mm256_add_ps(_mm256_cvtepi32_ps(bg), _mm256_mul_ps(_mm256_cvtepi32_ps(change), weight));
+
+  diff = _mm256_max_epi32(d, _mm256_setzero_si256());
+  return _mm256_and_si256(_mm256_cvttps_epi32(updated), _mm256_set1_epi32(0xFFFF));
+}
+
+__attribute__((target("avx2")))
+static uint32_t subtr_and_update_bg_row_avx2(uint16_t *img, uint16_t *bg, int width, float img_weight)
+{
+  const __m256 weight = _mm256_set1_ps(img_weight);
+  __m256i sums = _mm256_setzero_si256();
+
+  int col = 0;
+  for(; col + 16 <= width; col += 16) {
+    const __m256i img16 = _mm256_loadu_si256((const __m256i*) (img + col));
+    const __m256i bg16  = _mm256_loadu_si256((const __m256i*) (bg + col));
+    const __m256i imgLo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(img16));
+    const __m256i imgHi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(img16, 1));
+    const __m256i bgLo  = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(bg16));
+    const __m256i bgHi  = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(bg16, 1));
+
+    __m256i diffLo, diffHi;
+    const __m256i newBgLo = subtr_and_update_bg_8(imgLo, bgLo, weight, diffLo);
+    const __m256i newBgHi = subtr_and_update_bg_8(imgHi, bgHi, weight, diffHi);
+
+    // the pack interleaves the 128 bit halves, the permute puts them back in order
+    _mm256_storeu_si256((__m256i*) (img + col), _mm256_permute4x64_epi64(_mm256_packus_epi32(diffLo, diffHi), 0xD8));
+    _mm256_storeu_si256((__m256i*) (bg + col), _mm256_permute4x64_epi64(_mm256_packus_epi32(newBgLo, newBgHi), 0xD8));
+    sums = _mm256_add_epi32(sums, _mm256_add_epi32(imgLo, imgHi));
+  }
+
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i*) lanes, sums);
+  uint32_t sum = 0;
+  for(int lane = 0; lane < 8; lane++) {
+    sum += lanes[lane];
+  }
+  return sum + subtr_and_update_bg_row_scalar(img + col, bg + col, width - col, img_weight);
+}
+
+#endif
+
+
+uint32_t subtr_and_update_bg_row(uint16_t *img, uint16_t *bg, int width, float img_weight)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    case simd_avx2:  return subtr_and_update_bg_row_avx2(img, bg, width, img_weight);
+    case simd_sse41: return subtr_and_update_bg_row_sse41(img, bg, width, img_weight);
+    default:         break;
+  }
+#endif
+  return subtr_and_update_bg_row_scalar(img, bg, width, img_weight);
+}
+
+
+static void add_row_scalar(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  for(int col = 0; col < width; col++) {
+    col_sums[col] += row[col];
+  }
+}
+
+static void sub_row_scalar(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  for(int col = 0; col < width; col++) {
+    col_sums[col] -= row[col];
+  }
+}
+
+/// Means of the columns from begin to end, all with the full window and the same count
+static void box_mean_interior_scalar(uint32_t const *prefix, int begin, int end, int radius, uint32_t count, uint16_t *out)
+{
+  for(int col = begin; col < end; col++) {
+    out[col] = (uint16_t) ((prefix[col + radius + 1] - prefix[col - radius]) / count);
+  }
+}
+
+/// Mean of a column whose window is cut at the border
+static inline uint16_t box_mean_border(uint32_t const *prefix, int width, int col, int radius, int rows)
+{
+  const int first = std::max(col - radius, 1);
+  const int last = std::min(col + radius, width - 1);
+  if(first > last) {
+    return 0;
+  }
+  return (uint16_t) ((prefix[last + 1] - prefix[first]) / ((uint32_t) rows * (last - first + 1)));
+}
+
+/*
+  The vector versions divide by the count in double: with the sum below 2^32
+  and the count below 2^19, (sum + 0.5) / count stays far enough from the
+  next integer that the rounded reciprocal truncates to the exact quotient.
+*/
+static const uint32_t max_reciprocal_count = 1u << 19;
+
+#ifdef IMG_KERNELS_X86
+
+__attribute__((target("sse4.1")))
+static void add_row_sse41(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  int col = 0;
+  for(; col + 8 <= width; col += 8) {
+    const __m128i px = _mm_loadu_si128((const __m128i*) (row + col));
+    __m128i *sums = (__m128i*) (col_sums + col);
+    _mm_storeu_si128(sums,     _mm_add_epi32(_mm_loadu_si128(sums),     _mm_cvtepu16_epi32(px)));
+    _mm_storeu_si128(sums + 1, _mm_add_epi32(_mm_loadu_si128(sums + 1), _mm_cvtepu16_epi32(_mm_srli_si128(px, 8))));
+  }
+  add_row_scalar(col_sums + col, row + col, width - col);
+}
+
+__attribute__((target("sse4.1")))
+static void sub_row_sse41(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  int col = 0;
+  for(; col + 8 <= width; col += 8) {
+    const __m128i px = _mm_loadu_si128((const __m128i*) (row + col));
+    __m128i *sums = (__m128i*) (col_sums + col);
+    _mm_storeu_si128(sums,     _mm_sub_epi32(_mm_loadu_si128(sums),     _mm_cvtepu16_epi32(px)));
+    _mm_storeu_si128(sums + 1, _mm_sub_epi32(_mm_loadu_si128(sums + 1), _mm_cvtepu16_epi32(_mm_srli_si128(px, 8))));
+  }
+  sub_row_scalar(col_sums + col, row + col, width - col);
+}
+
+/// Four unsigned sums divided by the count, as int32
+__attribute__((target("sse4.1")))
+static inline __m128i div_count_4(__m128i sums, __m128d reciprocal)
+{
+  // flipping the sign bit and adding 2^31 back converts unsigned to double
+  const __m128i shifted = _mm_xor_si128(sums, _mm_set1_epi32((int) 0x80000000u));
+  const __m128d offset = _mm_set1_pd(2147483648.0 + 0.5);
+  const __m128d lo = _mm_add_pd(_mm_cvtepi32_pd(shifted), offset);
+  const __m128d hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(shifted, 8)), offset);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(lo, reciprocal)),
+                            _mm_cvttpd_epi32(_mm_mul_pd(hi, reciprocal)));
+}
+
+__attribute__((target("sse4.1")))
+static void box_mean_interior_sse41(uint32_t const *prefix, int begin, int end, int radius, uint32_t count, uint16_t *out)
+{
+  const __m128d reciprocal = _mm_set1_pd(1.0 / count);
+
+  int col = begin;
+  for(; col + 8 <= end; col += 8) {
+    const __m128i sumsLo = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (prefix + col + radius + 1)),
+                                         _mm_loadu_si128((const __m128i*) (prefix + col - radius)));
+    const __m128i sumsHi = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (prefix + col + radius + 5)),
+                                         _mm_loadu_si128((const __m128i*) (prefix + col - radius + 4)));
+    _mm_storeu_si128((__m128i*) (out + col), _mm_packus_epi32(div_count_4(sumsLo, reciprocal),
+                                                              div_count_4(sumsHi, reciprocal)));
+  }
+  box_mean_interior_scalar(prefix, col, end, radius, count, out);
+}
+
+__attribute__((target("avx2")))
+static void add_row_avx2(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  int col = 0;
+  for(; col + 16 <= width; col += 16) {
+    const __m256i px = _mm256_loadu_si256((const __m256i*) (row + col));
+    __m256i *sums = (__m256i*) (col_sums + col);
+    _mm256_storeu_si256(sums,     _mm256_add_epi32(_mm256_loadu_si256(sums),     _mm256_cvtepu16_epi32(_mm256_castsi256_si128(px))));
+    _mm256_storeu_si256(sums + 1, _mm256_add_epi32(_mm256_loadu_si256(sums + 1), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(px, 1))));
+  }
+  add_row_scalar(col_sums + col, row + col, width - col);
+}
+
+__attribute__((target("avx2")))
+static void sub_row_avx2(uint32_t *col_sums, uint16_t const *row, int width)
+{
+  int col = 0;
+  for(; col + 16 <= width; col += 16) {
+    const __m256i px = _mm256_loadu_si256((const __m256i*) (row + col));
+    __m256i *sums = (__m256i*) (col_sums + col);
+    _mm256_storeu_si256(sums,     _mm256_sub_epi32(_mm256_loadu_si256(sums),     _mm256_cvtepu16_epi32(_mm256_castsi256_si128(px))));
+    _mm256_storeu_si256(sums + 1, _mm256_sub_epi32(_mm256_loadu_si256(sums + 1), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(px, 1))));
+  }
+  sub_row_scalar(col_sums + col, row + col, width - col);
+}
+
+/// Eight unsigned sums divided by the count, as int32
+__attribute__((target("avx2")))
+static inline __m256i div_count_8(__m256i sums, __m256d reciprocal)
+{
+  const __m256i shifted = _mm256_xor_si256(sums, _mm256_set1_epi32((int) 0x80000000u));
+  const __m256d offset = _mm256_set1_pd(2147483648.0 + 0.5);
+  const __m256d lo = _mm256_add_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(shifted)), offset);
+  const __m256d hi = _mm256_add_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(shifted, 1)), offset);
+  return _mm256_set_m128i(_mm256_cvttpd_epi32(_mm256_mul_pd(hi, reciprocal)),
+                          _mm256_cvttpd_epi32(_mm256_mul_pd(lo, reciprocal)));
+}
+
+__attribute__((target("avx2")))
+static void box_mean_interior_avx2(uint32_t const *prefix, int begin, int end, int radius, uint32_t count, uint16_t *out)
+{
+  const __m256d reciprocal = _mm256_set1_pd(1.0 / count);
+
+  int col = begin;
+  for(; col + 16 <= end; col += 16) {
+    const __m256i sumsLo = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (prefix + col + radius + 1)),
+                                            _mm256_loadu_si256((const __m256i*) (prefix + col - radius)));
+    const __m256i sumsHi = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (prefix + col + radius + 9)),
+                                            _mm256_loadu_si256((const __m256i*) (prefix + col - radius + 8)));
+    const __m256i means = _mm256_packus_epi32(div_count_8(sumsLo, reciprocal), div_count_8(sumsHi, reciprocal));
+    _mm256_storeu_si256((__m256i*) (out + col), _mm256_permute4x64_epi64(means, 0xD8));
+  }
+  box_mean_interior_scalar(prefix, col, end, radius, count, out);
+}
+
+#endif
+
+
+void add_row(uint32_t *col_sums, uint16_t const *row, int width)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    case simd_avx2:  add_row_avx2(col_sums, row, width); return;
+    case simd_sse41: add_row_sse41(col_sums, row, width); return;
+    default:         break;
+  }
+#endif
+  add_row_scalar(col_sums, row, width);
+}
+
+void sub_row(uint32_t *col_sums, uint16_t const *row, int width)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    case simd_avx2:  sub_row_avx2(col_sums, row, width); return;
+    case simd_sse41: sub_row_sse41(col_sums, row, width); return;
+    default:         break;
+  }
+#endif
+  sub_row_scalar(col_sums, row, width);
+}
+
+void box_mean_row(uint32_t const *col_sums, int width, int radius, int rows, uint32_t *prefix, uint16_t *out)
+{
+  if(rows <= 0) {
+    std::fill(out, out + width, 0);
+    return;
+  }
+
+  // prefix[col] is the sum of the columns before col, column 0 is left out
+  prefix[0] = 0;
+  if(width > 0) {
+    prefix[1] = 0;
+  }
+  for(int col = 1; col < width; col++) {
+    prefix[col + 1] = prefix[col] + col_sums[col];
+  }
+
+  // the window is cut at column 1 on the left and the last column on the right
+  const int begin = std::min(radius + 1, width);
+  const int end = std::max(width - radius, begin);
+  for(int col = 0; col < begin; col++) {
+    out[col] = box_mean_border(prefix, width, col, radius, rows);
+  }
+  for(int col = end; col < width; col++) {
+    out[col] = box_mean_border(prefix, width, col, radius, rows);
+  }
+
+  const uint32_t count = (uint32_t) rows * (2*radius + 1);
+#ifdef IMG_KERNELS_X86
+  if(count < max_reciprocal_count) {
+    switch(active_simd_level()){
+      case simd_avx2:  box_mean_interior_avx2(prefix, begin, end, radius, count, out); return;
+      case simd_sse41: box_mean_interior_sse41(prefix, begin, end, radius, count, out); return;
+      default:         break;
+    }
+  }
+#endif
+  box_mean_interior_scalar(prefix, begin, end, radius, count, out);
+}
+
+
+static int local_max_row_scalar(uint16_t const *const *rows, int begin, int end, uint16_t threshold, int *cols)
+{
+  uint16_t const *above = rows[0];
+  uint16_t const *row = rows[1];
+  uint16_t const *below = rows[2];
+
+  int found = 0;
+  for(int col = begin; col < end; col++) {
+    const uint16_t mid = row[col];
+    if(mid < threshold || mid <= above[col] || mid <= row[col-1]) {
+      continue;
+    }
+    if(mid >= above[col-1] && mid >= above[col+1] && mid >= row[col+1] &&
+       mid >= below[col-1] && mid >= below[col] && mid >= below[col+1]) {
+      cols[found++] = col;
+    }
+  }
+  return found;
+}
+
+/*
+  The vector versions fold the threshold into the maximum of the eight
+  neighbours: a pixel counts if it equals the maximum of itself and that.
+  The compare mask has two bits per pixel, found pixels are rare so the
+  bits are walked one by one.
+*/
+
+#ifdef IMG_KERNELS_X86
+
+__attribute__((target("sse4.1")))
+static int local_max_row_sse41(uint16_t const *const *rows, int begin, int end, uint16_t threshold, int *cols)
+{
+  uint16_t const *above = rows[0];
+  uint16_t const *row = rows[1];
+  uint16_t const *below = rows[2];
+  const __m128i minimum = _mm_set1_epi16((short) threshold);
+
+  int found = 0;
+  int col = begin;
+  for(; col + 8 <= end; col += 8) {
+    const __m128i mid  = _mm_loadu_si128((const __m128i*) (row + col));
+    const __m128i top  = _mm_loadu_si128((const __m128i*) (above + col));
+    const __m128i left = _mm_loadu_si128((const __m128i*) (row + col - 1));
+
+    __m128i peak = _mm_max_epu16(minimum, top);
+    peak = _mm_max_epu16(peak, left);
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (above + col - 1)));
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (above + col + 1)));
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (row + col + 1)));
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (below + col - 1)));
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (below + col)));
+    peak = _mm_max_epu16(peak, _mm_loadu_si128((const __m128i*) (below + col + 1)));
+
+    const __m128i isPeak = _mm_cmpeq_epi16(_mm_max_epu16(mid, peak), mid);
+    const __m128i isTie = _mm_or_si128(_mm_cmpeq_epi16(mid, top), _mm_cmpeq_epi16(mid, left));
+    unsigned mask = (unsigned) _mm_movemask_epi8(_mm_andnot_si128(isTie, isPeak));
+
+    while(mask) {
+      cols[found++] = col + (__builtin_ctz(mask) >> 1);
+      mask &= mask - 1;
+      mask &= mask - 1;
+    }
+  }
+
+  uint16_t const *rest[3] = {above, row, below};
+  return found + local_max_row_scalar(rest, col, end, threshold, cols + found);
+}
+
+__attribute__((target("avx2")))
+static int local_max_row_avx2(uint16_t const *const *rows, int begin, int end, uint16_t threshold, int *cols)
+{
+  uint16_t const *above = rows[0];
+  uint16_t const *row = rows[1];
+  uint16_t const *below = rows[2];
+  const __m256i minimum = _mm256_set1_epi16((short) threshold);
+
+  int found = 0;
+  int col = begin;
+  for(; col + 16 <= end; col += 16) {
+    const __m256i mid  = _mm256_loadu_si256((const __m256i*) (row + col));
+    const __m256i top  = _mm256_loadu_si256((const __m256i*) (above + col));
+    const __m256i left = _mm256_loadu_si256((const __m256i*) (row + col - 1));
+
+    __m256i peak = _mm256_max_epu16(minimum, top);
+    peak = _mm256_max_epu16(peak, left);
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (above + col - 1)));
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (above + col + 1)));
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (row + col + 1)));
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (below + col - 1)));
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (below + col)));
+    peak = _mm256_max_epu16(peak, _mm256_loadu_si256((const __m256i*) (below + col + 1)));
+
+    const __m256i isPeak = _mm256_cmpeq_epi16(_mm256_max_epu16(mid, peak), mid);
+    const __m256i isTie = _mm256_or_si256(_mm256_cmpeq_epi16(mid, top), _mm256_cmpeq_epi16(mid, left));
+    unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_andnot_si256(isTie, isPeak));
+
+    while(mask) {
+      cols[found++] = col + (__builtin_ctz(mask) >> 1);
+      mask &= mask - 1;
+      mask &= mask - 1;
+    }
+  }
+
+  uint16_t const *rest[3] = {above, row, below};
+  return found + local_max_row_scalar(rest, col, end, threshold, cols + found);
+}
+
+#endif
+
+
+int local_max_row(uint16_t const *const *rows, int begin, int end, uint16_t threshold, int *cols)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    case simd_avx2:  return local_max_row_avx2(rows, begin, end, threshold, cols);
+    case simd_sse41: return local_max_row_sse41(rows, begin, end, threshold, cols);
+    default:         break;
+  }
+#endif
+  return local_max_row_scalar(rows, begin, end, threshold, cols);
+}
+
+
+/*
+  Spot sums add up every pixel into the sums of its column and of its row,
+  for the values and for the count of pixels above 0. The column and row
+  sums are weighted with their index at the end, so a block needs no
+  multiply per pixel. All sums are exact in 32 bits, for the biggest spot
+  11 columns of up to 11 pixels of at most 65535 weighted with at most 100.
+  The versions are templates on the spot size, so all loops have fixed
+  bounds.
+*/
+
+static const int spot_fields = sizeof(spot_sums)/sizeof(int32_t);
+
+template <int Size>
+static void spot_sums_scalar(uint16_t const *pixels, int lane, spot_sums & sums)
+{
+  int32_t col_q[Size] = {0};
+  int32_t col_n[Size] = {0};
+  sums = spot_sums();
+
+  for(int y = 0; y < Size; y++) {
+    int32_t row_q = 0;
+    int32_t row_n = 0;
+    for(int x = 0; x < Size; x++) {
+      const int32_t value = pixels[(y*Size + x)*spot_lanes + lane];
+      const int32_t above = (value > 0);
+      row_q += value;
+      row_n += above;
+      col_q[x] += value;
+      col_n[x] += above;
+      sums.q_max = std::max(sums.q_max, value);
+    }
+    sums.q  += row_q;
+    sums.n  += row_n;
+    sums.my += y*row_q;
+    sums.sy += y*y*row_q;
+    sums.y  += y*row_n;
+    sums.y2 += y*y*row_n;
+  }
+
+  for(int x = 0; x < Size; x++) {
+    sums.mx += x*col_q[x];
+    sums.sx += x*x*col_q[x];
+    sums.x  += x*col_n[x];
+    sums.x2 += x*x*col_n[x];
+  }
+}
+
+#ifdef IMG_KERNELS_X86
+
+/// Copy the sums of the lanes to the spots, the last block may hold fewer spots than lanes
+static inline void store_spot_sums(int32_t const (*lanes)[spot_lanes], int count, spot_sums *sums)
+{
+  for(int lane = 0; lane < count; lane++) {
+    spot_sums & spot = sums[lane];
+    spot.n     = lanes[0][lane];
+    spot.x     = lanes[1][lane];
+    spot.y     = lanes[2][lane];
+    spot.x2    = lanes[3][lane];
+    spot.y2    = lanes[4][lane];
+    spot.q     = lanes[5][lane];
+    spot.q_max = lanes[6][lane];
+    spot.mx    = lanes[7][lane];
+    spot.my    = lanes[8][lane];
+    spot.sx    = lanes[9][lane];
+    spot.sy    = lanes[10][lane];
+  }
+}
+
+/// Sums of the four spots from the given lane on
+template <int Size>
+__attribute__((target("sse4.1")))
+static void spot_sums_4_sse41(uint16_t const *pixels, int lane, int32_t (*lanes)[spot_lanes])
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i col_q[Size];
+  __m128i col_n[Size];
+  for(int x = 0; x < Size; x++) {
+    col_q[x] = zero;
+    col_n[x] = zero;
+  }
+
+  __m128i n = zero, y_sum = zero, y2 = zero, q = zero, q_max = zero, my = zero, sy = zero;
+  for(int y = 0; y < Size; y++) {
+    __m128i row_q = zero;
+    __m128i row_n = zero;
+    for(int x = 0; x < Size; x++) {
+      const __m128i value = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*) (pixels + (y*Size + x)*spot_lanes + lane)));
+      const __m128i above = _mm_cmpgt_epi32(value, zero);
+      row_q = _mm_add_epi32(row_q, value);
+      row_n = _mm_sub_epi32(row_n, above);
+      col_q[x] = _mm_add_epi32(col_q[x], value);
+      col_n[x] = _mm_sub_epi32(col_n[x], above);
+      q_max = _mm_max_epi32(q_max, value);
+    }
+    const __m128i weight = _mm_set1_epi32(y);
+    const __m128i weight2 = _mm_set1_epi32(y*y);
+    q = _mm_add_epi32(q, row_q);
+    n = _mm_add_epi32(n, row_n);
+    my = _mm_add_epi32(my, _mm_mullo_epi32(weight, row_q));
+    sy = _mm_add_epi32(sy, _mm_mullo_epi32(weight2, row_q));
+    y_sum = _mm_add_epi32(y_sum, _mm_mullo_epi32(weight, row_n));
+    y2 = _mm_add_epi32(y2, _mm_mullo_epi32(weight2, row_n));
+  }
+
+  __m128i x_sum = zero, x2 = zero, mx = zero, sx = zero;
+  for(int x = 0; x < Size; x++) {
+    const __m128i weight = _mm_set1_epi32(x);
+    const __m128i weight2 = _mm_set1_epi32(x*x);
+    mx = _mm_add_epi32(mx, _mm_mullo_epi32(weight, col_q[x]));
+    sx = _mm_add_epi32(sx, _mm_mullo_epi32(weight2, col_q[x]));
+    x_sum = _mm_add_epi32(x_sum, _mm_mullo_epi32(weight, col_n[x]));
+    x2 = _mm_add_epi32(x2, _mm_mullo_epi32(weight2, col_n[x]));
+  }
+
+  const __m128i fields[] = {n, x_sum, y_sum, x2, y2, q, q_max, mx, my, sx, sy};
+  for(int field = 0; field < spot_fields; field++) {
+    _mm_storeu_si128((__m128i*) (lanes[field] + lane), fields[field]);
+  }
+}
+
+template <int Size>
+__attribute__((target("sse4.1")))
+static void spot_sums_block_sse41(uint16_t const *pixels, int count, spot_sums *sums)
+{
+  int32_t lanes[spot_fields][spot_lanes];
+  for(int first = 0; first < count; first += spot_lanes) {
+    spot_sums_4_sse41<Size>(pixels, 0, lanes);
+    spot_sums_4_sse41<Size>(pixels, 4, lanes);
+    store_spot_sums(lanes, std::min<int>(spot_lanes, count - first), sums + first);
+    pixels += Size*Size*spot_lanes;
+  }
+}
+
+template <int Size>
+__attribute__((target("avx2")))
+static void spot_sums_block_avx2(uint16_t const *pixels, int count, spot_sums *sums)
+{
+  int32_t lanes[spot_fields][spot_lanes];
+  const __m256i zero = _mm256_setzero_si256();
+
+  for(int first = 0; first < count; first += spot_lanes) {
+    __m256i col_q[Size];
+    __m256i col_n[Size];
+    for(int x = 0; x < Size; x++) {
+      col_q[x] = zero;
+      col_n[x] = zero;
+    }
+
+    __m256i n = zero, y_sum = zero, y2 = zero, q = zero, q_max = zero, my = zero, sy = zero;
+    for(int y = 0; y < Size; y++) {
+      __m256i row_q = zero;
+      __m256i row_n = zero;
+      for(int x = 0; x < Size; x++) {
+        const __m256i value = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (pixels + (y*Size + x)*spot_lanes)));
+        const __m256i above = _mm256_cmpgt_epi32(value, zero);
+        row_q = _mm256_add_epi32(row_q, value);
+        row_n = _mm256_sub_epi32(row_n, above);
+        col_q[x] = _mm256_add_epi32(col_q[x], value);
+        col_n[x] = _mm256_sub_epi32(col_n[x], above);
+        q_max = _mm256_max_epi32(q_max, value);
+      }
+      const __m256i weight = _mm256_set1_epi32(y);
+      const __m256i weight2 = _mm256_set1_epi32(y*y);
+      q = _mm256_add_epi32(q, row_q);
+      n = _mm256_add_epi32(n, row_n);
+      my = _mm256_add_epi32(my, _mm256_mullo_epi32(weight, row_q));
+      sy = _mm256_add_epi32(sy, _mm256_mullo_epi32(weight2, row_q));
+      y_sum = _mm256_add_epi32(y_sum, _mm256_mullo_epi32(weight, row_n));
+      y2 = _mm256_add_epi32(y2, _mm256_mullo_epi32(weight2, row_n));
+    }
+
+    __m256i x_sum = zero, x2 = zero, mx = zero, sx = zero;
+    for(int x = 0; x < Size; x++) {
+      const __m256i weight = _mm256_set1_epi32(x);
+      const __m256i weight2 = _mm256_set1_epi32(x*x);
+      mx = _mm256_add_epi32(mx, _mm256_mullo_epi32(weight, col_q[x]));
+      sx = _mm256_add_epi32(sx, _mm256_mullo_epi32(weight2, col_q[x]));
+      x_sum = _mm256_add_epi32(x_sum, _mm256_mullo_epi32(weight, col_n[x]));
+      x2 = _mm256_add_epi32(x2, _mm256_mullo_epi32(weight2, col_n[x]));
+    }
+
+    const __m256i fields[] = {n, x_sum, y_sum, x2, y2, q, q_max, mx, my, sx, sy};
+    for(int field = 0; field < spot_fields; field++) {
+      _mm256_storeu_si256((__m256i*) lanes[field], fields[field]);
+    }
+    store_spot_sums(lanes, std::min<int>(spot_lanes, count - first), sums + first);
+    pixels += Size*Size*spot_lanes;
+  }
+}
+
+#endif
+
+
+template <int Size>
+static void spot_sums_block_fixed(uint16_t const *pixels, int count, spot_sums *sums)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    case simd_avx2:  spot_sums_block_avx2<Size>(pixels, count, sums); return;
+    case simd_sse41: spot_sums_block_sse41<Size>(pixels, count, sums); return;
+    default:         break;
+  }
+#endif
+  for(int spot = 0; spot < count; spot++) {
+    spot_sums_scalar<Size>(pixels + (spot/spot_lanes)*Size*Size*spot_lanes, spot%spot_lanes, sums[spot]);
+  }
+}
+
+bool spot_size_supported(int size)
+{
+  return size == 5 || size == 7 || size == 9 || size == 11;
+}
+
+void spot_sums_block(uint16_t const *pixels, int size, int count, spot_sums *sums)
+{
+  switch(size){
+    case 5:  spot_sums_block_fixed<5>(pixels, count, sums);  break;
+    case 7:  spot_sums_block_fixed<7>(pixels, count, sums);  break;
+    case 9:  spot_sums_block_fixed<9>(pixels, count, sums);  break;
+    case 11: spot_sums_block_fixed<11>(pixels, count, sums); break;
+  }
+}
+
+
+/*
+  Cutting the edges of a spot compares pixels with their neighbour towards
+  the middle, in the order Roi::cutEdges() takes them: every row, then
+  every column, then every row again, leaving out the middle three. A
+  pixel can be compared with a neighbour that was cut just before, so the
+  pairs are kept in a table in that order and every version goes through
+  it for spot_lanes spots at once; there are no branches on the pixels.
+
+  A pixel is cut if value + noise > comp with noise = isqrt(comp), at
+  least 3, and 0 for comp = 0. Since value >= 0 this is value > limit with
+  limit = comp - noise, 0 if below: a pixel is kept iff it is at most its
+  limit. The scalar version looks up the noise, the vector one takes the
+  square root in single precision, which truncates to the same integer
+  for every 16 bit value.
+*/
+
+/// The pixel pairs of the three passes of Roi::cutEdges(), in its order
+template <int Size>
+struct cut_order{
+  enum { pairs = 3*Size*(Size-3) };
+  uint8_t pixel[pairs];   ///< pixel that may be cut
+  uint8_t comp[pairs];    ///< its neighbour towards the middle
+
+  cut_order()
+  {
+    int i = 0;
+    add_rows(i);
+    add_columns(i);
+    add_rows(i);
+  }
+
+  static cut_order const& get()
+  {
+    static const cut_order order;
+    return order;
+  }
+
+private:
+  void add(int &i, int p, int c)
+  {
+    pixel[i] = p;
+    comp[i] = c;
+    i++;
+  }
+
+  void add_rows(int &i)
+  {
+    const int mid = (Size-1)/2;
+    for(int y = 0; y < Size; y++) {
+      for(int x = 0; x < mid-1; x++) {
+        add(i, y*Size + x, y*Size + x+1);
+      }
+      for(int x = mid+2; x < Size; x++) {
+        add(i, y*Size + x, y*Size + x-1);
+      }
+    }
+  }
+
+  void add_columns(int &i)
+  {
+    const int mid = (Size-1)/2;
+    for(int y = 0; y < mid-1; y++) {
+      for(int x = 0; x < Size; x++) {
+        add(i, y*Size + x, (y+1)*Size + x);
+      }
+    }
+    for(int y = mid+2; y < Size; y++) {
+      for(int x = 0; x < Size; x++) {
+        add(i, y*Size + x, (y-1)*Size + x);
+      }
+    }
+  }
+};
+
+/// Noise of every 16 bit value the way Roi::cutEdges() takes it
+static uint8_t const *cut_noise_table()
+{
+  static uint8_t table[1 << 16];
+  static const bool filled = [](){
+    for(int comp = 0; comp < (1 << 16); comp++) {
+      table[comp] = (comp == 0)? 0 : (comp < 16)? 3 : (int) std::sqrt((double) comp);
+    }
+    return true;
+  }();
+  (void) filled;
+  return table;
+}
+
+template <int Size>
+static void spot_cut_edges_scalar(uint16_t *pixels, int32_t *sums)
+{
+  cut_order<Size> const& order = cut_order<Size>::get();
+  uint8_t const *noise = cut_noise_table();
+
+  for(int i = 0; i < order.pairs; i++) {
+    uint16_t *value = pixels + order.pixel[i]*spot_lanes;
+    uint16_t const *comp = pixels + order.comp[i]*spot_lanes;
+    for(int lane = 0; lane < spot_lanes; lane++) {
+      const int limit = std::max(comp[lane] - noise[comp[lane]], 0);
+      value[lane] = (value[lane] <= limit)? value[lane] : 0;
+    }
+  }
+
+  for(int lane = 0; lane < spot_lanes; lane++) {
+    sums[lane] = 0;
+  }
+  for(int p = 0; p < Size*Size; p++) {
+    for(int lane = 0; lane < spot_lanes; lane++) {
+      sums[lane] += pixels[p*spot_lanes + lane];
+    }
+  }
+}
+
+#ifdef IMG_KERNELS_X86
+
+/// The pixels of comp's eight lanes may keep, comp less its noise
+__attribute__((target("sse4.1")))
+static inline __m128i cut_limit_sse41(__m128i comp)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 root_lo = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(comp, zero)));
+  const __m128 root_hi = _mm_sqrt_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(comp, zero)));
+  const __m128i root = _mm_packus_epi32(_mm_cvttps_epi32(root_lo), _mm_cvttps_epi32(root_hi));
+  // isqrt is below 3 only for comp < 16, and a limit below 0 cuts every pixel
+  return _mm_subs_epu16(comp, _mm_max_epu16(root, _mm_set1_epi16(3)));
+}
+
+/// Sums of the eight lanes of the spot_lanes spots of a cut block
+__attribute__((target("sse4.1")))
+static inline void store_cut_sums_sse41(uint16_t const *pixels, int pixel_count, int32_t *sums)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum_lo = zero, sum_hi = zero;
+  for(int p = 0; p < pixel_count; p++) {
+    const __m128i value = _mm_loadu_si128((const __m128i*) (pixels + p*spot_lanes));
+    sum_lo = _mm_add_epi32(sum_lo, _mm_unpacklo_epi16(value, zero));
+    sum_hi = _mm_add_epi32(sum_hi, _mm_unpackhi_epi16(value, zero));
+  }
+  _mm_storeu_si128((__m128i*) sums, sum_lo);
+  _mm_storeu_si128((__m128i*) (sums + 4), sum_hi);
+}
+
+template <int Size>
+__attribute__((target("sse4.1")))
+static void spot_cut_edges_sse41(uint16_t *pixels, int32_t *sums)
+{
+  cut_order<Size> const& order = cut_order<Size>::get();
+
+  for(int i = 0; i < order.pairs; i++) {
+    __m128i *value = (__m128i*) (pixels + order.pixel[i]*spot_lanes);
+    const __m128i pixel = _mm_loadu_si128(value);
+    const __m128i limit = cut_limit_sse41(_mm_loadu_si128((const __m128i*) (pixels + order.comp[i]*spot_lanes)));
+    const __m128i keep = _mm_cmpeq_epi16(_mm_min_epu16(pixel, limit), pixel);
+    _mm_storeu_si128(value, _mm_and_si128(pixel, keep));
+  }
+
+  store_cut_sums_sse41(pixels, Size*Size, sums);
+}
+
+#endif
+
+template <int Size>
+static void spot_cut_edges_fixed(uint16_t *pixels, int32_t *sums)
+{
+#ifdef IMG_KERNELS_X86
+  switch(active_simd_level()){
+    // wider vectors do not help, every pass follows the pixels cut before
+    case simd_avx2:
+    case simd_sse41: spot_cut_edges_sse41<Size>(pixels, sums); return;
+    default:         break;
+  }
+#endif
+  spot_cut_edges_scalar<Size>(pixels, sums);
+}
+
+void spot_cut_edges_block(uint16_t *pixels, int size, int32_t *sums)
+{
+  switch(size){
+    case 5:  spot_cut_edges_fixed<5>(pixels, sums);  break;
+    case 7:  spot_cut_edges_fixed<7>(pixels, sums);  break;
+    case 9:  spot_cut_edges_fixed<9>(pixels, sums);  break;
+    case 11: spot_cut_edges_fixed<11>(pixels, sums); break;
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef IMG_KERNELS_HPP
+#define IMG_KERNELS_HPP
+
+#include <stdint.h>
+
+/// Kernels behind image16_ref and Roi, with SSE4.1 and AVX2 versions picked at runtime
+/** Every kernel uses the widest instruction set the CPU supports, up to the
+    limit set with limit_simd_level(). Every version gives bit-identical
+    results to the scalar one.
+**/
+enum simd_level { simd_scalar = 0, simd_sse41 = 1, simd_avx2 = 2 };
+
+simd_level cpu_simd_level();
+simd_level active_simd_level();
+void limit_simd_level(simd_level level);
+const char *simd_level_name(simd_level level);
+
+/// Subtract the background from a row and update the background
+/** @return sum of the pixel values before the subtraction, wraps like an int sum
+**/
+uint32_t subtr_and_update_bg_row(uint16_t *img, uint16_t *bg, int width, float img_weight);
+
+/// Add the pixels of a row to the column sums
+void add_row(uint32_t *col_sums, uint16_t const *row, int width);
+
+/// Subtract the pixels of a row from the column sums
+void sub_row(uint32_t *col_sums, uint16_t const *row, int width);
+
+/// Mean over the window around each pixel of a row, from the column sums of the window's rows
+/** Like image16_ref::sum_halo the window leaves out column 0.
+    @param col_sums width sums of the same rows
+    @param radius The window spans 2*radius+1 columns, cut at the border
+    @param rows Number of rows in the column sums
+    @param prefix Scratch space for width+1 values
+    @param out Receives the width means
+**/
+void box_mean_row(uint32_t const *col_sums, int width, int radius, int rows, uint32_t *prefix, uint16_t *out);
+
+/// Columns of the middle row that are a local maximum of the three rows
+/** A pixel counts if it reaches the threshold and no neighbour is bigger.
+    Ties with the top or the left neighbour do not count, so of two equal
+    pixels next to each other in a row or a column only one can be taken.
+    @param rows The row above, the row itself and the row below
+    @param begin First column to test, at least 1
+    @param end Column after the last one to test, at most the width - 1
+    @param cols Receives the columns in increasing order, needs room for end-begin
+    @return Number of columns found
+**/
+int local_max_row(uint16_t const *const *rows, int begin, int end, uint16_t threshold, int *cols);
+
+enum { spot_lanes = 8, spot_max_size = 11 };
+
+/// Integer sums over the pixels of a spot that Roi::calc() takes its moments from
+struct spot_sums{
+  int32_t n;      ///< pixels above 0
+  int32_t x;      ///< sum of their columns
+  int32_t y;      ///< sum of their rows
+  int32_t x2;     ///< sum of their squared columns
+  int32_t y2;     ///< sum of their squared rows
+  int32_t q;      ///< sum of the pixel values
+  int32_t q_max;  ///< biggest pixel value
+  int32_t mx;     ///< pixel values times their column
+  int32_t my;     ///< pixel values times their row
+  int32_t sx;     ///< pixel values times their squared column
+  int32_t sy;     ///< pixel values times their squared row
+};
+
+/// Spot sizes spot_sums_block() has a version for: 5, 7, 9 and 11
+bool spot_size_supported(int size);
+
+/// Sums of count spots of size x size pixels, spot_lanes spots side by side
+/** The sums are exact, every version gives the same.
+    @param pixels Blocks of spot_lanes spots, pixel i of a spot, row by row,
+           is at i*spot_lanes + the spot's lane. Lanes after the last spot
+           must hold valid pixels, their sums are dropped.
+    @param size Side of the spots, one spot_size_supported() accepts
+    @param sums Receives count sums
+**/
+void spot_sums_block(uint16_t const *pixels, int size, int count, spot_sums *sums);
+
+/// Cut the edges of spot_lanes spots side by side the way Roi::cutEdges() does
+/** Every version cuts the same pixels as Roi::cutEdges(), without branches.
+    @param pixels One block of spots laid out like for spot_sums_block(), cut in place
+    @param size Side of the spots, one spot_size_supported() accepts
+    @param sums Receives the sum of the pixels left of every spot
+**/
+void spot_cut_edges_block(uint16_t *pixels, int size, int32_t *sums);
+
+#endif
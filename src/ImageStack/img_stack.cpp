@@ -1,12 +1,21 @@
 #include <QDebug>
 #include <QString>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QXmlStreamReader>
 
 #include <iostream>
 #include <algorithm>
 #include <string>   // memset
 #include <cassert>
 #include <cmath>
+#include <mutex>
+#include <vector>
 
+#include "img_kernels.hpp"
 #include "img_stack.hpp"
 
 
@@ -21,10 +30,13 @@ class img_file_accessor
     virtual bool good() = 0;
     virtual std::string const& get_mode() = 0;
     virtual std::string const& get_path() = 0;
+    virtual std::vector<std::string> get_files() { return std::vector<std::string>(1, get_path()); }
     
     virtual int img_count() = 0;
+    virtual int refresh() { return img_count(); }
 
     virtual image16_ref get_image(int img) = 0;
+    virtual void read_image(int img, image16_ref &image) { image.copy_from(get_image(img)); }
     virtual void append_image(image16_ref const& image) = 0;
     virtual void append_as_8bit_image(image16_ref const& image, int shift = 0) = 0;
     virtual void append_new_16bit_image(uint16_t * data, int width, int length) = 0;
@@ -43,24 +55,208 @@ class tiff_file_accessor : public img_file_accessor
     bool writeable();
     std::string const& get_mode();
     std::string const& get_path();
+    std::string get_description();
     
     int img_count();
+    int refresh();
 
     image16_ref get_image(int img);
+    void read_image(int img, image16_ref &image);
     void append_image(image16_ref const& image);
     void append_as_8bit_image(image16_ref const& image, int shift = 0);
  	void append_new_16bit_image(uint16_t * data, int width, int length);
 
+  protected:
+    bool set_directory(int img);
+
   private:
     static void TIFFWarningHandler(const char* module, const char* fmt, va_list ap);
+
+    void index_directories();
+    bool load_index(QString const& index_path, quint64 stack_size, qint64 modified);
+    void save_index(QString const& index_path, quint64 stack_size, qint64 modified);
   
+  protected:
     TIFF *tiff_;              ///< tiff file handle
     std::string path_;        ///< path of the tiff file
     std::string mode_;        ///< opening mode of the tiff file
     bool good_;               ///< indicated wether tiff file could be opened
+    std::vector<toff_t> dir_offsets_; ///< file offset of every directory, only built for reading
+};
+
+
+/// tiff file that frames are mapped from, shared by the accessor and all mapped frames
+struct mapped_tiff_file
+{
+  QFile file;               ///< stays open as long as frames are mapped from it
+  std::mutex mutex;         ///< QFile keeps its maps in a table that is not thread safe
+};
+
+
+/// one frame mapped from a tiff file, unmapped when the last image referencing it is destructed
+struct mapped_tiff_frame
+{
+  mapped_tiff_frame(std::shared_ptr<mapped_tiff_file> const& file, uchar *pixels)
+    : file_(file), pixels_(pixels) {}
+
+  ~mapped_tiff_frame()
+  {
+    std::lock_guard<std::mutex> lock(file_->mutex);
+    file_->file.unmap(pixels_);
+  }
+
+  std::shared_ptr<mapped_tiff_file> file_;  ///< keeps the file open
+  uchar *pixels_;                           ///< start of the mapped frame
+};
+
+
+/// read-only accessor for TIFF containers that hands out frames without copying them
+/** The strip offsets of a frame are resolved once, the first time it is requested.
+    Uncompressed 16 bit frames are mapped copy-on-write straight from the file,
+    so the images can still be modified in place. Frames that can not be mapped
+    (compressed, byte swapped, scattered strips) are read through libtiff.
+**/
+class mapped_tiff_file_accessor : public tiff_file_accessor
+{
+  public:
+    mapped_tiff_file_accessor(std::string path);
+
+    int refresh();
+
+    image16_ref get_image(int img);
+    void read_image(int img, image16_ref &image);
+
+  private:
+    /// position of a frame in the file
+    struct frame_layout
+    {
+      frame_layout() : offset(0), length(0), width(0), bits_per_pixel(0),
+                       resolved(false), mappable(false) {}
+
+      toff_t offset;          ///< file offset of the first row
+      uint32 length;          ///< length of the frame in pixels
+      uint32 width;           ///< width of the frame in pixels
+      uint16 bits_per_pixel;  ///< range of a pixel value in bits
+      bool resolved;          ///< the fields above are valid
+      bool mappable;          ///< false if the frame has to be read through libtiff
+    };
+
+    frame_layout const& resolve_frame(int img);
+
+    std::shared_ptr<mapped_tiff_file> file_;  ///< null if the file could not be mapped
+    std::vector<frame_layout> frames_;        ///< layout of every frame in the container
+    qint64 file_size_;                        ///< size of the mapped file
+    bool native_order_;                       ///< pixels are stored in host byte order
+};
+
+
+/// read-only accessor for OME-TIFF series that are split across several files
+/** The planes of the first image in the OME-XML of the opened file are read,
+    ordered by channel, time and z, from the files they are stored in. Every file
+    is opened once and streamed from, nothing is copied into a joined stack.
+    Files without a multi-file series are read as a single stack.
+**/
+class ome_tiff_series_accessor : public img_file_accessor
+{
+  public:
+    ome_tiff_series_accessor(std::string path);
+    ~ome_tiff_series_accessor();
+
+    bool good();
+    bool writeable();
+    std::string const& get_mode();
+    std::string const& get_path();
+    std::vector<std::string> get_files();
+
+    int img_count();
+
+    image16_ref get_image(int img);
+    void read_image(int img, image16_ref &image);
+    void append_image(image16_ref const& image);
+    void append_as_8bit_image(image16_ref const& image, int shift = 0);
+    void append_new_16bit_image(uint16_t * data, int width, int length);
+
+  private:
+    /// planes that are stored in consecutive directories of one file
+    struct plane_block
+    {
+      int file;         ///< index into files_
+      int first_dir;    ///< directory of the first plane in its file
+      int count;        ///< number of planes in the block
+      int first_plane;  ///< number of the first plane in the series
+    };
+
+    bool read_series(std::string const& description);
+    int open_file(std::string const& name);
+    void append_block(int file, int first_dir, int count);
+    plane_block const& find_block(int img);
+
+    std::vector<tiff_file_accessor*> files_;  ///< files of the series, the opened file first
+    std::vector<plane_block> blocks_;         ///< planes of the series in reading order
+    std::string path_;                        ///< path of the opened file
+    std::string mode_;                        ///< always "r"
+    int plane_count_;                         ///< number of planes in the series
+};
+
+
+/// read-only accessor for a directory of single-frame TIFF files
+/** The files are read in name order. refresh() picks up files added since the
+    last scan. A file is taken once a later file exists or it has not been
+    modified for a second, so frames that are still being written are skipped.
+**/
+class tiff_directory_accessor : public img_file_accessor
+{
+  public:
+    tiff_directory_accessor(std::string path);
+
+    bool good();
+    bool writeable();
+    std::string const& get_mode();
+    std::string const& get_path();
+    std::vector<std::string> get_files();
+
+    int img_count();
+    int refresh();
+
+    image16_ref get_image(int img);
+    void read_image(int img, image16_ref &image);
+    void append_image(image16_ref const& image);
+    void append_as_8bit_image(image16_ref const& image, int shift = 0);
+    void append_new_16bit_image(uint16_t * data, int width, int length);
+
+  private:
+    std::vector<std::string> files_;  ///< complete frame files in reading order
+    std::string path_;                ///< path of the directory
+    std::string mode_;                ///< always "r"
 };
 
 
+/// Allocate pixels aligned to image16_ref::row_alignment
+/** The allocation the pixels are cut from is noted right before them
+**/
+static uint16_t *new_aligned_pixels(size_t count)
+{
+  const size_t alignment = image16_ref::row_alignment;
+  char *block = new char[count * sizeof(uint16_t) + alignment + sizeof(char*)];
+  const uintptr_t first = reinterpret_cast<uintptr_t>(block + sizeof(char*));
+  char *pixels = block + sizeof(char*) + (alignment - first % alignment) % alignment;
+  reinterpret_cast<char**>(pixels)[-1] = block;
+  return reinterpret_cast<uint16_t*>(pixels);
+}
+
+static void delete_aligned_pixels(uint16_t *pixels)
+{
+  if(pixels) delete[] reinterpret_cast<char**>(pixels)[-1];
+}
+
+/// Row distance in pixels that keeps every row at image16_ref::row_alignment
+static int aligned_stride(int width)
+{
+  const int block = image16_ref::row_alignment / sizeof(uint16_t);
+  return (width + block - 1) / block * block;
+}
+
+
 // public
 
 /// Create an empty image
@@ -70,21 +266,10 @@ class tiff_file_accessor : public img_file_accessor
     @param img Number of the image in the stack
 **/
 image16_ref::image16_ref(int length, int width, int bits_per_pixel,  int img)
-  : length_(length), width_(width), scanline_size_(width * sizeof(uint16)),
-    bits_per_pixel_(bits_per_pixel), ref_count_(new int), dir_number_(img)
+  : image16_ref(new_aligned_pixels((size_t) length * aligned_stride(width)), aligned_stride(width),
+                length, width, width * sizeof(uint16), bits_per_pixel, img, std::shared_ptr<void>())
 { 
-  uint16_t **data = new uint16_t*[length];
-  uint16_t *data_rows = new uint16_t[length * width];
-  
-  for(int row = 0; row < (int) length; row++) {
-    data[row] =  &data_rows[row * width];
-    memset(data[row], '\0', scanline_size_);
-  }
-  
-  assert(scanline_size_ == width * (int) sizeof(uint16_t));
-  
-  data_ = data;
-  *ref_count_ = 1;
+  memset(pixels_, '\0', (size_t) length_ * stride_ * sizeof(uint16_t));
 }
 
 
@@ -96,65 +281,41 @@ image16_ref::image16_ref(image16_ref const& image)
   if(data_ == image.data_) return;
 
   data_ = image.data_;
+  pixels_ = image.pixels_;
+  stride_ = image.stride_;
   length_ = image.length_;
   width_ = image.width_;
   scanline_size_ = image.scanline_size_;
   bits_per_pixel_ = image.bits_per_pixel_;
   dir_number_ = image.dir_number_;
   ref_count_ = image.ref_count_;
+  mapping_ = image.mapping_;
 
   (*ref_count_)++;
 }
 
 image16_ref::image16_ref()
-   : length_(128), width_(128), scanline_size_(128 * sizeof(uint16)),
-  bits_per_pixel_(16), ref_count_(new int), dir_number_(1)
+  : image16_ref(128, 128, 16, 1)
 {
-    uint16_t **data = new uint16_t*[length_];
-    uint16_t *data_rows = new uint16_t[length_ * width_];
-
-    for(int row = 0; row < (int) length_; row++) {
-      data[row] =  &data_rows[row * width_];
-      memset(data[row], '\0', scanline_size_);
-    }
-
-    assert(scanline_size_ == width_ * (int) sizeof(uint16_t));
-
-    data_ = data;
-    *ref_count_ = 1;
 }
 
 
 /// Image destructor, delete data if last reference to it gets destructed
 image16_ref::~image16_ref()
 {
-  (*ref_count_)--;  
-  
-  if(*ref_count_ == 0) {
-    delete[] data_[0];
-    delete[] data_;
-    delete ref_count_;
-    ref_count_ = nullptr;
-    data_ = nullptr;
-  }
-  
+  release();
 }
 
 
 /// Copy an image by copying its data (deep copy)
 image16_ref image16_ref::copy()
 { 
-  
-  uint16_t **data = new uint16_t*[length_];
-  uint16_t *data_rows = new uint16_t[length_ * width_];
+  image16_ref image = allocate(length_, width_, bits_per_pixel_, dir_number_);
   for(int row = 0; row < length_; row++) {
-    data[row] = &data_rows[row * width_];
-    memcpy(data[row], data_[row], scanline_size_);
+    memcpy(image.data_[row], data_[row], width_ * sizeof(uint16_t));
   }
   
-  assert(scanline_size_ == width_ * (int) sizeof(uint16_t));
-  
-  return image16_ref(data, length_, width_, scanline_size_, bits_per_pixel_, dir_number_);
+  return image;
 }
 
 
@@ -172,6 +333,39 @@ uint16_t const* const *image16_ref::get_data() const
 }
 
 
+/// Return the first pixel of the image, row r starts get_stride() * r pixels after it
+uint16_t *image16_ref::get_pixels()
+{
+  return pixels_;
+}
+
+
+/// Return the first pixel of the image, row r starts get_stride() * r pixels after it
+uint16_t const *image16_ref::get_pixels() const
+{
+  return pixels_;
+}
+
+
+/// Return the distance of two rows
+/** @return The distance of two rows in pixels, at least the width
+**/
+int image16_ref::get_stride() const
+{
+  return stride_;
+}
+
+
+/// Tell if every row starts at a multiple of row_alignment
+/** True for images that own their pixels, mapped frames follow the layout of the file
+**/
+bool image16_ref::is_aligned() const
+{
+  return reinterpret_cast<uintptr_t>(pixels_) % row_alignment == 0 &&
+         (stride_ * sizeof(uint16_t)) % row_alignment == 0;
+}
+
+
 /// Return the length of the image
 /** @return The length of the image in pixels
 **/
@@ -199,6 +393,20 @@ int image16_ref::get_dir_number() const
 }
 
 
+/// Set the directory number, for an image that is reused for another frame
+void image16_ref::set_dir_number(int dir_number)
+{
+  dir_number_ = dir_number;
+}
+
+
+/// Tell if this is the only reference to pixels the image owns, which may then be overwritten
+bool image16_ref::is_exclusive() const
+{
+  return *ref_count_ == 1 && !mapping_;
+}
+
+
 /// Return the size of one line in bytes of the image
 /** @return The size of one line in bytes of the image
 **/
@@ -229,20 +437,18 @@ image16_ref& image16_ref::operator=(image16_ref const& image)
 {
   if(data_ == image.data_) return *this;
   
-  (*ref_count_)--;
-  if(*ref_count_ == 0) {
-    delete[] data_[0];
-    delete[] data_;
-    delete ref_count_;
-  }
+  release();
 
   data_ = image.data_;
+  pixels_ = image.pixels_;
+  stride_ = image.stride_;
   length_ = image.length_;
   width_ = image.width_;
   scanline_size_ = image.scanline_size_;
   bits_per_pixel_ = image.bits_per_pixel_;
   dir_number_ = image.dir_number_;
   ref_count_ = image.ref_count_;
+  mapping_ = image.mapping_;
 
   (*ref_count_)++;
   
@@ -250,6 +456,29 @@ image16_ref& image16_ref::operator=(image16_ref const& image)
 }
 
 
+/// Copy the pixels of an image into this one (deep copy)
+/** If the sizes differ, or the pixels of this image are shared or mapped,
+    this image refers to the other one instead.
+    @param image The image to copy
+**/
+image16_ref& image16_ref::copy_from(image16_ref const& image)
+{
+  if(data_ == image.data_) return *this;
+
+  if(length_ != image.length_ || width_ != image.width_ || !is_exclusive()) {
+    return *this = image;
+  }
+
+  for(int row = 0; row < length_; row++) {
+    memcpy(data_[row], image.data_[row], width_ * sizeof(uint16_t));
+  }
+  bits_per_pixel_ = image.bits_per_pixel_;
+  dir_number_ = image.dir_number_;
+
+  return *this;
+}
+
+
 /// Shift all pixel values to the left
 /** @param shift shift amount
 **/
@@ -354,20 +583,17 @@ int image16_ref::subtr_and_update_bg(image16_ref const& bg, float img_weight)
   assert(length_ == bg.length_ && width_ == bg.width_);
   assert(img_weight >= 0 && img_weight <= 1);
   
-  int meanbg = 0;
+  // the kernel takes the widest vectors the CPU has, unpadded images in one go
+  uint32_t sum = 0;
   
-  for(int row = 0; row < length_; row++) {
-    for(int col = 0; col < width_; col++) {
-      uint16_t img_data = data_[row][col];
-      uint16_t bg_data = bg.data_[row][col];
-      int diff_data = std::min<int>( (img_data - bg_data) , (int)sqrt((double)img_data) ) ; // subtract background and test if change is bigger than sigma of noise
-      data_[row][col] =  std::max( img_data - bg_data , 0 );
-             
-      bg.data_[row][col] = (uint16_t) (bg_data  + diff_data * img_weight);      // update background
-      meanbg += img_data;
+  if(stride_ == width_ && bg.stride_ == width_) {
+    sum = subtr_and_update_bg_row(pixels_, bg.pixels_, length_*width_, img_weight);
+  } else {
+    for(int row = 0; row < length_; row++) {
+      sum += subtr_and_update_bg_row(pixels_ + (size_t) row*stride_, bg.pixels_ + (size_t) row*bg.stride_, width_, img_weight);
     }
   }
-  meanbg /= (length_*width_);
+  int meanbg = (int) sum / (length_*width_);
   
   return meanbg;
 }
@@ -392,11 +618,13 @@ image16_ref& image16_ref::operator-=(int subtrahend)
 /** @param fir_radius The radius of the square where the average is calculated from
 **/
 image16_ref& image16_ref::apply_highpass(int fir_radius)
-{  
+{
+  // the window reaches rows that are already filtered, so filter a copy
+  image16_ref fir_img(length_, width_, bits_per_pixel_, dir_number_);
+  apply_highpass(fir_radius, &fir_img);
+
   for(int row = 0; row < length_; row++) {
-    for(int col = 0; col < width_; col++) {
-      data_[row][col] = sum_halo(row, col, fir_radius);
-    }
+    std::copy(fir_img.data_[row], fir_img.data_[row] + width_, data_[row]);
   }
   
   return *this;
@@ -404,16 +632,15 @@ image16_ref& image16_ref::apply_highpass(int fir_radius)
 
 /// Apply a 2D high-pass filter to a second image
 /** @param fir_radius The radius of the square where the average is calculated from
-    @param fir_img The radius of the square where the average is calculated from
+    @param fir_img Receives the filtered image
 **/
 image16_ref& image16_ref::apply_highpass(int fir_radius, image16_ref *fir_img)
 {
   assert(length_ == fir_img->length_ && width_ == fir_img->width_);
 
+  image16_highpass highpass(*this, fir_radius);
   for(int row = 0; row < length_; row++) {
-    for(int col = 0; col < width_; col++) {
-      fir_img->data_[row][col] = sum_halo(row, col, fir_radius);
-    }
+    highpass.filter_row(row, fir_img->data_[row]);
   }
 
   return *this;
@@ -521,31 +748,92 @@ void image16_ref::write_as_csv(std::ostream &out)
 
 
 // private
-/// Create an image reference from a tiff container
-image16_ref::image16_ref(uint16_t *const *data, int length, int width,
-                           int scanline_size, int bits_per_pixel, int dir_number)
-  : data_(data), length_(length), width_(width), scanline_size_(scanline_size),
-    bits_per_pixel_(bits_per_pixel), ref_count_(new int), dir_number_(dir_number)
-{           
+
+/// Create an image reference to pixels in memory, or in a memory mapped tiff container
+/** The row array is built here. The pixels are owned unless a mapping is given,
+    mapped pixels stay valid as long as a reference to the mapping exists.
+    @param pixels First pixel of row 0
+    @param stride Distance of two rows in pixels
+**/
+image16_ref::image16_ref(uint16_t *pixels, int stride, int length, int width,
+                           int scanline_size, int bits_per_pixel, int dir_number,
+                           std::shared_ptr<void> const& mapping)
+  : pixels_(pixels), stride_(stride), length_(length), width_(width), scanline_size_(scanline_size),
+    bits_per_pixel_(bits_per_pixel), ref_count_(new int), dir_number_(dir_number),
+    mapping_(mapping)
+{
+  uint16_t **rows = new uint16_t*[length_];
+  for(int row = 0; row < length_; row++) {
+    rows[row] = pixels_ + (size_t) row * stride_;
+  }
+  data_ = rows;
+
   *ref_count_ = 1;
 }
 
-/// Calculate the sum of all pixel values in a halo
-int image16_ref::sum_halo(int row, int col, int fir_radius)
+/// Create an image that owns its pixels without clearing them, for images that are filled right away
+image16_ref image16_ref::allocate(int length, int width, int bits_per_pixel, int dir_number)
+{
+  const int stride = aligned_stride(width);
+  return image16_ref(new_aligned_pixels((size_t) length * stride), stride, length, width,
+                     width * sizeof(uint16_t), bits_per_pixel, dir_number, std::shared_ptr<void>());
+}
+
+/// Drop this reference, free the pixels with the last one
+void image16_ref::release()
 {
-  int halo_acc = 0;
-  int halo_count = 0;
+  (*ref_count_)--;
   
-  for(int row_halo = row - fir_radius; row_halo < row + fir_radius + 1; row_halo++) {
-    for(int col_halo = col - fir_radius; col_halo < col + fir_radius + 1; col_halo++) {
-      if(row_halo > 0 && row_halo < length_ && col_halo > 0 && col_halo < width_) {
-        halo_acc += data_[row_halo][col_halo];
-        halo_count++;
-      }
-    }
+  if(*ref_count_ == 0) {
+    if(!mapping_) delete_aligned_pixels(pixels_);
+    delete[] data_;
+    delete ref_count_;
+    ref_count_ = nullptr;
+    data_ = nullptr;
+    pixels_ = nullptr;
   }
-  
-  return halo_acc/halo_count;
+}
+
+
+/********************** image16_highpass **********************************/
+
+/** @param image The image to filter, must outlive the filter
+    @param fir_radius The radius of the square where the average is calculated from
+**/
+image16_highpass::image16_highpass(image16_ref const& image, int fir_radius)
+  : pixels_(image.get_pixels()), stride_(image.get_stride()), length_(image.get_length()), width_(image.get_width()),
+    fir_radius_(fir_radius), first_(0), last_(-1),
+    col_sums_(image.get_width()), prefix_(image.get_width() + 1)
+{
+}
+
+/// Filter one row, each pixel gets the mean of the square around it
+/** Like before, row 0 and column 0 never count towards a mean.
+    @param row The row to filter
+    @param fir_row Receives the width filtered values of the row
+**/
+void image16_highpass::filter_row(int row, uint16_t *fir_row)
+{
+  const int first = std::max(row - fir_radius_, 1);
+  const int last = std::min(row + fir_radius_, length_ - 1);
+
+  // rows out of order or past the window start over
+  if(first < first_ || last < last_ || first > last_) {
+    std::fill(col_sums_.begin(), col_sums_.end(), 0);
+    first_ = first;
+    last_ = first - 1;
+  }
+
+  while(last_ < last) {
+    last_++;
+    add_row(col_sums_.data(), pixels_ + (size_t) last_*stride_, width_);
+  }
+  while(first_ < first) {
+    sub_row(col_sums_.data(), pixels_ + (size_t) first_*stride_, width_);
+    first_++;
+  }
+
+  box_mean_row(col_sums_.data(), width_, fir_radius_, last_ - first_ + 1, prefix_.data(), fir_row);
 }
 
 
@@ -555,11 +843,33 @@ int image16_ref::sum_halo(int row, int col, int fir_radius)
 img_stack::img_stack(std::string path, std::string mode)
 {
   this->accessor_ = NULL;
+
+  if(mode.compare("r") == 0 && QFileInfo(QString::fromStdString(path)).isDir()) {
+    this->accessor_ = new tiff_directory_accessor(path);
+    return;
+  }
+
   std::string extension = path.substr(path.find_last_of('.') + 1);
   
   std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-  if(extension.compare("tif") == 0 || extension.compare("tiff") == 0) {
-    this->accessor_ = new tiff_file_accessor(path, mode);
+
+  std::string name = path.substr(path.find_last_of("/\\") + 1);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  const bool ome = name.find(".ome.") != std::string::npos;
+
+  // BigTIFF is read by libtiff transparently, the extensions only select it for writing
+  const bool big_tiff = extension.compare("btf") == 0 || extension.compare("tf8") == 0;
+
+  if(extension.compare("tif") == 0 || extension.compare("tiff") == 0 || big_tiff) {
+    if(mode.compare("r") == 0 && ome) {
+      this->accessor_ = new ome_tiff_series_accessor(path);
+    } else if(mode.compare("r") == 0) {
+      this->accessor_ = new mapped_tiff_file_accessor(path);
+    } else if(big_tiff && mode.find('8') == std::string::npos) {
+      this->accessor_ = new tiff_file_accessor(path, mode + "8");
+    } else {
+      this->accessor_ = new tiff_file_accessor(path, mode);
+    }
   } else {
     std::cerr << "unknown file format " << extension << std::endl;
   }
@@ -594,18 +904,46 @@ std::string const& img_stack::get_path()
   return accessor_->get_path();
 }
 
+/// Get the paths of all files the images are read from
+std::vector<std::string> img_stack::get_files()
+{
+  assert(good());
+  return accessor_->get_files();
+}
+
 int img_stack::img_count()
 {
   assert(good());
   return accessor_->img_count();
 }
 
+/// Pick up images appended to the container since it was opened, for stacks that are still being written
+/** @return the number of images in the container
+**/
+int img_stack::refresh()
+{
+  assert(good());
+  return accessor_->refresh();
+}
+
 image16_ref img_stack::get_image(int img)
 {
   assert(good());
   return accessor_->get_image(img);
 }
 
+/// Read an image into the pixels of a given image, to reuse them for the next frame
+/** If the image has another size, shares its pixels or points into a file,
+    it refers to the image read instead, like an assignment of get_image().
+    @param img The number of the image
+    @param image Receives the image
+**/
+void img_stack::read_image(int img, image16_ref &image)
+{
+  assert(good());
+  accessor_->read_image(img, image);
+}
+
 void img_stack::append_image(image16_ref const& image)
 {
   assert(good());
@@ -677,10 +1015,11 @@ tiff_file_accessor::tiff_file_accessor(std::string path, std::string mode)
 {
   TIFFSetWarningHandler(&TIFFWarningHandler);
   tiff_ = TIFFOpen(path.c_str(), mode.c_str());
-  if(!tiff_) {
-    good_ = false;
+  good_ = (tiff_ != NULL);
+
+  if(good_ && mode_.compare("r") == 0) {
+    index_directories();
   }
-  good_ = true;
 }
 
 /// Close a tiff container
@@ -724,11 +1063,30 @@ std::string const& tiff_file_accessor::get_path()
   return path_;
 }
 
+/// Get the description of the first image, holds the OME-XML of OME-TIFF files
+/** @return the image description, empty if there is none
+**/
+std::string tiff_file_accessor::get_description()
+{
+  char *description = NULL;
+
+  set_directory(0);
+  if(!TIFFGetField(tiff_, TIFFTAG_IMAGEDESCRIPTION, &description) || !description) {
+    return std::string();
+  }
+
+  return std::string(description);
+}
+
 /// Get the number of images in the tiff container
 /** @return the number of images in the tiff container
 **/
 int tiff_file_accessor::img_count()
 {
+  if(!dir_offsets_.empty()) {
+    return (int) dir_offsets_.size();
+  }
+
   int count = 0;
   TIFFSetDirectory(tiff_, 0);
   
@@ -740,13 +1098,40 @@ int tiff_file_accessor::img_count()
   return count;
 }
 
+/// Index the directories appended since the container was opened, only for reading
+/** @return the number of images in the tiff container
+**/
+int tiff_file_accessor::refresh()
+{
+  if(dir_offsets_.empty()) {
+    return img_count();
+  }
+
+  // libtiff maps the file when it is opened, only a new handle sees what was appended since
+  TIFF *tiff = TIFFOpen(path_.c_str(), mode_.c_str());
+  if(!tiff) {
+    return img_count();
+  }
+
+  TIFFClose(tiff_);
+  tiff_ = tiff;
+
+  if(TIFFSetSubDirectory(tiff_, dir_offsets_.back())) {
+    while(TIFFReadDirectory(tiff_)) {
+      dir_offsets_.push_back(TIFFCurrentDirOffset(tiff_));
+    }
+  }
+
+  return img_count();
+}
+
 /// Get an image from the tiff container
 /** @param img The number of the image
     @return a refernce to the requested image
 **/
 image16_ref tiff_file_accessor::get_image(int img)
 { 
-  TIFFSetDirectory(tiff_, img);
+  set_directory(img);
   
   tsize_t scanline_size = TIFFScanlineSize(tiff_);
   
@@ -769,17 +1154,45 @@ image16_ref tiff_file_accessor::get_image(int img)
   }*/
   
   
-  uint16_t **data = new uint16_t*[length];
-  uint16_t *data_rows = new uint16_t[length * width];
+  image16_ref image = image16_ref::allocate(length, width, bits_per_pixel, img);
   
   for(int row = 0; row < (int) length; row++) {
-    data[row] =  &data_rows[row * width];
-    TIFFReadScanline(tiff_, data[row], row);
+    TIFFReadScanline(tiff_, image.data_[row], row);
   }
   
   // rely on return value optimization here,
   // copy-constructor should not be called
-  return image16_ref(data, length, width, scanline_size, bits_per_pixel, img);
+  return image;
+}
+
+/// Read an image of the tiff container into the pixels of a given image
+/** @param img The number of the image
+    @param image Receives the image, see img_stack::read_image
+**/
+void tiff_file_accessor::read_image(int img, image16_ref &image)
+{
+  set_directory(img);
+
+  uint32 length;
+  TIFFGetField(tiff_,  TIFFTAG_IMAGELENGTH, &length);
+
+  uint32 width;
+  TIFFGetField(tiff_,  TIFFTAG_IMAGEWIDTH, &width);
+
+  uint16 bits_per_pixel;
+  TIFFGetField(tiff_, TIFFTAG_BITSPERSAMPLE, &bits_per_pixel);
+
+  if((int) length != image.length_ || (int) width != image.width_ || !image.is_exclusive()) {
+    image = get_image(img);
+    return;
+  }
+
+  for(int row = 0; row < (int) length; row++) {
+    TIFFReadScanline(tiff_, image.data_[row], row);
+  }
+
+  image.bits_per_pixel_ = bits_per_pixel;
+  image.dir_number_ = img;
 }
 
 /// Append an image to the end of the tiff container
@@ -860,3 +1273,654 @@ void tiff_file_accessor::TIFFWarningHandler(const char* /*module*/, const char*
 {
   /* do nothing*/
 }
+
+// protected
+
+/// Make an image the current directory, without walking the directory chain if it is indexed
+/** @param img The number of the image
+    @return true iff the directory could be read
+**/
+bool tiff_file_accessor::set_directory(int img)
+{
+  if(img >= 0 && img < (int) dir_offsets_.size()
+     && TIFFSetSubDirectory(tiff_, dir_offsets_[img])) {
+    return true;
+  }
+
+  return TIFFSetDirectory(tiff_, img);
+}
+
+// private
+
+/// magic number and layout version at the start of an index file
+static const char ifd_index_magic[8] = {'S','F','P','I','F','D','X','1'};
+
+/// Build the table of directory offsets, from the index file next to the stack if it is up to date
+void tiff_file_accessor::index_directories()
+{
+  dir_offsets_.clear();
+
+  QFileInfo info(QString::fromStdString(path_));
+  const QString index_path = info.absoluteFilePath() + ".ifdx";
+  const quint64 stack_size = info.size();
+  const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+
+  if(load_index(index_path, stack_size, modified)) {
+    return;
+  }
+
+  TIFFSetDirectory(tiff_, 0);
+
+  do {
+    dir_offsets_.push_back(TIFFCurrentDirOffset(tiff_));
+  } while (TIFFReadDirectory(tiff_));
+
+  TIFFSetDirectory(tiff_, 0);
+
+  // single images are indexed as fast as the index file is read
+  if(dir_offsets_.size() > 1) {
+    save_index(index_path, stack_size, modified);
+  }
+}
+
+/// Read the directory offsets from an index file
+/** @param index_path path of the index file
+    @param stack_size size of the stack, the index is rejected if it was built for another size
+    @param modified modification time of the stack, the index is rejected if it is older
+    @return true iff the index could be read and belongs to the stack
+**/
+bool tiff_file_accessor::load_index(QString const& index_path, quint64 stack_size, qint64 modified)
+{
+  QFile index_file(index_path);
+  if(!index_file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+
+  char magic[sizeof(ifd_index_magic)];
+  quint64 header[3];   // stack size, modification time, number of directories
+
+  if(index_file.read(magic, sizeof(magic)) != sizeof(magic)
+     || memcmp(magic, ifd_index_magic, sizeof(magic)) != 0
+     || index_file.read(reinterpret_cast<char*>(header), sizeof(header)) != sizeof(header)
+     || header[0] != stack_size || (qint64) header[1] != modified || header[2] == 0
+     || index_file.size() != (qint64) (sizeof(magic) + sizeof(header) + header[2] * sizeof(quint64))) {
+    return false;
+  }
+
+  std::vector<quint64> offsets(header[2]);
+  const qint64 bytes = offsets.size() * sizeof(quint64);
+  if(index_file.read(reinterpret_cast<char*>(offsets.data()), bytes) != bytes) {
+    return false;
+  }
+
+  for(size_t dir = 0; dir < offsets.size(); dir++) {
+    if(offsets[dir] >= stack_size) {
+      return false;
+    }
+  }
+
+  dir_offsets_.assign(offsets.begin(), offsets.end());
+  return true;
+}
+
+/// Write the directory offsets to an index file, failures are ignored
+/** @param index_path path of the index file
+    @param stack_size size of the stack
+    @param modified modification time of the stack
+**/
+void tiff_file_accessor::save_index(QString const& index_path, quint64 stack_size, qint64 modified)
+{
+  // written to a temporary file and renamed, readers never see a partial index
+  QSaveFile index_file(index_path);
+  if(!index_file.open(QIODevice::WriteOnly)) {
+    return;
+  }
+
+  std::vector<quint64> offsets(dir_offsets_.begin(), dir_offsets_.end());
+  quint64 header[3] = {stack_size, (quint64) modified, (quint64) offsets.size()};
+
+  index_file.write(ifd_index_magic, sizeof(ifd_index_magic));
+  index_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  index_file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(quint64));
+  index_file.commit();
+}
+
+
+/********************** mapped_tiff_file_accessor **********************************/
+// public
+
+/// Open a tiff container for reading and map its uncompressed frames
+mapped_tiff_file_accessor::mapped_tiff_file_accessor(std::string path)
+  : tiff_file_accessor(path, "r"), file_size_(0), native_order_(false)
+{
+  if(!good_) {
+    return;
+  }
+
+  file_.reset(new mapped_tiff_file);
+  file_->file.setFileName(QString::fromStdString(path));
+  if(!file_->file.open(QIODevice::ReadOnly)) {
+    file_.reset();
+    return;
+  }
+
+  file_size_ = file_->file.size();
+  native_order_ = !TIFFIsByteSwapped(tiff_);
+  frames_.resize(img_count());
+}
+
+/// Index the frames appended since the container was opened
+/** @return the number of images in the tiff container
+**/
+int mapped_tiff_file_accessor::refresh()
+{
+  int count = tiff_file_accessor::refresh();
+
+  if(file_) {
+    file_size_ = file_->file.size();
+    frames_.resize(count);
+  }
+
+  return count;
+}
+
+/// Get an image from the tiff container
+/** @param img The number of the image
+    @return a reference to the requested image, pointing into the file if it could be mapped
+**/
+image16_ref mapped_tiff_file_accessor::get_image(int img)
+{
+  if(!file_ || img < 0 || img >= (int) frames_.size() || !resolve_frame(img).mappable) {
+    return tiff_file_accessor::get_image(img);
+  }
+
+  frame_layout const& frame = frames_[img];
+  int scanline_size = frame.width * sizeof(uint16_t);
+
+  uchar *pixels;
+  {
+    std::lock_guard<std::mutex> lock(file_->mutex);
+    pixels = file_->file.map(frame.offset, (qint64) frame.length * scanline_size, QFileDevice::MapPrivateOption);
+  }
+
+  if(!pixels) {
+    return tiff_file_accessor::get_image(img);
+  }
+
+  std::shared_ptr<void> mapping(new mapped_tiff_frame(file_, pixels));
+
+  // the rows lie in the file back to back
+  return image16_ref(reinterpret_cast<uint16_t*>(pixels), frame.width, frame.length, frame.width,
+                     scanline_size, frame.bits_per_pixel, img, mapping);
+}
+
+/// Read an image of the tiff container into the pixels of a given image
+/** A frame that could be mapped is read straight from the file, without a
+    mapping and without libtiff.
+    @param img The number of the image
+    @param image Receives the image, see img_stack::read_image
+**/
+void mapped_tiff_file_accessor::read_image(int img, image16_ref &image)
+{
+  if(!file_ || img < 0 || img >= (int) frames_.size() || !resolve_frame(img).mappable) {
+    tiff_file_accessor::read_image(img, image);
+    return;
+  }
+
+  frame_layout const& frame = frames_[img];
+  if((int) frame.length != image.length_ || (int) frame.width != image.width_ || !image.is_exclusive()) {
+    image = get_image(img);
+    return;
+  }
+
+  const qint64 scanline_size = frame.width * sizeof(uint16_t);
+  bool complete;
+  {
+    std::lock_guard<std::mutex> lock(file_->mutex);
+    complete = file_->file.seek(frame.offset);
+    if(image.stride_ == image.width_) {
+      const qint64 size = (qint64) frame.length * scanline_size;
+      complete = complete && file_->file.read(reinterpret_cast<char*>(image.pixels_), size) == size;
+    } else {
+      for(int row = 0; row < (int) frame.length && complete; row++) {
+        complete = file_->file.read(reinterpret_cast<char*>(image.data_[row]), scanline_size) == scanline_size;
+      }
+    }
+  }
+
+  if(!complete) {
+    tiff_file_accessor::read_image(img, image);
+    return;
+  }
+
+  image.bits_per_pixel_ = frame.bits_per_pixel;
+  image.dir_number_ = img;
+}
+
+// private
+
+/// Read the directory of a frame once and record where its pixels are stored
+/** @param img The number of the image
+    @return the layout of the frame
+**/
+mapped_tiff_file_accessor::frame_layout const& mapped_tiff_file_accessor::resolve_frame(int img)
+{
+  frame_layout & frame = frames_[img];
+  if(frame.resolved) {
+    return frame;
+  }
+
+  frame.resolved = true;
+
+  if(!set_directory(img)) {
+    return frame;
+  }
+
+  uint16 compression, samples_per_pixel;
+  uint32 rows_per_strip;
+  toff_t *strip_offsets = NULL;
+
+  TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &frame.length);
+  TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &frame.width);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_BITSPERSAMPLE, &frame.bits_per_pixel);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+  TIFFGetFieldDefaulted(tiff_, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+
+  const tsize_t scanline_size = TIFFScanlineSize(tiff_);
+
+  if(native_order_ && compression == COMPRESSION_NONE
+     && frame.bits_per_pixel == 16 && samples_per_pixel == 1
+     && scanline_size == (tsize_t) (frame.width * sizeof(uint16_t))
+     && TIFFGetField(tiff_, TIFFTAG_STRIPOFFSETS, &strip_offsets) && strip_offsets) {
+
+    // the rows have to follow each other, otherwise a frame is not one block of the file
+    const uint32 strips = TIFFNumberOfStrips(tiff_);
+    const uint64 strip_size = (uint64) std::min(rows_per_strip, frame.length) * scanline_size;
+
+    bool contiguous = true;
+    for(uint32 strip = 1; strip < strips && contiguous; strip++) {
+      contiguous = (strip_offsets[strip] == strip_offsets[0] + strip * strip_size);
+    }
+
+    frame.offset = strip_offsets[0];
+    frame.mappable = contiguous
+                     && frame.offset % sizeof(uint16_t) == 0
+                     && frame.offset + (uint64) frame.length * scanline_size <= (uint64) file_size_;
+  }
+
+  return frame;
+}
+
+
+/********************** ome_tiff_series_accessor **********************************/
+// public
+
+/// Open an OME-TIFF file and all files of the series it belongs to
+ome_tiff_series_accessor::ome_tiff_series_accessor(std::string path)
+  : path_(path), mode_("r"), plane_count_(0)
+{
+  if(open_file(path) != 0) {
+    return;
+  }
+
+  if(!read_series(files_[0]->get_description())) {
+    // not a multi-file series, or a part of it is missing: read the file on its own
+    for(size_t file = 1; file < files_.size(); file++) {
+      delete files_[file];
+    }
+    files_.resize(1);
+
+    blocks_.clear();
+    plane_count_ = 0;
+    append_block(0, 0, files_[0]->img_count());
+  }
+}
+
+/// Close all files of the series
+ome_tiff_series_accessor::~ome_tiff_series_accessor()
+{
+  for(size_t file = 0; file < files_.size(); file++) {
+    delete files_[file];
+  }
+}
+
+bool ome_tiff_series_accessor::good()
+{
+  return plane_count_ > 0;
+}
+
+bool ome_tiff_series_accessor::writeable()
+{
+  return false;
+}
+
+std::string const& ome_tiff_series_accessor::get_mode()
+{
+  return mode_;
+}
+
+std::string const& ome_tiff_series_accessor::get_path()
+{
+  return path_;
+}
+
+/// Get the paths of all files of the series
+std::vector<std::string> ome_tiff_series_accessor::get_files()
+{
+  std::vector<std::string> paths;
+  for(size_t file = 0; file < files_.size(); file++) {
+    paths.push_back(files_[file]->get_path());
+  }
+  return paths;
+}
+
+/// Get the number of planes in the series
+int ome_tiff_series_accessor::img_count()
+{
+  return plane_count_;
+}
+
+/// Get a plane of the series
+/** @param img The number of the plane in the series
+    @return a reference to the requested image, numbered in the series
+**/
+image16_ref ome_tiff_series_accessor::get_image(int img)
+{
+  plane_block const& block = find_block(img);
+
+  image16_ref image = files_[block.file]->get_image(block.first_dir + img - block.first_plane);
+  image.dir_number_ = img;
+
+  return image;
+}
+
+/// Read a plane of the series into an image, see img_stack::read_image
+void ome_tiff_series_accessor::read_image(int img, image16_ref &image)
+{
+  plane_block const& block = find_block(img);
+
+  files_[block.file]->read_image(block.first_dir + img - block.first_plane, image);
+  image.dir_number_ = img;
+}
+
+void ome_tiff_series_accessor::append_image(image16_ref const& /*image*/)
+{
+  /* read only */
+}
+
+void ome_tiff_series_accessor::append_as_8bit_image(image16_ref const& /*image*/, int /*shift*/)
+{
+  /* read only */
+}
+
+void ome_tiff_series_accessor::append_new_16bit_image(uint16_t * /*data*/, int /*width*/, int /*length*/)
+{
+  /* read only */
+}
+
+// private
+
+/// Build the planes of the series from the TiffData elements of the first image in the OME-XML
+/** @param description the OME-XML of the opened file
+    @return true iff the series spans several files and all of them could be opened
+**/
+bool ome_tiff_series_accessor::read_series(std::string const& description)
+{
+  struct tiff_data
+  {
+    int c, t, z;            // position of the first plane
+    int ifd;                // directory of the first plane
+    int count;              // number of planes, -1 for all remaining directories
+    std::string file_name;  // empty for the file the OME-XML is stored in
+  };
+
+  std::vector<tiff_data> planes;
+  bool other_files = false;
+
+  QXmlStreamReader xml(QString::fromStdString(description));
+
+  while(!xml.atEnd()) {
+    xml.readNext();
+
+    if(xml.isEndElement() && xml.name() == QLatin1String("Pixels")) {
+      break;   // only the first image of the file is read
+    }
+
+    if(!xml.isStartElement() || xml.name() != QLatin1String("TiffData")) {
+      continue;
+    }
+
+    QXmlStreamAttributes attributes = xml.attributes();
+
+    tiff_data plane;
+    plane.c = attributes.value("FirstC").toString().toInt();
+    plane.t = attributes.value("FirstT").toString().toInt();
+    plane.z = attributes.value("FirstZ").toString().toInt();
+    plane.ifd = attributes.value("IFD").toString().toInt();
+
+    if(attributes.hasAttribute("PlaneCount")) {
+      plane.count = attributes.value("PlaneCount").toString().toInt();
+    } else {
+      plane.count = attributes.hasAttribute("IFD") ? 1 : -1;
+    }
+
+    // the file is named by an optional UUID child
+    while(!xml.atEnd() && !(xml.isEndElement() && xml.name() == QLatin1String("TiffData"))) {
+      xml.readNext();
+      if(xml.isStartElement() && xml.name() == QLatin1String("UUID")) {
+        plane.file_name = xml.attributes().value("FileName").toString().toStdString();
+      }
+    }
+
+    other_files |= !plane.file_name.empty()
+                   && QFileInfo(QString::fromStdString(path_)).fileName().toStdString() != plane.file_name;
+    planes.push_back(plane);
+  }
+
+  if(xml.hasError() || planes.empty() || !other_files) {
+    return false;
+  }
+
+  std::stable_sort(planes.begin(), planes.end(), [](tiff_data const& a, tiff_data const& b) {
+    if(a.c != b.c) return a.c < b.c;
+    if(a.t != b.t) return a.t < b.t;
+    return a.z < b.z;
+  });
+
+  for(size_t plane = 0; plane < planes.size(); plane++) {
+    int file = planes[plane].file_name.empty() ? 0 : open_file(planes[plane].file_name);
+    if(file < 0) {
+      std::cerr << "OME-TIFF series file missing: " << planes[plane].file_name << std::endl;
+      return false;
+    }
+
+    int dirs = files_[file]->img_count();
+    int count = (planes[plane].count < 0) ? dirs - planes[plane].ifd : planes[plane].count;
+    if(planes[plane].ifd < 0 || count <= 0 || planes[plane].ifd + count > dirs) {
+      std::cerr << "OME-TIFF series plane out of range in " << files_[file]->get_path() << std::endl;
+      return false;
+    }
+
+    append_block(file, planes[plane].ifd, count);
+  }
+
+  return true;
+}
+
+/// Open a file of the series once
+/** @param name path of the first file, or name of a series file relative to it
+    @return index of the file in files_, -1 if it could not be opened
+**/
+int ome_tiff_series_accessor::open_file(std::string const& name)
+{
+  std::string file_path = name;
+  if(!files_.empty()) {
+    file_path = QFileInfo(QString::fromStdString(path_)).absolutePath().toStdString() + "/" + name;
+  }
+
+  for(size_t file = 0; file < files_.size(); file++) {
+    if(QFileInfo(QString::fromStdString(files_[file]->get_path())).absoluteFilePath()
+       == QFileInfo(QString::fromStdString(file_path)).absoluteFilePath()) {
+      return (int) file;
+    }
+  }
+
+  tiff_file_accessor *accessor = new mapped_tiff_file_accessor(file_path);
+  if(!accessor->good()) {
+    delete accessor;
+    return -1;
+  }
+
+  files_.push_back(accessor);
+  return (int) files_.size() - 1;
+}
+
+/// Last block that starts at or before plane img
+ome_tiff_series_accessor::plane_block const& ome_tiff_series_accessor::find_block(int img)
+{
+  assert(img >= 0 && img < plane_count_);
+
+  int first = 0;
+  int last = (int) blocks_.size() - 1;
+  while(first < last) {
+    int mid = (first + last + 1) / 2;
+    if(blocks_[mid].first_plane <= img) {
+      first = mid;
+    } else {
+      last = mid - 1;
+    }
+  }
+
+  return blocks_[first];
+}
+
+/// Append planes to the series, merged with the previous block if they directly follow it
+void ome_tiff_series_accessor::append_block(int file, int first_dir, int count)
+{
+  if(count <= 0) {
+    return;
+  }
+
+  if(!blocks_.empty()) {
+    plane_block & last = blocks_.back();
+    if(last.file == file && last.first_dir + last.count == first_dir) {
+      last.count += count;
+      plane_count_ += count;
+      return;
+    }
+  }
+
+  plane_block block = {file, first_dir, count, plane_count_};
+  blocks_.push_back(block);
+  plane_count_ += count;
+}
+
+
+/********************** tiff_directory_accessor **********************************/
+// public
+
+/// Open a directory of frame files
+tiff_directory_accessor::tiff_directory_accessor(std::string path)
+  : path_(path), mode_("r")
+{
+  refresh();
+}
+
+bool tiff_directory_accessor::good()
+{
+  return QFileInfo(QString::fromStdString(path_)).isDir();
+}
+
+bool tiff_directory_accessor::writeable()
+{
+  return false;
+}
+
+std::string const& tiff_directory_accessor::get_mode()
+{
+  return mode_;
+}
+
+std::string const& tiff_directory_accessor::get_path()
+{
+  return path_;
+}
+
+/// Get the paths of all frame files read so far
+std::vector<std::string> tiff_directory_accessor::get_files()
+{
+  return files_;
+}
+
+/// Get the number of complete frame files
+int tiff_directory_accessor::img_count()
+{
+  return (int) files_.size();
+}
+
+/// Scan the directory for frame files added since the last scan
+/** @return the number of complete frame files
+**/
+int tiff_directory_accessor::refresh()
+{
+  QDir dir(QString::fromStdString(path_));
+  const QStringList entries = dir.entryList(QStringList() << "*.tif" << "*.tiff", QDir::Files, QDir::Name);
+  const QDateTime settled = QDateTime::currentDateTime().addMSecs(-1000);
+
+  for(int entry = (int) files_.size(); entry < entries.size(); entry++) {
+    QFileInfo info(dir.absoluteFilePath(entries.at(entry)));
+
+    // the newest file may still be written to
+    if(entry == entries.size() - 1 && info.lastModified() > settled) {
+      break;
+    }
+
+    files_.push_back(info.absoluteFilePath().toStdString());
+  }
+
+  return img_count();
+}
+
+/// Get the first image of a frame file
+/** @param img The number of the frame file
+    @return a reference to the image, numbered in the directory
+**/
+image16_ref tiff_directory_accessor::get_image(int img)
+{
+  assert(img >= 0 && img < (int) files_.size());
+
+  // mapped frames keep the file mapping alive after the accessor is closed
+  mapped_tiff_file_accessor file(files_[img]);
+
+  image16_ref image = file.get_image(0);
+  image.dir_number_ = img;
+
+  return image;
+}
+
+/// Read the frame of one file into an image, see img_stack::read_image
+void tiff_directory_accessor::read_image(int img, image16_ref &image)
+{
+  assert(img >= 0 && img < (int) files_.size());
+
+  mapped_tiff_file_accessor file(files_[img]);
+
+  file.read_image(0, image);
+  image.dir_number_ = img;
+}
+
+void tiff_directory_accessor::append_image(image16_ref const& /*image*/)
+{
+  /* read only */
+}
+
+void tiff_directory_accessor::append_as_8bit_image(image16_ref const& /*image*/, int /*shift*/)
+{
+  /* read only */
+}
+
+void tiff_directory_accessor::append_new_16bit_image(uint16_t * /*data*/, int /*width*/, int /*length*/)
+{
+  /* read only */
+}
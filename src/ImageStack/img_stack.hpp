@@ -4,16 +4,22 @@
 #include <string>
 #include <tiffio.h>
 #include <ostream>
+#include <memory>
 
 #include <stdint.h>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 
 
 class image16_ref
 {
+  friend class img_file_accessor;
   friend class tiff_file_accessor;
+  friend class mapped_tiff_file_accessor;
+  friend class ome_tiff_series_accessor;
+  friend class tiff_directory_accessor;
 
   public:
     image16_ref(int length, int width, int bits_per_pixel, int img);
@@ -24,6 +30,12 @@ class image16_ref
     image16_ref copy();
     uint16_t *const *get_data();
     uint16_t const *const *get_data() const;
+    uint16_t *get_pixels();
+    uint16_t const *get_pixels() const;
+    int get_stride() const;
+    bool is_aligned() const;
+    
+    static const int row_alignment = 64;   ///< bytes, every row of an image that owns its pixels starts at a multiple of it
     
     int get_length() const;
     int get_width() const;
@@ -31,8 +43,11 @@ class image16_ref
     int get_bytes_per_pixel() const;
     int get_bits_per_pixel() const;
     int get_dir_number() const;
+    void set_dir_number(int dir_number);
+    bool is_exclusive() const;
     
     image16_ref& operator=(image16_ref const& image);
+    image16_ref& copy_from(image16_ref const& image);
     
     image16_ref& operator<<=(int shift); 
     image16_ref& operator>>=(int shift);
@@ -56,18 +71,47 @@ class image16_ref
     void print(int size);
     
   private:
-    image16_ref(uint16_t *const *data, int length, int width,
-                 int scanline_size, int bits_per_pixel, int dir_number);
+    image16_ref(uint16_t *pixels, int stride, int length, int width,
+                 int scanline_size, int bits_per_pixel, int dir_number,
+                 std::shared_ptr<void> const& mapping);
+    
+    static image16_ref allocate(int length, int width, int bits_per_pixel, int dir_number);
+    void release();
     
-    int sum_halo(int row, int col, int fir_radius);
-                 
-    uint16_t *const *data_;        ///< data array of image
+    uint16_t *const *data_;        ///< row pointers into pixels_, the view get_data() hands out
+    uint16_t *pixels_;             ///< first pixel of row 0, the rows follow at stride_
+    int stride_;                   ///< distance of two rows in pixels
     int length_;                ///< length of the image
     int width_;                 ///< width of the image
     int scanline_size_;         ///< size of a line in bytes
     int bits_per_pixel_;        ///< bits used to store a pixel value
     int *ref_count_;            ///< nr of references that point to same data
     int dir_number_;            ///< number of the image in its tiff container
+    std::shared_ptr<void> mapping_; ///< memory map the pixels point into, pixels are not owned if set
+};
+
+
+/// Runs the high-pass filter of image16_ref over an image one row after the other
+/** Keeps the column sums of the rows in the window, so a row costs O(1) per
+    pixel for any radius as long as the rows come in increasing order.
+**/
+class image16_highpass
+{
+  public:
+    image16_highpass(image16_ref const& image, int fir_radius);
+
+    void filter_row(int row, uint16_t *fir_row);
+
+  private:
+    uint16_t const *pixels_;        ///< first pixel of the filtered image
+    int stride_;                    ///< distance of two rows in pixels
+    int length_;
+    int width_;
+    int fir_radius_;
+    int first_;                     ///< first row in the column sums
+    int last_;                      ///< last row in the column sums, first_-1 if there is none
+    std::vector<uint32_t> col_sums_;
+    std::vector<uint32_t> prefix_;  ///< scratch space of box_mean_row()
 };
 
 
@@ -81,10 +125,13 @@ class img_stack
     bool writeable();
     std::string const& get_mode();
     std::string const& get_path();
+    std::vector<std::string> get_files();
     
     int img_count();
+    int refresh();
 
     image16_ref get_image(int img);
+    void read_image(int img, image16_ref &image);
     void append_image(image16_ref const& image);
     void append_as_8bit_image(image16_ref const& image, int shift = 0);
 	void append_new_16bit_image(uint16_t * data, int width, int length);
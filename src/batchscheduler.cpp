@@ -0,0 +1,148 @@
+#include "qtfiles.h"
+
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include "batchscheduler.h"
+#include "pipelinerunner.h"
+#include "workstealingpool.h"
+
+BatchScheduler::BatchScheduler(int numThreads, int numDecoders, int maxRunsInFlight)
+: numThreads(numThreads),
+  numDecoders(numDecoders),
+  maxRunsInFlight(qMax(1,maxRunsInFlight)),
+  liveTimeout(0),
+  snapshotInterval(5000),
+  frameQueueCapacity(64),
+  spotQueueCapacity(16384),
+  fuseFilterFind(true),
+  numSpots(0),
+  pool(new WorkStealingPool(numThreads))
+{
+}
+
+BatchScheduler::~BatchScheduler()
+{
+  for(auto runner : inFlight){
+    delete runner;
+  }
+}
+
+/// Follow stacks that are still being written, see PipelineRunner::setLive()
+void BatchScheduler::setLive(int idleTimeout, int snapshotInterval)
+{
+  liveTimeout = idleTimeout;
+  this->snapshotInterval = snapshotInterval;
+}
+
+/// Expand directories to the TIFF stacks they contain, sorted by name
+QStringList BatchScheduler::collectStacks(const QStringList &paths)
+{
+  QStringList stacks;
+
+  for(const auto & path : paths){
+    QFileInfo info(path);
+    if(info.isDir()){
+      QDir dir(path);
+      const QStringList entries = dir.entryList(QStringList() << "*.tif" << "*.tiff" << "*.btf" << "*.tf8",
+                                                QDir::Files, QDir::Name);
+
+      // the later files of an OME-TIFF series are read through its first file
+      QStringList seriesParts;
+      for(const auto & entry : entries){
+        if(!entry.toLower().contains(".ome.")){
+          continue;
+        }
+        img_stack stack(dir.absoluteFilePath(entry).toStdString(),"r");
+        if(!stack.good()){
+          continue;
+        }
+        const std::vector<std::string> files = stack.get_files();
+        for(size_t file = 1; file < files.size(); file++){
+          seriesParts << QFileInfo(QString::fromStdString(files[file])).absoluteFilePath();
+        }
+      }
+
+      for(const auto & entry : entries){
+        const QString stackPath = dir.absoluteFilePath(entry);
+        if(!seriesParts.contains(stackPath)){
+          stacks << stackPath;
+        }
+      }
+    }else{
+      stacks << path;
+    }
+  }
+
+  return stacks;
+}
+
+/// Localize all stacks with default parameters
+int BatchScheduler::run(const QStringList &fileNames, double camPixelSize, double resPixelSize, QTextStream &out)
+{
+  return run(fileNames, QList<LocalizationRun::Parameters>() << LocalizationRun::Parameters(),
+             camPixelSize, resPixelSize, out);
+}
+
+/// Localize all stacks with every parameter set, returns the number of runs that failed
+int BatchScheduler::run(const QStringList &fileNames, QList<LocalizationRun::Parameters> const& parameterSets,
+                        double camPixelSize, double resPixelSize, QTextStream &out)
+{
+  QElapsedTimer batchWatch;
+  batchWatch.start();
+
+  int runs = 0;
+  int failed = 0;
+  numSpots = 0;
+
+  for(const auto & fileName : fileNames){
+    for(const auto & params : parameterSets){
+      // overlap: the next reader starts as soon as the previous one is done
+      if(!inFlight.isEmpty()){
+        inFlight.last()->waitForRead();
+      }
+      while(inFlight.size() >= maxRunsInFlight){
+        finishOldest(out);
+      }
+
+      runs++;
+      PipelineRunner *runner = new PipelineRunner(numThreads,numDecoders,pool.get());
+      runner->setParameters(params);
+      runner->setLive(liveTimeout,snapshotInterval);
+      runner->setFrameQueueCapacity(frameQueueCapacity);
+      runner->setSpotQueueCapacity(spotQueueCapacity);
+      runner->setFuseFilterFind(fuseFilterFind);
+      if(!runner->start(camPixelSize,resPixelSize,fileName)){
+        out << "error: could not localize " << fileName << "\n";
+        delete runner;
+        failed++;
+        continue;
+      }
+      inFlight << runner;
+    }
+  }
+
+  while(!inFlight.isEmpty()){
+    finishOldest(out);
+  }
+
+  const double seconds = batchWatch.elapsed() / 1000.0;
+  out << "batch\t" << runs-failed << " runs\t" << seconds << " s\t"
+      << numSpots << " spots\t" << ((seconds>0)? numSpots/seconds : 0.0) << " spots/s\n";
+
+  return failed;
+}
+
+void BatchScheduler::finishOldest(QTextStream &out)
+{
+  PipelineRunner *runner = inFlight.takeFirst();
+  runner->wait();
+
+  out << "file\t" << runner->getFileName() << "\t" << runner->getTag() << "\n";
+  runner->printStatistics(out);
+  out << "\n";
+  out.flush();
+
+  numSpots += runner->getNumSpots();
+  delete runner;
+}
@@ -0,0 +1,56 @@
+#ifndef BATCHSCHEDULER_H
+#define BATCHSCHEDULER_H
+
+#include <QList>
+#include <QStringList>
+
+#include <memory>
+
+#include "localizationrun.h"
+
+class PipelineRunner;
+class QTextStream;
+class WorkStealingPool;
+
+/// Localizes a list of stacks one after another with overlapping runs
+/** Every stack is localized once per parameter set. The next run is opened
+    and decoded as soon as the reader of the previous one is done, so its read
+    and filter stages run while the previous run is still in find, estimate
+    and insert. At most maxRunsInFlight runs are processed at the same time,
+    all of them on one WorkStealingPool of numThreads workers.
+**/
+class BatchScheduler
+{
+  public:
+    BatchScheduler(int numThreads, int numDecoders, int maxRunsInFlight = 2);
+    ~BatchScheduler();
+
+    static QStringList collectStacks(const QStringList &paths);
+
+    void setLive(int idleTimeout, int snapshotInterval);
+    inline void setFrameQueueCapacity(int capacity) { frameQueueCapacity = capacity; }
+    inline void setSpotQueueCapacity(int capacity) { spotQueueCapacity = capacity; }
+    inline void setFuseFilterFind(bool fuse) { fuseFilterFind = fuse; }
+
+    int run(const QStringList &fileNames, double camPixelSize, double resPixelSize, QTextStream &out);
+    int run(const QStringList &fileNames, QList<LocalizationRun::Parameters> const& parameterSets,
+            double camPixelSize, double resPixelSize, QTextStream &out);
+
+  private:
+    void finishOldest(QTextStream &out);
+
+    int numThreads;
+    int numDecoders;
+    int maxRunsInFlight;
+    int liveTimeout;
+    int snapshotInterval;
+    int frameQueueCapacity;
+    int spotQueueCapacity;
+    bool fuseFilterFind;
+    int numSpots;
+
+    std::unique_ptr<WorkStealingPool> pool;
+    QList<PipelineRunner*> inFlight;
+};
+
+#endif // BATCHSCHEDULER_H
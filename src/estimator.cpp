@@ -1,58 +1,36 @@
 #include "qtfiles.h"
 
+#include <QTextStream>
+#include <QElapsedTimer>
+
+#include <algorithm>
 #include <math.h>
 
 #include "estimator.h"
+#include "ImageStack/img_kernels.hpp"
 #include <unistd.h>
 
-#define ROISIZE 7
-#define ROIRAD  (ROISIZE-1)/2
 #define CATCHROIS 100000
 
-//default values
-int Estimator::threasholdFactor = 3;
-int Estimator::cutoffFactor = 2;
-double Estimator::separateFactor = 0.7;
-
-ThreadSaveQueue< image16_ref > Estimator::toFilterQueue;
-ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > Estimator::toFindQueue;
-ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > Estimator::toSaveQueue;
-ThreadSaveQueue< Roi > Estimator::toPrintQueue;
-ThreadSaveQueue< Roi > Estimator::roiQueue;
-ThreadSaveQueue< Roi::Result > Estimator::resultQueue;
-
-QMutex estimateMutex;
-QMutex fillLokImgMutex;
-
-QVector<int> Estimator::meanBgVec;
-
-image16_ref * Estimator::resultImage = nullptr;
-
-img_stack* Estimator::tiffStack  = nullptr;
-img_stack* Estimator::firStack  = nullptr;
-img_stack* Estimator::diffStack = nullptr;
-
-double Estimator::dataPixelSize = 0;
-double Estimator::lokImgPixelSize = 0;
-
-int Estimator::dimZ = 0;
-
-int Estimator::currResNr = 0;
-
-std::atomic<uint32_t> Estimator::deletedRois(0);
-
-QString Estimator::currFileName="lokImg.tif";
-QFile Estimator::resultFile;
-QFile Estimator::challengeFile;
-QFile Estimator::loggerFile;
-QTime Estimator::globalWatch;
+/// Smallest pixel value that is not below the threshold, above UINT16_MAX if there is none
+static inline int spotMinimum(double threashold)
+{
+  // a NaN threshold let every pixel through
+  if(!(threashold > 0)){
+    return 0;
+  }
+  return (threashold > UINT16_MAX)? UINT16_MAX+1 : (int) ceil(threashold);
+}
 
 
-Estimator::Estimator(int _id, QObject *parent)
+Estimator::Estimator(int _id, LocalizationRun *_run, QObject *parent)
 : QObject(parent),
   id(_id),
+  run(_run),
+  nextIntermediate(100),
   bgimg(nullptr)
 {
+  snapshotWatch.start();
 }
 
 Estimator::~Estimator()
@@ -61,117 +39,29 @@ Estimator::~Estimator()
     delete bgimg;
     bgimg = nullptr;
   }
+  for(auto roi : spareRois){
+    delete roi;
+  }
   qDebug() << "Estimator deleted" << id;
 }
 
-void Estimator::closeFiles()
-{
-  if(resultFile.isOpen())
-    resultFile.close();
-
-  if(challengeFile.isOpen())
-  challengeFile.close();
-
-  if(loggerFile.isOpen())
-    loggerFile.close();
-}
-
-void Estimator::close()
-{
-  closeFiles();
-
-  toFilterQueue.close();
-  toFindQueue.close();
-  toPrintQueue.close();
-  toSaveQueue.close();
-  roiQueue.close();
-  resultQueue.close();
-}
-
+#ifndef HEADLESS
 bool Estimator::initEstimatorStatics()
 {
     QString fileName = QFileDialog::getOpenFileName(0, tr("Open File"),
                                                     QDir::currentPath(),
-                                                    tr("TiffImages (*.tif *.tiff)"));
+                                                    tr("TiffImages (*.tif *.tiff *.btf *.tf8)"));
    if(fileName.isEmpty()){
       return false;
    }
 
-   dataPixelSize = 100.0;
-   lokImgPixelSize = 10.0;
+   double dataPixelSize = QInputDialog::getDouble(nullptr,"Set Data Pixel Size","Define camera pixel dimensions in nanometers",102,1,2000,0);
+   double lokImgPixelSize = QInputDialog::getDouble(nullptr,"Set Lokalisation image Pixel Size","Define pixel dimensions of final lokalization image in nanometers",10,0.01,2000,1);
 
-   dataPixelSize = QInputDialog::getDouble(nullptr,"Set Data Pixel Size","Define camera pixel dimensions in nanometers",102,1,2000,0);
-   lokImgPixelSize = QInputDialog::getDouble(nullptr,"Set Lokalisation image Pixel Size","Define pixel dimensions of final lokalization image in nanometers",10,0.01,2000,1);
-
-   return initEstimatorStatics(dataPixelSize,lokImgPixelSize,fileName);
+   return run->init(dataPixelSize,lokImgPixelSize,fileName);
 }
-
-bool Estimator::initEstimatorStatics(double camPixelSize, double resPixelSize, QString fileName)
-{
-  QFileInfo info(fileName);
-  currFileName = info.baseName();
-
-  QDir::setCurrent(info.absolutePath());
-
-  tiffStack = new img_stack(fileName.toStdString(),std::string("r"));
-
-#ifdef SAVE
-  firStack  = new img_stack((currFileName+"_fir.tif").toStdString(),std::string("w"));
-  diffStack = new img_stack((currFileName+"_bg.tif" ).toStdString(),std::string("w"));
 #endif
 
-  dataPixelSize = camPixelSize;
-  lokImgPixelSize = resPixelSize;
-
-  if(resultFile.isOpen()){
-    resultFile.close();
-  }
-
-  resultFile.setFileName(info.baseName()+"_locations.txt");
-  if (!resultFile.open(QIODevice::WriteOnly | QIODevice::Text))
-    qDebug()<< "error: result file could not be opened!";
-
-  if(challengeFile.isOpen()){
-    challengeFile.close();
-  }
-  challengeFile.setFileName(info.baseName()+"_result_locations.csv");
-  if (!challengeFile.open(QIODevice::WriteOnly | QIODevice::Text))
-      qDebug()<< "error: challenge file could not be opened!";
-
-
-  if(loggerFile.isOpen()){
-      loggerFile.close();
-  }
-  loggerFile.setFileName(info.baseName()+"_log.txt");
-  if (!loggerFile.open(QIODevice::WriteOnly | QIODevice::Text))
-      qDebug()<< "error: result file could not be opened!";
-
-
-  logHeader();
-
-  dimZ = tiffStack->img_count();
-
-  currResNr = 0;
-  deletedRois = 0;
-
-  resultImage = new image16_ref((double)tiffStack->get_image(0).get_length()*dataPixelSize/lokImgPixelSize,
-                                tiffStack->get_image(0).get_width()*dataPixelSize/lokImgPixelSize,
-                                tiffStack->get_image(0).get_bits_per_pixel(),0);
-
-  meanBgVec.clear();
-
-  toFilterQueue.reset();
-  toFindQueue.reset();
-  toPrintQueue.reset();
-  toSaveQueue.reset();
-  roiQueue.reset();
-  resultQueue.reset();
-
-  globalWatch.restart();
-
-  return true;
-}
-
 
 //void Estimator::load()
 //{
@@ -185,7 +75,7 @@ bool Estimator::initEstimatorStatics(double camPixelSize, double resPixelSize, Q
 
 void Estimator::read()
 {
-  emit maxImage(dimZ);
+  emit maxImage(run->dimZ);
 
   generateFirstBGImage();
 
@@ -198,87 +88,112 @@ void Estimator::read()
 
 void Estimator::generateFirstBGImage()
 {
-  bgimg = new image16_ref(tiffStack->get_image(0));
+  bgimg = new image16_ref(run->tiffStack->get_image(0));
   for(int i=1; i<4; i++){
-    *bgimg += tiffStack->get_image(i);
+    *bgimg += run->tiffStack->get_image(i);
   }
   *bgimg >>=2;
 }
 
 void Estimator::generateDiffImages(double bgWeight)
 {
-  toFilterQueue.signUp();
-  toFilterQueue.setThreashold(dimZ/10);
+  run->toFilterQueue.signUp();
+  run->toFilterQueue.setThreashold(run->frameThreashold());
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" diff start " << toFilterQueue.size() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" diff start " << run->toFilterQueue.size() << "\n";
 #endif
   QTime readWatch;
   readWatch.start();
-  for(int z=0; z<dimZ; z++){
+  int z = 0;
+  for(; run->waitForFrame(z); z++){
 
-    image16_ref *diffimg = new image16_ref(tiffStack->get_image(z));
+    image16_ref *diffimg = nullptr;
+    if(run->numDecoders>0){
+      if(!run->decodeQueue.pop_next(diffimg)){
+        break;
+      }
+    }else{
+      diffimg = run->framePool.acquire(run->frameLength,run->frameWidth,z);
+      run->tiffStack->read_image(z,*diffimg);
+    }
 
     int meanbg = diffimg->subtr_and_update_bg(*bgimg,bgWeight);
-    meanBgVec.push_back(meanbg);
-    toFilterQueue.push_back(diffimg);
+    run->setMeanBackground(z,meanbg);
+    run->toFilterQueue.push_back(diffimg);
+
+    if(run->liveTimeout>0 && z%100 == 0){
+      emit maxImage(run->dimZ);
+    }
   }
 
   qDebug() << "++++readTime:" << readWatch.elapsed();
-  qDebug() <<"\n" << globalWatch.elapsed() << "++++Estimator"<< id <<"Last Image Subtracted" <<dimZ-1;
+  qDebug() <<"\n" << run->globalWatch.elapsed() << "++++Estimator"<< id <<"Last Image Subtracted" <<z-1;
+
+  out << "Estimator "<< id << "  Elapsed time " << run->globalWatch.elapsed() << "  Background subtracting - num frames: " <<z-1 << "\n";
 
-  out << "Estimator "<< id << "  Elapsed time " << globalWatch.elapsed() << "  Background subtracting - num frames: " <<dimZ-1 << "\n";
+  run->toFilterQueue.finish();
 
-  toFilterQueue.finish();
+  delete run->tiffStack;
+  run->tiffStack = nullptr;
+}
 
-  delete tiffStack;
+/// Decode frames of the stack in parallel to the background subtraction in read()
+void Estimator::decode()
+{
+  img_stack stack(run->stackPath.toStdString(),std::string("r"));
+  if(!stack.good()){
+    qDebug() << "Decoder" << id << "could not open" << run->stackPath;
+    run->decodeQueue.close();
+    emit finished(id);
+    return;
+  }
+
+  int z = 0;
+  while(run->decodeQueue.nextFrame(z)){
+    image16_ref *frame = run->framePool.acquire(run->frameLength,run->frameWidth,z);
+    stack.read_image(z,*frame);
+    run->decodeQueue.push(z, frame);
+  }
+
+  emit finished(id);
 }
 
 void Estimator::filter()
 {
   int sliceNr = -1;
-  toFindQueue.signUp();
-  toFindQueue.setThreashold(dimZ/10);
+  run->toFindQueue.signUp();
+  run->toFindQueue.setThreashold(run->frameThreashold());
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" filter sleep " << toFilterQueue.size() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" filter sleep " << run->toFilterQueue.size() << "\n";
 #endif
 
   image16_ref *diffImg = nullptr;
 
-  while(toFilterQueue.pop_front(diffImg))
+  while(run->toFilterQueue.pop_front(diffImg))
   {
     sliceNr = diffImg->get_dir_number();
 
-    image16_ref *firImg = new image16_ref(diffImg->get_length(),diffImg->get_width(),diffImg->get_scanline_size(),diffImg->get_dir_number());
-    if(!firImg){
-      qDebug() << "Filter: not enough Memory";
-      throw "Filter: Out of memory";
-    }
-
-    diffImg->apply_highpass(1,firImg);
-
-    toFindQueue.push_back(new QPair< image16_ref*,image16_ref* >(diffImg,firImg) );
+    filterFrame(diffImg);
 
-    if( toFindQueue.size()>=100 )
-    {
-      emit firProgress(sliceNr);
 #ifdef LOG
-      out << globalWatch.elapsed() <<" "<< id <<" filter " << toFindQueue.size() << " " << toFindQueue.getNumHandles() << "\n";
-#endif
+    if( run->toFindQueue.size()>=100 ){
+      out << run->globalWatch.elapsed() <<" "<< id <<" filter " << run->toFindQueue.size() << " " << run->toFindQueue.getNumHandles() << "\n";
     }
+#endif
   }
 
-  qDebug() << globalWatch.elapsed() << "Estimator"<< id <<"Last Image Filtered" <<sliceNr;
+  qDebug() << run->globalWatch.elapsed() << "Estimator"<< id <<"Last Image Filtered" <<sliceNr;
 
-  toFilterQueue.close();  
-  toFindQueue.finish();
+  run->toFilterQueue.close();  
+  run->toFindQueue.finish();
 
 
 #ifdef LOG
-  out << "Estimator "<< id << "  Elapsed time " << globalWatch.elapsed()  <<" Image filtering - num frames: " <<sliceNr << "\n";
+  out << "Estimator "<< id << "  Elapsed time " << run->globalWatch.elapsed()  <<" Image filtering - num frames: " <<sliceNr << "\n";
 #endif
 
 #ifdef CHAIN
@@ -289,6 +204,33 @@ void Estimator::filter()
 }
 
 
+/// Filter one frame and hand it on to find(), or search it right away if the run fuses both
+void Estimator::filterFrame(image16_ref *diffImg)
+{
+  const int sliceNr = diffImg->get_dir_number();
+
+#ifndef SAVE
+  if(run->fuseFilterFind){
+    filterFindFrame(diffImg);
+    emit firProgress(sliceNr);
+    return;
+  }
+#endif
+
+  image16_ref *firImg = run->framePool.acquire(diffImg->get_length(),diffImg->get_width(),sliceNr);
+  if(!firImg){
+    qDebug() << "Filter: not enough Memory";
+    throw "Filter: Out of memory";
+  }
+
+  diffImg->apply_highpass(1,firImg);
+
+  run->toFindQueue.push_back(new QPair< image16_ref*,image16_ref* >(diffImg,firImg) );
+
+  // the queue is bounded by frameQueueCapacity, its depth says nothing about the progress
+  emit firProgress(sliceNr);
+}
+
 void Estimator::findAll()
 {
   find();
@@ -296,62 +238,34 @@ void Estimator::findAll()
 
 void Estimator::find()
 {
-  int padding = 3;
-
-  roiQueue.signUp();
-  roiQueue.setThreashold(3000);
-  toSaveQueue.signUp();
-  toSaveQueue.setThreashold(dimZ/10);
+  run->roiQueue.signUp();
+  run->roiQueue.setThreashold(3000);
+  run->toSaveQueue.signUp();
+  run->toSaveQueue.setThreashold(run->frameThreashold());
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" find start " << toFindQueue.size() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" find start " << run->toFindQueue.size() << "\n";
 #endif
 
   QPair< image16_ref*,image16_ref* > * findPair = nullptr;
 
-  while(toFindQueue.pop_front(findPair))
+  while(run->toFindQueue.pop_front(findPair))
   {
-    image16_ref * diffImg = findPair->first;
-    image16_ref * firImg  = findPair->second;
-
-    int sliceNr = firImg->get_dir_number();
-
-    double threashold = threasholdFactor * sqrt(meanBgVec[sliceNr]);
-    int dimX = firImg->get_width();
-    int dimY = firImg->get_length();
-
-    const auto diffData = diffImg->get_data();
-    const auto firData  = firImg->get_data();
-
-    for(int y=padding; y<dimY-padding; y++){
-      for(int x=padding; x<dimX-padding; x++){
-        if(isMax(firData,x,y,threashold)){
-           separate(x,y,sliceNr,diffData);
-        }
-      }
-    }
-
-#ifdef SAVE
-    toSaveQueue.push_back(findPair);
-#else
-    delete findPair;
-    delete firImg;
-    delete diffImg;
-#endif        
+    findFrame(findPair);
   }
 
-  qDebug() << globalWatch.elapsed() << "Estimator" << id << "Last image Searched";
+  qDebug() << run->globalWatch.elapsed() << "Estimator" << id << "Last image Searched";
 
-  toFindQueue.close();
-  roiQueue.finish();
+  run->toFindQueue.close();
+  run->roiQueue.finish();
 
 #ifdef LOG
-  out << "Estimator " << id << "  Elapsed time " << globalWatch.elapsed() <<  "  Searching spots - num frames: "<< toFindQueue.getNumHandles() << "\n";
+  out << "Estimator " << id << "  Elapsed time " << run->globalWatch.elapsed() <<  "  Searching spots - num frames: "<< run->toFindQueue.getNumHandles() << "\n";
 #endif
 
 #ifdef SAVE
-  toSaveQueue.finish();
+  run->toSaveQueue.finish();
 #endif
 
 #ifdef CHAIN
@@ -361,165 +275,224 @@ void Estimator::find()
   emit finished(id);
 }
 
-bool Estimator::isMax( uint16_t const *const * data, int posX, int posY, double threashold)
+/// Filter and search one frame in one pass, the filtered frame is never stored
+/** The filtered rows are made one ahead of the row being searched and only
+    the three rows findMaxima() looks at are kept, so the pass stays in the cache
+    and finds the same spots, in the same order, as filterFrame() and
+    findFrame() one after the other.
+**/
+void Estimator::filterFindFrame(image16_ref *diffImg)
 {
-  int midValue = data[posY][posX];
-  if(midValue<threashold){
-    return false;
-  }
+  const int padding = run->roiKernels->size/2;   // a spot must fit in the frame
 
-  int topValue = data[posY-1][posX];
-  if(midValue==topValue){
-    return false;
-  }
+  const int sliceNr = diffImg->get_dir_number();
 
-  int leftValue = data[posY][posX-1];
-  if(midValue==leftValue){
-    return false;
-  }
+  double threashold = run->params.threasholdFactor * sqrt(run->meanBackground(sliceNr));
+  int dimX = diffImg->get_width();
+  int dimY = diffImg->get_length();
 
-  for(int y=-1; y<=1; y++ ){
-    int Y = posY+y;
-    for(int x=-1; x<=1; x++ ){
-      int surValue = data[Y][posX+x];
-      if(midValue<surValue){
-         return false;
-      }
+  const auto diffData = diffImg->get_data();
+
+  firRows.resize(3*dimX);
+  auto firRow = [&](int y){ return &firRows[(y%3)*dimX]; };
+
+  image16_highpass highpass(*diffImg,1);
+
+  const int minimum = spotMinimum(threashold);
+
+  uint16_t const * rows[3];
+  for(int y=padding; y<dimY-padding; y++){
+    if(y == padding){
+      highpass.filter_row(y-1,firRow(y-1));
+      highpass.filter_row(y,  firRow(y));
     }
+    highpass.filter_row(y+1,firRow(y+1));
+
+    rows[0] = firRow(y-1);
+    rows[1] = firRow(y);
+    rows[2] = firRow(y+1);
+
+    findMaxima(rows,y,dimX,minimum);
   }
 
-  return true;
+  separateMaxima(sliceNr,diffData);
+
+  run->releaseFoundSpots(sliceNr,roiBatch,nullptr);
+
+  run->framePool.release(diffImg);
 }
 
-void Estimator::separate(int posX, int posY, int sliceNr, const uint16_t *const*data)
+/// Search one frame for spots, they are passed on in frame order
+void Estimator::findFrame(QPair< image16_ref*,image16_ref* > *findPair)
 {
+  const int padding = run->roiKernels->size/2;
 
-  double meanbg = meanBgVec.at(sliceNr);
+  image16_ref * diffImg = findPair->first;
+  image16_ref * firImg  = findPair->second;
 
-  Roi *roi = new Roi(posX-ROIRAD,posY-ROIRAD,sliceNr,meanbg,ROISIZE,ROISIZE);
+  int sliceNr = firImg->get_dir_number();
 
-  double cutoff = cutoffFactor*sqrt(meanbg);
+  double threashold = run->params.threasholdFactor * sqrt(run->meanBackground(sliceNr));
+  int dimX = firImg->get_width();
+  int dimY = firImg->get_length();
 
-  int QOld = 0;
-  for(int y=0; y<ROISIZE; y++){
-    for(int x=0; x<ROISIZE; x++){
-      quint16 value = (quint16) data[posY-ROIRAD+y][posX-ROIRAD+x];
-      value = (value>cutoff)? value-cutoff : 0;
-      QOld += value;
-      roi->setValue(value,x,y);
-    }
+  const auto diffData = diffImg->get_data();
+  const auto firData  = firImg->get_data();
+
+  const int minimum = spotMinimum(threashold);
+
+  for(int y=padding; y<dimY-padding; y++){
+    findMaxima(&firData[y-1],y,dimX,minimum);
   }
 
-  int QNew = roi->cutEdges();
+  separateMaxima(sliceNr,diffData);
 
-  if(QNew > (QOld * separateFactor)){
-    roiQueue.push_back(roi);
-  }else{
-    deletedRois++;
-    delete roi;
+#ifdef SAVE
+  run->releaseFoundSpots(sliceNr,roiBatch,findPair);
+#else
+  run->releaseFoundSpots(sliceNr,roiBatch,nullptr);
+
+  delete findPair;
+  run->framePool.release(firImg);
+  run->framePool.release(diffImg);
+#endif
+}
+
+/// Append the local maxima of a row of the filtered frame to maxima
+/** A maximum must reach the minimum, no neighbour may be bigger and its top
+    and left neighbour must be smaller.
+    @param rows The filtered rows posY-1, posY and posY+1
+    @param minimum Smallest value a spot may have, see spotMinimum()
+**/
+void Estimator::findMaxima(uint16_t const *const *rows, int posY, int dimX, int minimum)
+{
+  const int padding = run->roiKernels->size/2;
+
+  if(minimum > UINT16_MAX){
+    return;
+  }
+
+  maxCols.resize(dimX);
+  const int found = local_max_row(rows,padding,dimX-padding,(uint16_t) minimum,maxCols.data());
+  for(int i=0; i<found; i++){
+    maxima.push_back(QPoint(maxCols[i],posY));
+  }
+}
+
+/// Separate a spot around every maximum of the frame, in the order they were found
+/** The edges of all spots of the frame are cut together, see Roi::separate().
+**/
+void Estimator::separateMaxima(int sliceNr, const uint16_t *const*data)
+{
+  if(maxima.empty()){
+    return;
+  }
+
+  double meanbg = run->meanBackground(sliceNr);
+  double cutoff = run->params.cutoffFactor*sqrt(meanbg);
+
+  Roi::Kernels const& kernels = *run->roiKernels;
+  const int rad = kernels.size/2;
+
+  for(const QPoint & pos : maxima){
+    candidates.push_back(newRoi(pos.x()-rad,pos.y()-rad,sliceNr,meanbg,kernels.size,kernels.size));
+  }
+  maxima.clear();
+
+  qOld.resize(candidates.size());
+  qNew.resize(candidates.size());
+  Roi::separate(kernels,candidates.data(),candidates.size(),data,cutoff,qOld.data(),qNew.data());
+
+  for(size_t i=0; i<candidates.size(); i++){
+    if(qNew[i] > (qOld[i] * run->params.separateFactor)){
+      roiBatch.push_back(candidates[i]);
+    }else{
+      run->deletedRois++;
+      freeRoi(candidates[i]);
+    }
   }
+  candidates.clear();
 }
 
 void Estimator::estimate()
 {
 
-  resultQueue.signUp();
-  resultQueue.setThreashold(1000);
+  run->resultQueue.signUp();
+  run->resultQueue.setThreashold(0);   // a chunk holds many results already
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" estimate start " << roiQueue.size() << " " << roiQueue.getNumHandles() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" estimate start " << run->roiQueue.size() << " " << run->roiQueue.getNumHandles() << "\n";
 #endif
 
-  Roi *roi = nullptr;
+  std::vector<Roi*> rois;
+  uint64_t batchNr;
 
-  while(roiQueue.pop_front(roi))
+  while(run->takeSpots(rois,batchSize,true,batchNr))
   {
 #ifdef LOG
-    out << globalWatch.elapsed() <<" "<< id <<" estimate " << roiQueue.size() << " " << roiQueue.getNumHandles() << "\n";
+    out << run->globalWatch.elapsed() <<" "<< id <<" estimate " << run->roiQueue.size() << " " << run->roiQueue.getNumHandles() << "\n";
 #endif
 
-    Roi::Result * res = roi->calc();
-    delete roi;
-
-    res->convertMetric(dataPixelSize);
-
-    printResults(res);
-
-    resultQueue.push_back(res);
+    // the run passes the chunk on to resultQueue once it is printed
+    ResultTable::Chunk *results = run->results.acquire();
+    estimateInto(*results,rois);
+    run->releaseResults(batchNr,results,true);
   }
 
-  roiQueue.close();
-  resultQueue.finish();
+  run->roiQueue.close();
+  run->resultQueue.finish();
 
 #ifdef CHAIN
   generateSpotFromPendingResults();
 #endif
 
-  closeFiles();
+  run->closeFiles();
 
   emit finished(id);
 }
 
-void Estimator::printResults(Roi::Result * res)
+/// Estimate a batch of spots into an empty chunk, the spots are freed
+void Estimator::estimateInto(ResultTable::Chunk & results, std::vector<Roi*> const& rois)
 {
-  QTextStream challengeOut(&challengeFile);
-  QTextStream out(&resultFile);
+  static_assert(batchSize <= ResultTable::Chunk::capacity, "a chunk holds the results of a batch");
 
-  QMutexLocker locker(&estimateMutex);
+  batchResults.resize(rois.size());
+  run->spotEstimator->estimate(rois.data(),rois.size(),batchResults.data());
 
-  out << currResNr++    << "\t";
-  out << res->QMax      << "\t";
-  out << res->mx        << "\t";
-  out << res->my        << "\t";
-  out << sqrt(res->dx2) << "\t";
-  out << sqrt(res->dy2) << "\t";
-  out << sqrt(res->sx2) << "\t";
+  for(size_t i=0; i<rois.size(); i++){
+    freeRoi(rois[i]);
 
-  out << sqrt(res->sy2) << "\t";
-  out << res->gesQ      << "\t";
-  out << res->sliceNr   << "\n";
-
-  challengeOut << res->mx      << ";";
-  challengeOut << res->my      << ";";
-  challengeOut << 0            << ";";
-  challengeOut << res->sliceNr << ";";
-  challengeOut << res->gesQ    << "\n";
+    batchResults[i].convertMetric(run->dataPixelSize);
+    results.append(batchResults[i]);
+  }
 }
 
 void Estimator::estimateGenerate()
 {
-  toPrintQueue.signUp();
-  toPrintQueue.setThreashold(100);
+  run->toPrintQueue.signUp();
+  run->toPrintQueue.setThreashold(100);
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id<<" estimateGenerate start " << roiQueue.size() << " " << roiQueue.getNumHandles() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id<<" estimateGenerate start " << run->roiQueue.size() << " " << run->roiQueue.getNumHandles() << "\n";
 #endif
 
-  Roi *roi = nullptr;
+  std::vector<Roi*> rois;
+  uint64_t batchNr;
 
-  while(roiQueue.pop_front(roi))
+  while(run->takeSpots(rois,batchSize,true,batchNr))
   {
 
 #ifdef LOG
-    out << globalWatch.elapsed() <<" "<< id <<" estimateGenerate " << roiQueue.size() << " " << roiQueue.getNumHandles() << "\n";
+    out << run->globalWatch.elapsed() <<" "<< id <<" estimateGenerate " << run->roiQueue.size() << " " << run->roiQueue.getNumHandles() << "\n";
 #endif
 
-    Roi::Result * res = roi->calc();
-    delete roi;
-
-    res->convertMetric(dataPixelSize);
-
-    printResults(res);
-
-    Roi * genRoi = generateSpot(res);
-
-    toPrintQueue.push_back(genRoi);
+    estimateGenerateBatch(rois,batchNr);
   }
 
-  roiQueue.close();
-  toPrintQueue.finish();
+  run->roiQueue.close();
+  run->toPrintQueue.finish();
 
 #ifdef CHAIN
 #ifdef SAVE
@@ -530,64 +503,100 @@ void Estimator::estimateGenerate()
   emit finished(id);
 }
 
+/// Fit a batch of spots, print the results and pass the generated spots on
+/** @param batchNr number LocalizationRun::takeSpots() gave the batch
+**/
+void Estimator::estimateGenerateBatch(std::vector<Roi*> const& rois, uint64_t batchNr)
+{
+  ResultTable::Chunk *results = run->results.acquire();
+  estimateInto(*results,rois);
+
+  for(int row=0; row<results->count; row++){
+    roiBatch.push_back(generateSpot(*results,row));
+  }
+  // rendered already, the run recycles the chunk once it is printed
+  run->releaseResults(batchNr,results,false);
+
+  run->toPrintQueue.push_many(roiBatch);
+}
+
 void Estimator::saveStacks()
 {
   qDebug() << "Saving Background and Filtered Stacks! Hold on...";
 
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" save sleep " << toSaveQueue.size() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" save sleep " << run->toSaveQueue.size() << "\n";
 #endif
 
   QPair< image16_ref*,image16_ref* > * savePair = nullptr;
 
-  while(toSaveQueue.pop_front(savePair))
+  while(run->toSaveQueue.pop_front(savePair))
   {
-    image16_ref * diffImg = savePair->first;
-    image16_ref * firImg  = savePair->second;
-
 #ifdef LOG
-    out << globalWatch.elapsed() <<" "<< id <<" save " << toSaveQueue.size() << "\n";
+    out << run->globalWatch.elapsed() <<" "<< id <<" save " << run->toSaveQueue.size() << "\n";
 #endif
-    diffStack->append_image(*diffImg);
-    firStack ->append_image(*firImg);
-
-    delete savePair;
-    delete diffImg;
-    delete firImg;
+    saveFrame(savePair);
   }
 
-  toSaveQueue.close();
+  run->toSaveQueue.close();
 
   emit finished(id);
 
-  delete diffStack;
-  delete firStack;
+  closeSavedStacks();
+}
+
+/// Append the background and filtered image of one frame to the saved stacks
+void Estimator::saveFrame(QPair< image16_ref*,image16_ref* > *savePair)
+{
+  image16_ref * diffImg = savePair->first;
+  image16_ref * firImg  = savePair->second;
+
+  run->diffStack->append_image(*diffImg);
+  run->firStack ->append_image(*firImg);
+
+  delete savePair;
+  run->framePool.release(diffImg);
+  run->framePool.release(firImg);
+}
+
+void Estimator::closeSavedStacks()
+{
+  delete run->diffStack;
+  delete run->firStack;
+  run->diffStack = nullptr;
+  run->firStack  = nullptr;
 }
 
 void Estimator::generateSpotFromPendingResults()
 {
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" generateSpot sleep " << resultQueue.size() << " " << resultQueue.getNumHandles() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" generateSpot sleep " << run->resultQueue.size() << " " << run->resultQueue.getNumHandles() << "\n";
 #endif
 
-  toPrintQueue.signUp();
+  run->toPrintQueue.signUp();
 
-  Roi::Result * res = nullptr;
+  std::vector<ResultTable::Chunk*> chunks;
+  std::vector<Roi*> genRois;
 
-  while(resultQueue.pop_front(res))
+  while(run->resultQueue.pop_many(chunks,1))
   {
 #ifdef LOG
-    out << globalWatch.elapsed() <<" "<< id <<" generateSpot " << resultQueue.size() << " " << resultQueue.getNumHandles() << "\n";
+    out << run->globalWatch.elapsed() <<" "<< id <<" generateSpot " << run->resultQueue.size() << " " << run->resultQueue.getNumHandles() << "\n";
 #endif
-    Roi * genRoi = generateSpot(res);
+    for(auto results : chunks){
+      for(int row=0; row<results->count; row++){
+        genRois.push_back(generateSpot(*results,row));
+      }
+      run->results.release(results);
+    }
 
-    toPrintQueue.push_back(genRoi);
+    run->toPrintQueue.push_many(genRois);
   }
 
-  resultQueue.close();
-  toPrintQueue.finish();
+  run->resultQueue.close();
+  run->toPrintQueue.finish();
 
 #ifdef CHAIN
 #ifdef SAVE
@@ -598,85 +607,91 @@ void Estimator::generateSpotFromPendingResults()
 
 }
 
-void Estimator::insertRoi(Roi * roi)
+void Estimator::insertRois(std::vector<Roi*> const& rois)
 {
-  const auto pos =  roi->getGlobalPos();
-  const int posX = pos.first;
-  const int posY = pos.second;
+  QMutexLocker locker(&run->fillLokImgMutex);
+  const int width  = run->resultImage->get_width();
+  const int length = run->resultImage->get_length();
 
-  const auto roiSize = roi->getSize();
-  const int dimX = roiSize.first;
-  const int dimY = roiSize.second;
+  uint16_t *const *data = run->resultImage->get_data();
 
-  QMutexLocker locker(&fillLokImgMutex);
-  const int width  = resultImage->get_width();
-  const int length = resultImage->get_length();
+  for(auto roi : rois){
+    const auto pos =  roi->getGlobalPos();
+    const int posX = pos.first;
+    const int posY = pos.second;
 
-  uint16_t *const *data = resultImage->get_data();
-  for(int y=0; y<dimY; y++){
-    for(int x=0; x<dimX; x++){
-      if(posX+x>0 && posX+x<width && posY+y>0 && posY+y<length){
-          data[posY+y][posX+x] += roi->val(x,y);
+    const auto roiSize = roi->getSize();
+    const int dimX = roiSize.first;
+    const int dimY = roiSize.second;
+
+    for(int y=0; y<dimY; y++){
+      for(int x=0; x<dimX; x++){
+        if(posX+x>0 && posX+x<width && posY+y>0 && posY+y<length){
+            data[posY+y][posX+x] += roi->val(x,y);
+        }
       }
     }
+
+    freeRoi(roi);
   }
+}
+
+/// Insert a batch of spots, then save a live snapshot or show an intermediate image when one is due
+void Estimator::insertBatch(std::vector<Roi*> const& rois)
+{
+  insertRois(rois);
 
-  delete roi;
+  if(run->liveTimeout>0 && snapshotWatch.elapsed() >= run->snapshotInterval){
+    run->saveResultSnapshot();
+    snapshotWatch.restart();
+  }
+
+#ifndef HEADLESS
+  if(run->toPrintQueue.getPops() >= nextIntermediate){
+    nextIntermediate += 5000;
+    emit printIntermediateImage(run->resultImage->copy());
+  }
+#endif
 }
 
 void Estimator::insertRoisInResultImage()
 {
-  QTextStream out(&loggerFile);
+  QTextStream out(&run->loggerFile);
 #ifdef LOG
-  out << globalWatch.elapsed() <<" "<< id <<" insertRois sleep " << toPrintQueue.size() << " " << toPrintQueue.getNumHandles() << "\n";
+  out << run->globalWatch.elapsed() <<" "<< id <<" insertRois sleep " << run->toPrintQueue.size() << " " << run->toPrintQueue.getNumHandles() << "\n";
 #endif
 
-  Roi * roi = nullptr;
+  std::vector<Roi*> rois;
 
-  while(toPrintQueue.pop_front(roi))
+  while(run->toPrintQueue.pop_many(rois,batchSize))
   {
 
 #ifdef LOG
-    out << globalWatch.elapsed() <<" "<< id <<" insertRois " << toPrintQueue.size() << " " << toPrintQueue.getNumHandles() << "\n";
+    out << run->globalWatch.elapsed() <<" "<< id <<" insertRois " << run->toPrintQueue.size() << " " << run->toPrintQueue.getNumHandles() << "\n";
 #endif
-    insertRoi(roi);
-
-    if(toPrintQueue.getPops()%5000 == 100){
-
-      emit printIntermediateImage(resultImage->copy());
-    }
+    insertBatch(rois);
   }
-  toPrintQueue.close();
+  run->toPrintQueue.close();
 
 #ifdef LOG
- loggerFile.close();
+ run->loggerFile.close();
 #endif
 
 #ifndef SAVE
   usleep(1000);
-  wakeAll();
+  run->wakeAll();
 #endif
 
   emit finished(id);
 }
 
 
-QString Estimator::saveResultImage()
-{
-  QString resultName = currFileName+"_lokimg.tiff";
-
-  img_stack saveLokImgStack(resultName.toStdString(),"w");
-  saveLokImgStack.append_image(*resultImage);
-
-  delete resultImage;
-  resultImage = nullptr;
-
-  return resultName;
-}
-
-
+#ifndef HEADLESS
 void Estimator::runSingleThreaded()
 {
+  // every stage drains its input before the next one starts
+  run->frameQueueCapacity = 0;
+  run->spotQueueCapacity = 0;
   initEstimatorStatics();
 
   read();
@@ -693,9 +708,9 @@ void Estimator::runSingleThreaded()
 
   insertRoisInResultImage();
 
-  saveResultImage();
+  run->saveResultImage();
 
-  closeFiles();
+  run->closeFiles();
 }
 
 void Estimator::generateNewStack()
@@ -720,6 +735,7 @@ void Estimator::generateNewStack()
     delete newImage;
   }
 }
+#endif
 
 image16_ref* Estimator::fillNewImage(int nrSpots, int length, int width, int dir_nr)
 {
@@ -776,21 +792,19 @@ void Estimator::addNewSpot(image16_ref *newImage)
 
   insertSpot(newImage,roi,posX,posY);
 
-  delete roi;
+  freeRoi(roi);
 }
 
-Roi * Estimator::generateSpot(Roi::Result * res)
+Roi * Estimator::generateSpot(ResultTable::Chunk const& results, int row)
 {
-  double widthX =  (sqrt(res->dx2)/lokImgPixelSize);
-  double widthY =  (sqrt(res->dy2)/lokImgPixelSize);
+  double widthX =  (sqrt(results.dx2[row])/run->lokImgPixelSize);
+  double widthY =  (sqrt(results.dy2[row])/run->lokImgPixelSize);
   double meanwidth = (widthX+widthY)/2.0;
 
   int rad = 3 + ((meanwidth>1)? meanwidth*2 : 0);
 
-  int globalX = res->mx/lokImgPixelSize - rad;
-  int globalY = res->my/lokImgPixelSize - rad;
-
-  delete res;
+  int globalX = results.mx[row]/run->lokImgPixelSize - rad;
+  int globalY = results.my[row]/run->lokImgPixelSize - rad;
 
   int dimX = (rad*2)+1;
   int dimY = dimX;
@@ -809,7 +823,7 @@ Roi * Estimator::generateSpot(Roi::Result * res)
 
 Roi * Estimator::generateSpot(int Qmax, double mx, double my, double sigma, int dimX, int dimY)
 {
-  Roi * roi= new Roi(0,0,0,0,dimX,dimY);
+  Roi * roi= newRoi(0,0,0,0,dimX,dimY);
 
   for(int y=0; y<dimY; y++){
     for(int x=0; x<dimX; x++){
@@ -820,6 +834,28 @@ Roi * Estimator::generateSpot(int Qmax, double mx, double my, double sigma, int
   return roi;
 }
 
+/// A Roi from the spare list, its pixels are left over and have to be set
+Roi *Estimator::newRoi(int posX, int posY, int sliceNr, int meanbg, int dimX, int dimY)
+{
+  if(spareRois.empty()){
+    run->roiPool.acquire(spareRois);
+  }
+
+  Roi *roi = spareRois.back();
+  spareRois.pop_back();
+  roi->reset(posX,posY,sliceNr,meanbg,dimX,dimY);
+  return roi;
+}
+
+/// Keep a Roi for newRoi(), a stage that frees more than it makes hands the surplus back to the run
+void Estimator::freeRoi(Roi *roi)
+{
+  spareRois.push_back(roi);
+  if(spareRois.size() >= 2*RoiPool::chunkSize){
+    run->roiPool.release(spareRois,RoiPool::chunkSize);
+  }
+}
+
 void Estimator::insertSpot(image16_ref *newImage, Roi *roi, int posX, int posY)
 {
   const auto roiSize = roi->getSize();
@@ -880,35 +916,3 @@ void Estimator::restartOthers()
   emit resultReady();
   emit spotReady();
 }
-
-void Estimator::wakeAll()
-{
-  toFilterQueue.wake();
-  toFindQueue.wake();
-  toSaveQueue.wake();
-  toPrintQueue.wake();
-  roiQueue.wake();
-  resultQueue.wake();
-}
-
-
-void Estimator::logHeader()
-{
-  QDateTime currTime(QDateTime::currentDateTime());
-
-  QTextStream out(&loggerFile);
-  out << "##############################################\n";
-  out << "### File: " << currFileName<< "\n";
-  out << "### Date: " << currTime.toString("hh:mm:ss  dd/MM/yyyy") << "\n";
-  out << "##############################################\n";
-  out << "### Estimator parameters:\n";
-  out << "### - Threashold factor = " << threasholdFactor<< "\n";
-  out << "### - Cutoff factor     = " << cutoffFactor<< "\n";
-  out << "### - Seperate factor   = " << separateFactor<< "\n";
-  out << "##############################################";
-  out << "### Data Parameters:\n";
-  out << "### - Number of frames  = " << dimZ<< "\n";
-  out << "### - Camera pixel size = " << dataPixelSize<< "\n";
-  out << "### - Result pixel size = " << lokImgPixelSize<< "\n";
-  out << "##############################################\n\n";
-}
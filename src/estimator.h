@@ -2,27 +2,41 @@
 #define ESTIMATOR_H
 
 #include <QObject>
+#include <QElapsedTimer>
 #include <QMutex>
 #include <QPair>
+#include <QPoint>
 #include <QFile>
 #include <QWaitCondition>
 
 #include <atomic>
+#include <cstdint>
+#include <vector>
 
-#include "threadsavequeue.h"
 #include "ImageStack/img_stack.hpp"
+#include "localizationrun.h"
+#include "resulttable.h"
 #include "roi.h"
 
-class QTime;
 class QTextStream;
 
 class Estimator : public QObject
 {
     Q_OBJECT
   public:
-    explicit Estimator(int _id, QObject *parent = 0);
+    explicit Estimator(int _id, LocalizationRun *_run, QObject *parent = 0);
     ~Estimator();
-    static void close();
+
+    static const size_t batchSize = 256;   ///< items a stage takes from its input queue at once
+
+    // one item, or one batch, of a stage; used by the stage loops and by TaskPipeline
+    void filterFrame(image16_ref *diffImg);
+    void filterFindFrame(image16_ref *diffImg);
+    void findFrame(QPair< image16_ref*,image16_ref* > *findPair);
+    void estimateGenerateBatch(std::vector<Roi*> const& rois, uint64_t batchNr);
+    void insertBatch(std::vector<Roi*> const& rois);
+    void saveFrame(QPair< image16_ref*,image16_ref* > *savePair);
+    void closeSavedStacks();
 
 
   signals:
@@ -49,9 +63,12 @@ class Estimator : public QObject
       estimate->generateSpots
     */
 
+#ifndef HEADLESS
     void runSingleThreaded();
+#endif
     //void load();
     void read();
+    void decode();
     void filter();
     void find();
     void findAll();
@@ -59,40 +76,38 @@ class Estimator : public QObject
     void generateSpotFromPendingResults();
     void insertRoisInResultImage();
 
-    void separate(int posX, int posY, int sliceNr, uint16_t const *const *data);
     void estimate();
     void estimateGenerate();
 
+#ifndef HEADLESS
     void generateNewStack();
+#endif
 
-    static void wakeAll();
     image16_ref* fillNewImage(int nrSpots, int length, int width, int dir_nr);
 
     void fillImageWithBackground(image16_ref *newImage);
     void addNewSpot(image16_ref *newImage);
 
     Roi * generateSpot(int Qmax, double mx, double my, double sigma, int dimX, int dimY);
-    Roi * generateSpot(Roi::Result * res);
+    Roi * generateSpot(ResultTable::Chunk const& results, int row);
 
     void insertSpot(image16_ref *newImage, Roi *roi,int posX,int posY);
     uint16_t expo2D(int x, int y, int A ,double mx, double my, double sig);
     uint16_t getPoissonRnd(double mean);
-    bool isMax( uint16_t const *const * data, int posX, int posY, double threashold);
+    void findMaxima(uint16_t const *const *rows, int posY, int dimX, int minimum);
+    void separateMaxima(int sliceNr, uint16_t const *const *data);
 
-    static bool initEstimatorStatics();
-    static bool initEstimatorStatics(double camPixelSize, double resPixelSize, QString fileName);
-    static void closeFiles();
+#ifndef HEADLESS
+    bool initEstimatorStatics();
+#endif
 
     void restartOthers();
 
-    static QString saveResultImage();
-
 private:
-    static void logHeader();
-    static void unlockMutexs();
-
-    void printResults(Roi::Result * res);
-    void insertRoi(Roi * roi);
+    void estimateInto(ResultTable::Chunk & results, std::vector<Roi*> const& rois);
+    void insertRois(std::vector<Roi*> const& rois);
+    Roi *newRoi(int posX, int posY, int sliceNr, int meanbg, int dimX, int dimY);
+    void freeRoi(Roi *roi);
 
 
   private slots:
@@ -103,46 +118,24 @@ private:
 
   private:
     int id;
+    LocalizationRun *run;
 
-public:
-    static QString currFileName;
-
-    static double dataPixelSize;
-    static double lokImgPixelSize;
+    std::vector<Roi*> roiBatch;   ///< spots separated in the current frame, passed on together
+    std::vector<Roi*> spareRois;  ///< freed spots, traded with the run's RoiPool a chunk at a time
+    std::vector<Roi::Result> batchResults;  ///< results of the spots the run's SpotEstimator estimates at once
+    std::vector<uint16_t> firRows;  ///< the three filtered rows findMaxima() looks at in filterFindFrame()
+    std::vector<int> maxCols;       ///< columns of the maxima in one row
+    std::vector<QPoint> maxima;     ///< maxima of the current frame, in row order
+    std::vector<Roi*> candidates;   ///< spots around the maxima, before the separation test
+    std::vector<int> qOld, qNew;    ///< sums of the candidates before and after cutting their edges
 
-    static int threasholdFactor;
-    static double separateFactor;
-    static int cutoffFactor;
+    QElapsedTimer snapshotWatch;  ///< time since the last snapshot of a live run
+    uint32_t nextIntermediate;    ///< inserted spots after which the next intermediate image is shown
 
-    static int dimZ;
+public:
     double bgWeight;
 
-    static std::atomic<uint32_t> deletedRois;
-    
     image16_ref * bgimg;
-
-    static image16_ref * resultImage;
-    static QVector<int> meanBgVec;
-
-    static img_stack *tiffStack;
-    static img_stack *diffStack;
-    static img_stack *firStack;
-
-    static int currResNr;
-
-    static QFile resultFile;
-    static QFile challengeFile;
-    static QFile loggerFile;
-
-    static ThreadSaveQueue<image16_ref > toFilterQueue;
-    static ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > toFindQueue;
-    static ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > toSaveQueue;
-    static ThreadSaveQueue< Roi > toPrintQueue;
-    static ThreadSaveQueue< Roi > roiQueue;
-    static ThreadSaveQueue< Roi::Result > resultQueue;
-
-    static QTime globalWatch;
-
 };
 
 #endif // ESTIMATOR_H
@@ -0,0 +1,61 @@
+#include "framepool.h"
+
+#include "ImageStack/img_stack.hpp"
+
+FramePool::FramePool()
+: allocations(0)
+{
+}
+
+FramePool::~FramePool()
+{
+  clear();
+}
+
+/// A frame of the given size, its pixels are left over from the frame it held before
+/** @param dirNumber Number of the frame in its stack
+**/
+image16_ref *FramePool::acquire(int length, int width, int dirNumber)
+{
+  {
+    std::lock_guard<std::mutex> lock(mt);
+    auto frames = idle.find(Size(length,width));
+    if(frames != idle.end() && !frames->second.empty()){
+      image16_ref *frame = frames->second.back();
+      frames->second.pop_back();
+      frame->set_dir_number(dirNumber);
+      return frame;
+    }
+  }
+
+  allocations++;
+  return new image16_ref(length,width,16,dirNumber);
+}
+
+/// Hand back a frame that is no longer used, nullptr is ignored
+void FramePool::release(image16_ref *frame)
+{
+  if(!frame){
+    return;
+  }
+  if(!frame->is_exclusive()){
+    delete frame;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mt);
+  idle[Size(frame->get_length(),frame->get_width())].push_back(frame);
+}
+
+/// Free all frames that were handed back and start counting allocations again
+void FramePool::clear()
+{
+  std::lock_guard<std::mutex> lock(mt);
+  for(auto & frames : idle){
+    for(auto frame : frames.second){
+      delete frame;
+    }
+  }
+  idle.clear();
+  allocations = 0;
+}
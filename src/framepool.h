@@ -0,0 +1,40 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class image16_ref;
+
+/// Frames of one run that are handed back and given out again instead of freed
+/** The reader, filter and find stages take their frames from the pool and
+    return them when they are done, so after the first frames in flight a run
+    allocates no more pixels. Frames are kept by size. A frame that shares
+    its pixels with another image or points into a mapped file is freed when
+    it is returned.
+**/
+class FramePool
+{
+  public:
+    FramePool();
+    ~FramePool();
+
+    image16_ref *acquire(int length, int width, int dirNumber);
+    void release(image16_ref *frame);
+    void clear();
+
+    inline uint32_t getAllocations() const { return allocations; }
+
+  private:
+    typedef std::pair<int,int> Size;   ///< length and width
+
+    std::mutex mt;
+    std::map< Size, std::vector<image16_ref*> > idle;
+    std::atomic<uint32_t> allocations;   ///< frames the pool had to create
+};
+
+#endif // FRAMEPOOL_H
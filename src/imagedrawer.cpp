@@ -730,7 +730,7 @@ void ImageDrawer::test()
     qDebug() << "WindowWidth:" << this->width();
     qDebug() << "CurrentWidth:" << currentWidth;
 
-    Estimator::wakeAll();
+    lokalizer.wakeAll();
 }
 
 void ImageDrawer::loadImage()
@@ -0,0 +1,503 @@
+#include "qtfiles.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QTextStream>
+#include <QThread>
+
+#include <cmath>
+
+#include "localizationrun.h"
+
+/// ms between two looks for new frames of a live stack
+static const int livePollInterval = 50;
+
+LocalizationRun::LocalizationRun()
+: nextFoundFrame(0),
+  nextSpotBatch(0),
+  nextPrintedBatch(0),
+  spotEstimator(SpotEstimator::create(params.method)),
+  roiKernels(Roi::kernels(params.roiSize)),
+  currFileName("lokImg.tif"),
+  numDecoders(0),
+  liveTimeout(0),
+  snapshotInterval(5000),
+  frameQueueCapacity(64),
+  spotQueueCapacity(16384),
+  fuseFilterFind(true),
+  dataPixelSize(0),
+  lokImgPixelSize(0),
+  frameLength(0),
+  frameWidth(0),
+  dimZ(0),
+  deletedRois(0),
+  resultImage(nullptr),
+  tiffStack(nullptr),
+  diffStack(nullptr),
+  firStack(nullptr),
+  currResNr(0),
+  toPrintQueue(4096),
+  roiQueue(16384),
+  resultQueue(4096)
+{
+}
+
+LocalizationRun::~LocalizationRun()
+{
+  close();
+  clearFoundFrames();
+  clearQueued();
+
+  delete resultImage;
+  delete tiffStack;
+  delete diffStack;
+  delete firStack;
+}
+
+void LocalizationRun::closeFiles()
+{
+  if(resultFile.isOpen())
+    resultFile.close();
+
+  if(challengeFile.isOpen())
+  challengeFile.close();
+
+  if(loggerFile.isOpen())
+    loggerFile.close();
+}
+
+void LocalizationRun::close()
+{
+  closeFiles();
+
+  decodeQueue.close();
+  toFilterQueue.close();
+  toFindQueue.close();
+  toPrintQueue.close();
+  toSaveQueue.close();
+  roiQueue.close();
+  resultQueue.close();
+
+  clearQueued();
+}
+
+bool LocalizationRun::init(double camPixelSize, double resPixelSize, QString fileName)
+{
+  QFileInfo info(fileName);
+  currFileName = info.baseName();
+
+  // outputs are written next to the stack, the working directory is shared by all runs
+  outputPrefix = info.absolutePath() + "/" + currFileName + params.tag;
+
+  stackPath = info.absoluteFilePath();
+
+  // a live stack is waited for until it holds the frames of the first background
+  const int minFrames = (liveTimeout>0)? 4 : 1;
+
+  QElapsedTimer idle;
+  idle.start();
+
+  delete tiffStack;
+  tiffStack = new img_stack(stackPath.toStdString(),std::string("r"));
+  while(!tiffStack->good() || tiffStack->img_count() < minFrames){
+    delete tiffStack;
+    tiffStack = nullptr;
+
+    if(liveTimeout<=0 || idle.elapsed() > liveTimeout){
+      qDebug() << "error: stack could not be opened!" << fileName;
+      return false;
+    }
+
+    QThread::msleep(livePollInterval);
+    tiffStack = new img_stack(stackPath.toStdString(),std::string("r"));
+  }
+
+#ifdef SAVE
+  delete firStack;
+  delete diffStack;
+  firStack  = new img_stack((outputPrefix+"_fir.tif").toStdString(),std::string("w"));
+  diffStack = new img_stack((outputPrefix+"_bg.tif" ).toStdString(),std::string("w"));
+#endif
+
+  dataPixelSize = camPixelSize;
+  lokImgPixelSize = resPixelSize;
+
+  if(resultFile.isOpen()){
+    resultFile.close();
+  }
+
+  resultFile.setFileName(outputPrefix+"_locations.txt");
+  if (!resultFile.open(QIODevice::WriteOnly | QIODevice::Text))
+    qDebug()<< "error: result file could not be opened!";
+
+  if(challengeFile.isOpen()){
+    challengeFile.close();
+  }
+  challengeFile.setFileName(outputPrefix+"_result_locations.csv");
+  if (!challengeFile.open(QIODevice::WriteOnly | QIODevice::Text))
+      qDebug()<< "error: challenge file could not be opened!";
+
+
+  if(loggerFile.isOpen()){
+      loggerFile.close();
+  }
+  loggerFile.setFileName(outputPrefix+"_log.txt");
+  if (!loggerFile.open(QIODevice::WriteOnly | QIODevice::Text))
+      qDebug()<< "error: result file could not be opened!";
+
+  dimZ = tiffStack->img_count();
+
+  logHeader();
+
+  currResNr = 0;
+  deletedRois = 0;
+
+  clearQueued();
+  {
+    QMutexLocker batchLock(&spotBatchMutex);
+    QMutexLocker printLock(&estimateMutex);
+    nextSpotBatch = 0;
+    nextPrintedBatch = 0;
+  }
+
+  // frames and spots of an earlier stack may have another size, start both pools anew
+  framePool.clear();
+  roiPool.clear();
+  results.clear();
+
+  image16_ref firstFrame = tiffStack->get_image(0);
+  frameLength = firstFrame.get_length();
+  frameWidth  = firstFrame.get_width();
+
+  delete resultImage;
+  resultImage = new image16_ref((double)frameLength*dataPixelSize/lokImgPixelSize,
+                                frameWidth*dataPixelSize/lokImgPixelSize,
+                                firstFrame.get_bits_per_pixel(),0);
+
+  // sized up front, the reader fills it while find() is reading it
+  meanBgVec.clear();
+  meanBgVec.resize(dimZ);
+
+  clearFoundFrames();
+
+  // decoders hand out a fixed number of frames, a live stack is read by the reader itself
+  if(liveTimeout>0){
+    numDecoders = 0;
+  }
+
+  if(numDecoders>0){
+    decodeQueue.reset(dimZ, qMax(16, 4*numDecoders));
+  }else{
+    decodeQueue.close();
+  }
+
+  toFilterQueue.reset();
+  toFindQueue.reset();
+  toPrintQueue.reset();
+  toSaveQueue.reset();
+  roiQueue.reset();
+  resultQueue.reset();
+
+  // frames are the large items, but spots pile up behind a slow estimator or
+  // insert stage, bounding all queues caps the memory of a run
+#ifdef CHAIN
+  const int capacity = 0;   // chained stages drain a queue only after filling it
+  const int spotCapacity = 0;
+#else
+  const int capacity = frameQueueCapacity;
+  const int spotCapacity = spotQueueCapacity;
+#endif
+  toFilterQueue.setCapacity(capacity);
+  toFindQueue.setCapacity(capacity);
+  toSaveQueue.setCapacity(capacity);
+  roiQueue.setCapacity(spotCapacity);
+  toPrintQueue.setCapacity(spotCapacity);
+
+  globalWatch.restart();
+
+  return true;
+}
+
+/// Set the estimator parameters, must not be called while the run is in flight
+void LocalizationRun::setParameters(Parameters const& parameters)
+{
+  params = parameters;
+  spotEstimator.reset(SpotEstimator::create(params.method));
+
+  roiKernels = Roi::kernels(params.roiSize);
+  if(!roiKernels){
+    qWarning() << "ROI size" << params.roiSize << "is not supported, using 7";
+    params.roiSize = 7;
+    roiKernels = Roi::kernels(params.roiSize);
+  }
+}
+
+/// Wait until frame z is in the stack
+/** Complete stacks return at once. A live stack is looked at again until the
+    frame arrives, the run is closed, or no frame arrived for liveTimeout ms.
+    @return true iff frame z can be read
+**/
+bool LocalizationRun::waitForFrame(int z)
+{
+  if(z < dimZ){
+    return true;
+  }
+
+  if(liveTimeout<=0 || !tiffStack){
+    return false;
+  }
+
+  QElapsedTimer idle;
+  idle.start();
+
+  while(!toFilterQueue.isDone()){
+    dimZ = tiffStack->refresh();
+    if(z < dimZ){
+      return true;
+    }
+
+    if(idle.elapsed() > liveTimeout){
+      return false;
+    }
+
+    QThread::msleep(livePollInterval);
+  }
+
+  return false;
+}
+
+/// Frames a stage collects before it starts, none in a live run where the stack length is open
+int LocalizationRun::frameThreashold() const
+{
+  return (liveTimeout>0)? 0 : dimZ/10;
+}
+
+/// Mean background of frame z, set by the reader before the frame is passed on
+int LocalizationRun::meanBackground(int z)
+{
+  QReadLocker locker(&meanBgLock);
+  return meanBgVec.at(z);
+}
+
+void LocalizationRun::setMeanBackground(int z, int meanbg)
+{
+  QWriteLocker locker(&meanBgLock);
+  if(z >= meanBgVec.size()){
+    meanBgVec.resize(qMax(2*meanBgVec.size(), z+1));
+  }
+  meanBgVec[z] = meanbg;
+}
+
+/// Pass the spots of a frame on in frame order
+/** Frames are searched in parallel and finish in any order. The spots of a
+    frame wait until those of all frames before it are passed on, so roiQueue,
+    and with SAVE toSaveQueue, see the frames in the order of the stack no
+    matter how many workers search.
+    @param rois spots of the frame in raster order, the vector is emptied
+    @param findPair background and filtered frame for the save stage, nullptr without SAVE
+**/
+void LocalizationRun::releaseFoundSpots(int sliceNr, std::vector<Roi*> & rois, QPair< image16_ref*,image16_ref* > *findPair)
+{
+  QMutexLocker locker(&foundFramesMutex);
+
+  FoundFrame & frame = foundFrames[sliceNr];
+  frame.rois.swap(rois);
+  frame.findPair = findPair;
+  rois.clear();
+
+  // the reader numbers the frames from 0 without gaps
+  auto next = foundFrames.begin();
+  while(next != foundFrames.end() && next->first == nextFoundFrame){
+    roiQueue.push_many(next->second.rois);
+#ifdef SAVE
+    toSaveQueue.push_back(next->second.findPair);
+#endif
+    next = foundFrames.erase(next);
+    nextFoundFrame++;
+  }
+}
+
+/// Take a batch of spots from roiQueue and number it
+/** Batches are numbered in the order they leave the queue, releaseResults()
+    prints their results in that order.
+    @param wait Wait like LockFreeQueue::pop_many() for the first spot, else take only what is there
+    @return false iff no spot was taken, no number is used up then
+**/
+bool LocalizationRun::takeSpots(std::vector<Roi*> & rois, size_t maxItems, bool wait, uint64_t & batchNr)
+{
+  QMutexLocker locker(&spotBatchMutex);
+
+  const bool taken = wait? roiQueue.pop_many(rois,maxItems) : roiQueue.try_pop_many(rois,maxItems);
+  if(taken){
+    batchNr = nextSpotBatch++;
+  }
+  return taken;
+}
+
+/// Print the results of a batch of takeSpots() in batch order
+/** Batches are estimated in parallel and finish in any order. The results of
+    a batch wait until those of all batches before it are printed, so the
+    result files list and number the spots in the order of roiQueue, the
+    order of the stack, no matter how many workers estimate.
+    @param chunk results of the batch in the order of its spots
+    @param render Pass the chunk on to resultQueue once it is printed, else it was rendered already and goes back to results
+**/
+void LocalizationRun::releaseResults(uint64_t batchNr, ResultTable::Chunk *chunk, bool render)
+{
+  QMutexLocker locker(&estimateMutex);
+
+  resultsAhead[batchNr] = EstimatedBatch{chunk, render};
+
+  auto next = resultsAhead.begin();
+  while(next != resultsAhead.end() && next->first == nextPrintedBatch){
+    printResults(*next->second.chunk);
+    if(next->second.render){
+      resultQueue.push_back(next->second.chunk);
+    }else{
+      results.release(next->second.chunk);
+    }
+    next = resultsAhead.erase(next);
+    nextPrintedBatch++;
+  }
+}
+
+/// Write the rows of a chunk to the result files and number them, the caller holds estimateMutex
+void LocalizationRun::printResults(ResultTable::Chunk const& chunk)
+{
+  QTextStream challengeOut(&challengeFile);
+  QTextStream out(&resultFile);
+
+  for(int row=0; row<chunk.count; row++){
+    out << currResNr++          << "\t";
+    out << chunk.QMax[row]      << "\t";
+    out << chunk.mx[row]        << "\t";
+    out << chunk.my[row]        << "\t";
+    out << sqrt(chunk.dx2[row]) << "\t";
+    out << sqrt(chunk.dy2[row]) << "\t";
+    out << sqrt(chunk.sx2[row]) << "\t";
+
+    out << sqrt(chunk.sy2[row]) << "\t";
+    out << chunk.gesQ[row]      << "\t";
+    out << chunk.sliceNr[row]   << "\n";
+
+    challengeOut << chunk.mx[row]      << ";";
+    challengeOut << chunk.my[row]      << ";";
+    challengeOut << 0                  << ";";
+    challengeOut << chunk.sliceNr[row] << ";";
+    challengeOut << chunk.gesQ[row]    << "\n";
+  }
+}
+
+/// Drop the spots of frames that were never passed on, left over by a closed run
+void LocalizationRun::clearFoundFrames()
+{
+  QMutexLocker locker(&foundFramesMutex);
+
+  for(auto & found : foundFrames){
+    roiPool.release(found.second.rois);
+    if(found.second.findPair){
+      framePool.release(found.second.findPair->first);
+      framePool.release(found.second.findPair->second);
+      delete found.second.findPair;
+    }
+  }
+  foundFrames.clear();
+  nextFoundFrame = 0;
+}
+
+/// Hand the spots and results still queued back to their pools, left over by a closed run
+/** Spots and results passed on by a stage that was still running when the
+    run was closed are caught by the next init() or the destructor.
+**/
+void LocalizationRun::clearQueued()
+{
+  std::vector<Roi*> stale;
+  roiQueue.drain(stale);
+  toPrintQueue.drain(stale);
+  roiPool.release(stale);
+
+  QMutexLocker locker(&estimateMutex);
+
+  for(auto & batch : resultsAhead){
+    results.release(batch.second.chunk);
+  }
+  resultsAhead.clear();
+
+  std::vector<ResultTable::Chunk*> chunks;
+  resultQueue.drain(chunks);
+  for(auto chunk : chunks){
+    results.release(chunk);
+  }
+}
+
+QString LocalizationRun::saveResultImage()
+{
+  QString resultName = outputPrefix+"_lokimg.tiff";
+
+  img_stack saveLokImgStack(resultName.toStdString(),"w");
+  saveLokImgStack.append_image(*resultImage);
+
+  delete resultImage;
+  resultImage = nullptr;
+
+  return resultName;
+}
+
+/// Write the localization image so far and flush the results, lets a live run be followed
+void LocalizationRun::saveResultSnapshot()
+{
+  image16_ref snapshot;
+  {
+    QMutexLocker locker(&fillLokImgMutex);
+    snapshot = resultImage->copy();
+  }
+
+  // replaced at once, a viewer never reads a half written image
+  const QString snapshotName = outputPrefix+"_lokimg_live.tiff";
+  const QString tmpName = outputPrefix+"_lokimg_live.tmp.tiff";
+  {
+    img_stack snapshotStack(tmpName.toStdString(),"w");
+    snapshotStack.append_image(snapshot);
+  }
+  QFile::remove(snapshotName);
+  QFile::rename(tmpName,snapshotName);
+
+  QMutexLocker locker(&estimateMutex);
+  resultFile.flush();
+  challengeFile.flush();
+}
+
+void LocalizationRun::wakeAll()
+{
+  toFilterQueue.wake();
+  toFindQueue.wake();
+  toSaveQueue.wake();
+  toPrintQueue.wake();
+  roiQueue.wake();
+  resultQueue.wake();
+}
+
+void LocalizationRun::logHeader()
+{
+  QDateTime currTime(QDateTime::currentDateTime());
+
+  QTextStream out(&loggerFile);
+  out << "##############################################\n";
+  out << "### File: " << currFileName<< "\n";
+  out << "### Date: " << currTime.toString("hh:mm:ss  dd/MM/yyyy") << "\n";
+  out << "##############################################\n";
+  out << "### Estimator parameters:\n";
+  out << "### - Threashold factor = " << params.threasholdFactor<< "\n";
+  out << "### - Cutoff factor     = " << params.cutoffFactor<< "\n";
+  out << "### - Seperate factor   = " << params.separateFactor<< "\n";
+  out << "### - ROI size          = " << params.roiSize<< "\n";
+  out << "### - Spot estimator    = " << spotEstimator->name()<< "\n";
+  out << "##############################################";
+  out << "### Data Parameters:\n";
+  out << "### - Number of frames  = " << dimZ<< "\n";
+  out << "### - Camera pixel size = " << dataPixelSize<< "\n";
+  out << "### - Result pixel size = " << lokImgPixelSize<< "\n";
+  out << "##############################################\n\n";
+}
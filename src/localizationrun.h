@@ -0,0 +1,153 @@
+#ifndef LOCALIZATIONRUN_H
+#define LOCALIZATIONRUN_H
+
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QPair>
+#include <QFile>
+#include <QString>
+#include <QTime>
+#include <QVector>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "framepool.h"
+#include "lockfreequeue.h"
+#include "orderedframequeue.h"
+#include "resulttable.h"
+#include "roipool.h"
+#include "spotestimator.h"
+#include "threadsavequeue.h"
+#include "ImageStack/img_stack.hpp"
+#include "roi.h"
+
+/// State of one localization of one stack
+/** Owns the estimator parameters, the input and output stacks, the result
+    files and all queues that connect the Estimator stages. Every Estimator
+    works on the run it was created for, so several stacks, or one stack with
+    several parameter sets, can be localized at the same time.
+**/
+class LocalizationRun
+{
+  public:
+    struct Parameters{
+      Parameters() : threasholdFactor(3), cutoffFactor(2), separateFactor(0.7), roiSize(7), method(SpotEstimator::Centroid) {}
+
+      int threasholdFactor;  ///< threashold over background: factor * sqrt(meanbg)
+      int cutoffFactor;      ///< cutoff in roi: value - factor * sqrt(meanbg)
+      double separateFactor; ///< minimum intensity ratio after separation
+      int roiSize;           ///< side of the square ROI around a spot, one Roi::kernels() has
+      SpotEstimator::Method method; ///< how the spots are estimated
+      QString tag;           ///< appended to the names of all output files
+    };
+
+    LocalizationRun();
+    ~LocalizationRun();
+
+    void setParameters(Parameters const& parameters);
+    bool init(double camPixelSize, double resPixelSize, QString fileName);
+    void close();
+    void closeFiles();
+    void wakeAll();
+
+    bool waitForFrame(int z);
+    int frameThreashold() const;
+
+    int meanBackground(int z);
+    void setMeanBackground(int z, int meanbg);
+
+    void releaseFoundSpots(int sliceNr, std::vector<Roi*> & rois, QPair< image16_ref*,image16_ref* > *findPair);
+    bool takeSpots(std::vector<Roi*> & rois, size_t maxItems, bool wait, uint64_t & batchNr);
+    void releaseResults(uint64_t batchNr, ResultTable::Chunk *chunk, bool render);
+
+    QString saveResultImage();
+    void saveResultSnapshot();
+
+  private:
+    void logHeader();
+    void clearFoundFrames();
+    void clearQueued();
+    void printResults(ResultTable::Chunk const& chunk);
+
+    struct FoundFrame{
+      std::vector<Roi*> rois;
+      QPair< image16_ref*,image16_ref* > *findPair;
+    };
+
+    QMutex foundFramesMutex;
+    int nextFoundFrame;                     ///< next frame whose spots go to roiQueue
+    std::map<int, FoundFrame> foundFrames;  ///< found ahead of nextFoundFrame
+
+    struct EstimatedBatch{
+      ResultTable::Chunk *chunk;
+      bool render;               ///< goes to resultQueue once printed, else back to results
+    };
+
+    QMutex spotBatchMutex;                  ///< numbers the batches in the order they leave roiQueue
+    uint64_t nextSpotBatch;                 ///< number of the next batch taken from roiQueue
+    uint64_t nextPrintedBatch;              ///< next batch whose results are printed, under estimateMutex
+    std::map<uint64_t, EstimatedBatch> resultsAhead;  ///< estimated ahead of nextPrintedBatch
+
+  public:
+    Parameters params;
+    std::unique_ptr<SpotEstimator> spotEstimator;  ///< estimates the spots with params.method
+    Roi::Kernels const* roiKernels;                ///< separates the spots, of params.roiSize
+
+    QString currFileName;
+    QString outputPrefix;
+    QString stackPath;
+
+    int numDecoders;      ///< parallel decoders, 0 lets the reader decode itself
+    int liveTimeout;      ///< ms without new frames that end a live run, 0 for a complete stack
+    int snapshotInterval; ///< ms between snapshots of the localization image in a live run
+    int frameQueueCapacity; ///< frames a queue holds before its producers wait, 0 for unbounded
+    int spotQueueCapacity;  ///< spots roiQueue and toPrintQueue hold before their producers wait, 0 for unbounded
+    bool fuseFilterFind;    ///< filter and search a frame in one pass, not with SAVE which stores the filtered frames
+
+    double dataPixelSize;
+    double lokImgPixelSize;
+
+    int frameLength;      ///< size of the frames of the stack in pixels
+    int frameWidth;
+
+    std::atomic<int> dimZ;  ///< grows while a live stack is read
+
+    std::atomic<uint32_t> deletedRois;
+
+    image16_ref * resultImage;
+    QVector<int> meanBgVec;
+    QReadWriteLock meanBgLock;  ///< meanBgVec grows while find() is reading it in a live run
+
+    img_stack *tiffStack;
+    img_stack *diffStack;
+    img_stack *firStack;
+
+    int currResNr;
+
+    QFile resultFile;
+    QFile challengeFile;
+    QFile loggerFile;
+
+    QMutex estimateMutex;
+    QMutex fillLokImgMutex;
+
+    FramePool framePool;  ///< frames the reader, filter and find stages reuse
+    RoiPool roiPool;      ///< spots the find, estimate and insert stages reuse
+    ResultTable results;  ///< chunks of results the estimate stage reuses
+
+    OrderedFrameQueue decodeQueue;
+    ThreadSaveQueue<image16_ref > toFilterQueue;
+    ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > toFindQueue;
+    ThreadSaveQueue< QPair< image16_ref*,image16_ref* > > toSaveQueue;
+    LockFreeQueue< Roi > toPrintQueue;
+    LockFreeQueue< Roi > roiQueue;       ///< one item per candidate spot, the busiest hand-off
+    LockFreeQueue< ResultTable::Chunk > resultQueue;  ///< printed chunks of results for generateSpotFromPendingResults()
+
+    QTime globalWatch;
+};
+
+#endif // LOCALIZATIONRUN_H
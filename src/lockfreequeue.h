@@ -0,0 +1,456 @@
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/// Lock-free queue of pointers with the lifecycle of ThreadSaveQueue
+/** Items are passed through a bounded ring of cells (multi producer, multi
+    consumer), push and pop take no lock. Threads only block when there is
+    nothing to do: consumers on an empty queue, producers on a full bounded
+    one. They are woken by the other side only if someone is sleeping, so a
+    busy pipeline never touches the mutex.
+
+    With capacity 0 the queue is unbounded: items that do not fit into the
+    ring go to a locked overflow list, and so do all items pushed while it
+    is not empty, so they keep their order. A bounded queue holds at most
+    min(capacity, ring size) items.
+**/
+template <typename Type>
+class LockFreeQueue
+{
+  public:
+
+    explicit LockFreeQueue(uint32_t ringSize = 4096) : m_pushCnt(0),
+                                                       m_popCnt(0),
+                                                       m_done(false),
+                                                       m_finish(false),
+                                                       m_lockedUsers(0),
+                                                       m_threashold(0),
+                                                       m_thld(0),
+                                                       m_capacity(0),
+                                                       m_highWater(0),
+                                                       m_overflowCnt(0),
+                                                       m_sleepers(0),
+                                                       m_spaceSleepers(0),
+                                                       m_enqueuePos(0),
+                                                       m_dequeuePos(0)
+    {
+      // ring size is a power of two, positions are masked instead of divided
+      uint32_t size = 2;
+      while(size < ringSize){
+        size <<= 1;
+      }
+
+      m_mask = size - 1;
+      m_ring.reset(new Cell[size]);
+      for(size_t pos = 0; pos < size; pos++){
+        m_ring[pos].sequence.store(pos, std::memory_order_relaxed);
+        m_ring[pos].data = nullptr;
+      }
+    }
+
+    virtual ~LockFreeQueue()
+    {
+      m_done = true;
+      m_finish = true;
+      wake();
+    }
+
+    /// Append an item, waits while a bounded queue is full
+    void push_back(Type * dataPtr)
+    {
+      enqueue(dataPtr);
+      published(1);
+    }
+
+    /// Append all items with one wakeup, the vector is emptied
+    void push_many(std::vector<Type *> & dataPtrs)
+    {
+      if(dataPtrs.empty()){
+        return;
+      }
+
+      for(auto dataPtr : dataPtrs){
+        enqueue(dataPtr);
+      }
+
+      published(dataPtrs.size());
+      dataPtrs.clear();
+    }
+
+    bool pop_front(Type* & dataPtr)
+    {
+      for(;;){
+        if(!waitForItems()){
+          dataPtr = nullptr;
+          return false;
+        }
+
+        if(tryPop(dataPtr)){
+          break;
+        }
+        // a producer has claimed a cell but not filled it yet
+        std::this_thread::yield();
+      }
+
+      consumed(1);
+      return true;
+    }
+
+    /// Take up to maxItems items, waits like pop_front for the first
+    /** @return false iff the queue is done, dataPtrs is empty then
+    **/
+    bool pop_many(std::vector<Type *> & dataPtrs, size_t maxItems)
+    {
+      dataPtrs.clear();
+
+      Type *dataPtr = nullptr;
+      while(dataPtrs.empty()){
+        if(!waitForItems()){
+          return false;
+        }
+
+        while(dataPtrs.size() < maxItems && tryPop(dataPtr)){
+          dataPtrs.push_back(dataPtr);
+        }
+
+        if(dataPtrs.empty()){
+          std::this_thread::yield();
+        }
+      }
+
+      consumed(dataPtrs.size());
+      return true;
+    }
+
+    /// Take up to maxItems items without waiting, the threashold does not apply
+    /** @return false iff no item was taken
+    **/
+    bool try_pop_many(std::vector<Type *> & dataPtrs, size_t maxItems)
+    {
+      dataPtrs.clear();
+      if(m_done){
+        return false;
+      }
+
+      Type *dataPtr = nullptr;
+      while(dataPtrs.size() < maxItems && tryPop(dataPtr)){
+        dataPtrs.push_back(dataPtr);
+      }
+
+      if(dataPtrs.empty()){
+        return false;
+      }
+
+      consumed(dataPtrs.size());
+      return true;
+    }
+
+    /// Called after every push and once the producers finished, lets a scheduler follow the queue
+    /** Set while no producer is running, the listener must not push to this queue.
+    **/
+    inline void setListener(std::function<void()> listener){
+      m_listener = listener;
+    }
+
+    inline void setThreashold(uint32_t threashold){
+      m_threashold = threashold;
+      m_thld = threashold;
+    }
+
+    /// Number of items the queue holds before push_back waits, 0 for unbounded
+    inline void setCapacity(uint32_t capacity){
+      m_capacity = capacity;
+      wake();
+    }
+
+    /// Take the items left in a closed queue, so their owner can free them before reset()
+    void drain(std::vector<Type *> & dataPtrs){
+      Type *dataPtr = nullptr;
+      while(tryPop(dataPtr)){
+        dataPtrs.push_back(dataPtr);
+      }
+    }
+
+    /// Reopen a closed queue, items left over from the last run are dropped without deleting them, see drain()
+    inline void reset() {
+      close();
+
+      Type *stale = nullptr;
+      while(tryPop(stale)){}
+
+      m_done = false;
+      m_finish = false;
+      m_pushCnt = 0;
+      m_popCnt = 0;
+      m_highWater = 0;
+    }
+
+    /// Number of items in the queue, exact once producers and consumers are idle
+    inline uint32_t size() const {
+      const int32_t fill = (int32_t) (m_pushCnt - m_popCnt);
+      return (fill > 0)? fill : 0;
+    }
+
+    inline uint32_t getPushes() const { return m_pushCnt; }
+    inline uint32_t getPops()   const { return m_popCnt;  }
+    inline uint32_t getCapacity()  const { return m_capacity;  }
+    inline uint32_t getHighWater() const { return m_highWater; }
+
+    bool isDone(){return m_done;}
+    bool isFinished(){return m_finish || m_done;}
+
+    void signUp(){
+      m_lockedUsers++;
+    }
+
+    void finish(){
+      m_lockedUsers--;
+      setThreashold(0);
+
+      if(m_lockedUsers<=0){
+        m_finish = true;
+      }
+      wake();
+
+      if(m_listener){
+        m_listener();
+      }
+    }
+
+    void wake(){
+      std::lock_guard<std::mutex> lock(m_waitMt);
+      m_waitCondition.notify_all();
+      m_spaceCondition.notify_all();
+    }
+
+    void close(){
+      m_lockedUsers = 0;
+      m_done = true;
+      setThreashold(0);
+      wake();
+    }
+
+  private:
+    struct Cell
+    {
+      std::atomic<size_t> sequence;   ///< position the cell is ready for
+      Type *data;
+    };
+
+    /// Put one item into the ring or the overflow list, waits while a bounded queue is full
+    void enqueue(Type * dataPtr)
+    {
+      // consumers take the overflow list only once the ring is empty, later items queue up behind it
+      const bool overflowing = m_overflowCnt > 0 && (m_capacity == 0 || m_done);
+
+      while(overflowing || !tryPush(dataPtr)){
+        if(m_capacity == 0 || m_done){
+          // unbounded, or closed and taking everything
+          std::lock_guard<std::mutex> lock(m_overflowMt);
+          m_overflow.push_back(dataPtr);
+          m_overflowCnt++;
+          break;
+        }
+
+        // back-pressure, consumers may still sleep on items of an unpublished batch
+        std::unique_lock<std::mutex> lock(m_waitMt);
+        if(m_sleepers > 0){
+          m_waitCondition.notify_all();
+        }
+        m_spaceSleepers++;
+        m_spaceCondition.wait(lock, [&](){ return m_done || !isFull(); });
+        m_spaceSleepers--;
+      }
+
+      m_pushCnt++;
+    }
+
+    /// Record the fill after items were enqueued and wake sleeping consumers if they have enough to do
+    void published(uint32_t count)
+    {
+      const uint32_t fill = size();
+      uint32_t highWater = m_highWater;
+      while(fill > highWater && !m_highWater.compare_exchange_weak(highWater, fill)){}
+
+      if(m_sleepers > 0 && (fill > m_thld || isFull())){
+        std::lock_guard<std::mutex> lock(m_waitMt);
+        if(count > 1 || (m_thld > 0 && fill == m_thld + 1)){
+          m_waitCondition.notify_all();
+        }else{
+          m_waitCondition.notify_one();
+        }
+      }
+
+      if(m_listener){
+        m_listener();
+      }
+    }
+
+    /// Block until items are over the threashold, false iff the queue is done
+    bool waitForItems()
+    {
+      for(;;){
+        if(m_done){
+          wake();
+          return false;
+        }
+
+        if(size() > m_thld || isFull()){
+          return true;
+        }
+
+        if(m_finish && size() == 0){
+          m_done = true;
+          wake();
+          return false;
+        }
+
+        std::unique_lock<std::mutex> lock(m_waitMt);
+        m_sleepers++;
+        m_waitCondition.wait(lock, [&](){
+          return m_done || m_finish || size() > m_thld || isFull();
+        });
+        m_sleepers--;
+      }
+    }
+
+    /// Count items taken out and wake waiting producers, the queue is done once it is drained after finish
+    void consumed(uint32_t count)
+    {
+      m_popCnt += count;
+      m_thld = 0;
+
+      if(m_spaceSleepers > 0){
+        std::lock_guard<std::mutex> lock(m_waitMt);
+        m_spaceCondition.notify_all();
+      }
+
+      if(size() == 0){
+        m_thld = (uint32_t) m_threashold;
+        if(m_finish){
+          m_done = true;
+          wake();
+        }
+      }
+    }
+
+    inline bool isFull() const {
+      if(m_capacity == 0){
+        return false;
+      }
+      const uint32_t capacity = m_capacity;
+      return size() >= ((capacity <= m_mask)? capacity : m_mask + 1);
+    }
+
+    bool tryPush(Type * dataPtr)
+    {
+      if(isFull()){
+        return false;
+      }
+
+      size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+      Cell *cell;
+
+      for(;;){
+        cell = &m_ring[pos & m_mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+        if(diff == 0){
+          if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+            break;
+          }
+        }else if(diff < 0){
+          return false;   // ring is full
+        }else{
+          pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->data = dataPtr;
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool tryPop(Type* & dataPtr)
+    {
+      size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+      Cell *cell;
+
+      for(;;){
+        cell = &m_ring[pos & m_mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+        if(diff == 0){
+          if(m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+            break;
+          }
+        }else if(diff < 0){
+          return popOverflow(dataPtr);   // ring is empty
+        }else{
+          pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+      }
+
+      dataPtr = cell->data;
+      cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool popOverflow(Type* & dataPtr)
+    {
+      if(m_overflowCnt == 0){
+        return false;
+      }
+
+      std::lock_guard<std::mutex> lock(m_overflowMt);
+      if(m_overflow.empty()){
+        return false;
+      }
+
+      dataPtr = m_overflow.front();
+      m_overflow.pop_front();
+      m_overflowCnt--;
+      return true;
+    }
+
+    std::condition_variable m_waitCondition;
+    std::condition_variable m_spaceCondition;
+    std::mutex m_waitMt;
+    std::atomic<uint32_t> m_pushCnt;
+    std::atomic<uint32_t> m_popCnt;
+    std::atomic<bool> m_done;
+    std::atomic<bool> m_finish;
+    std::atomic<int> m_lockedUsers;
+    std::atomic<uint32_t> m_threashold;
+    std::atomic<uint32_t> m_thld;
+    std::atomic<uint32_t> m_capacity;
+    std::atomic<uint32_t> m_highWater;
+
+    std::mutex m_overflowMt;
+    std::deque<Type *> m_overflow;
+    std::atomic<uint32_t> m_overflowCnt;
+
+    std::atomic<int> m_sleepers;
+    std::atomic<int> m_spaceSleepers;
+
+    std::function<void()> m_listener;
+
+    std::unique_ptr<Cell[]> m_ring;
+    size_t m_mask;
+    std::atomic<size_t> m_enqueuePos;
+    char m_padding[64];   ///< producers and consumers do not share a cache line
+    std::atomic<size_t> m_dequeuePos;
+};
+
+#endif // LOCKFREEQUEUE_H
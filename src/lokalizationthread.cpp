@@ -2,6 +2,8 @@
 
 #include <QMutexLocker>
 #include "estimator.h"
+#include "taskpipeline.h"
+#include "workstealingpool.h"
 
 #include "lokalizationthread.h"
 
@@ -9,6 +11,9 @@ LokalizationThread::LokalizationThread(QObject *parent) :
     QThread(parent)
 {
     numThreads = 2;
+    numDecoders = 2;
+    frameQueueCapacity = 64;
+    spotQueueCapacity = 16384;
     abort = false;
     exePath = QDir::currentPath();
     readInitFile();
@@ -19,7 +24,7 @@ LokalizationThread::LokalizationThread(QObject *parent) :
 
 LokalizationThread::~LokalizationThread()
 {
-  Estimator::close();
+  lokRun.close();
 
   abort = true;
   condition.wakeAll();
@@ -30,7 +35,7 @@ LokalizationThread::~LokalizationThread()
 
 void LokalizationThread::emitFinishTime()
 {
-  emit finishTime(Estimator::globalWatch.elapsed(), Estimator::currResNr);
+  emit finishTime(lokRun.globalWatch.elapsed(), lokRun.currResNr);
 }
 
 void LokalizationThread::startEstimator(double camPixelSize, double resPixelSize, QString fileName)
@@ -58,68 +63,56 @@ void LokalizationThread::sendPrintIntermediateImageSignal(image16_ref image)
 
 void LokalizationThread::run()
 {
-    QVector<QThread*> threadVec;
-
-    Estimator readEstim(0);
+    Estimator readEstim(0,&lokRun);
 
     connect(&readEstim,SIGNAL(maxImage(int)),this,SLOT(maxImage(int)));
     forever
     {
 
       QVector<QThread*> threadVec;
+      int numWorkers;
+
+      {
+        QMutexLocker locker(&mutex);
+        lokRun.setParameters(runParams);
+        lokRun.numDecoders = numDecoders;
+        lokRun.frameQueueCapacity = frameQueueCapacity;
+        lokRun.spotQueueCapacity = spotQueueCapacity;
+        numWorkers = numThreads;
+      }
 
-      if(!readEstim.initEstimatorStatics(camPixelSize,resPixelSize,currFileName)){
+      if(!lokRun.init(camPixelSize,resPixelSize,currFileName)){
           qDebug()<<"No File Selected!";
       }else{
 
-        for(int thread=0; thread<numThreads; thread++){
-          Estimator * filterEstim = new Estimator(10+thread);
+        for(int decoder=0; decoder<lokRun.numDecoders; decoder++){
+          Estimator * decodeEstim = new Estimator(70+decoder,&lokRun);
+          QThread *decodeThread   = new QThread;
+          connect(decodeThread,SIGNAL(started()),decodeEstim,SLOT(decode()));
+          connectMoveStart(decodeEstim,decodeThread);
+          threadVec << decodeThread;
+        }
+
+    #ifdef CHAIN
+        for(int thread=0; thread<numWorkers; thread++){
+          Estimator * filterEstim = new Estimator(10+thread,&lokRun);
           QThread *filterThread   = new QThread;
           connect(filterThread,SIGNAL(started()),filterEstim,SLOT(filter()));
           connectMoveStart(filterEstim,filterThread);
           threadVec << filterThread;
 
           connect(filterEstim,SIGNAL(firProgress(int)),this,SLOT(firProgress(int)));
-
-  #ifndef CHAIN
-          Estimator * calcEstim   = new Estimator(30+thread);
-          QThread *calcThread     = new QThread;
-          connect(calcThread,SIGNAL(started()),calcEstim,SLOT(estimateGenerate()));
-          connectMoveStart(calcEstim,calcThread);
-          threadVec << calcThread;
-    #endif
         }
-
-    #ifndef CHAIN
-
-        Estimator * findEstim   = new Estimator(20);
-        QThread *findThread     = new QThread;
-        connect(findThread,SIGNAL(started()),findEstim,SLOT(find()));
-        connectMoveStart(findEstim,findThread);
-        threadVec << findThread;
-
-
-        Estimator * insertEstim   = new Estimator(50);
-        QThread *insertThread     = new QThread;
-        connect(insertThread,SIGNAL(started()),insertEstim,SLOT(insertRoisInResultImage()));
-        connectMoveStart(insertEstim,insertThread);
-        threadVec << insertThread;
-
-
-//        Estimator * generateEstim   = new Estimator(40);
-//        QThread *generateThread     = new QThread;
-//        connect(generateThread,SIGNAL(started()),generateEstim,SLOT(generateSpotFromPendingResults()));
-//        connectMoveStart(generateEstim,generateThread);
-//        threadVec << generateThread;
-
-    #ifdef SAVE
-        Estimator * saveEstim   = new Estimator(60);
-        QThread *saveThread     = new QThread;
-        connect(saveThread,SIGNAL(started()),saveEstim,SLOT(saveStacks()));
-        connectMoveStart(saveEstim,saveThread);
-        threadVec << saveThread;
-    #endif
-
+    #else
+        // filter, find, estimate, insert and save run as tasks on the pool,
+        // NumberOfThreads workers, 0 for one per core
+        WorkStealingPool pool(numWorkers);
+        TaskPipeline pipeline(&pool,&lokRun);
+        for(auto estim : pipeline.estimators()){
+          connect(estim,SIGNAL(firProgress(int)),this,SLOT(firProgress(int)));
+          connect(estim,SIGNAL(printIntermediateImage(image16_ref)),this, SLOT(sendPrintIntermediateImageSignal(image16_ref)));
+        }
+        pipeline.start();
     #endif
 
         readEstim.read();
@@ -134,7 +127,11 @@ void LokalizationThread::run()
           delete th;
         }
 
-        const auto resName = Estimator::saveResultImage();
+    #ifndef CHAIN
+        pipeline.wait();
+    #endif
+
+        const auto resName = lokRun.saveResultImage();
 
         estimatorFinished(resName);
         emitFinishTime();
@@ -183,6 +180,9 @@ void LokalizationThread::readInitFile()
 
     QTextStream in(&initFile);
     numThreads = -1;
+    numDecoders = -1;
+    frameQueueCapacity = -1;
+    spotQueueCapacity = -1;
     separateFactor = -1.0;
     threasholdFactor = -1;
     cutoffFactor = -1;
@@ -191,6 +191,12 @@ void LokalizationThread::readInitFile()
         QString line = in.readLine();
         if(line.left(15)== "NumberOfThreads"){
             numThreads = line.section("\t",1,1).toInt();
+        }else if(line.left(16)== "NumberOfDecoders"){
+            numDecoders = line.section("\t",1,1).toInt();
+        }else if(line.left(18)== "FrameQueueCapacity"){
+            frameQueueCapacity = line.section("\t",1,1).toInt();
+        }else if(line.left(17)== "SpotQueueCapacity"){
+            spotQueueCapacity = line.section("\t",1,1).toInt();
         }else if(line.left(14)== "SeparateFactor"){
             separateFactor = line.section("\t",1,1).toDouble();
         }else if(line.left(16)== "ThreasholdFactor"){
@@ -199,6 +205,17 @@ void LokalizationThread::readInitFile()
             cutoffFactor = line.section("\t",1,1).toInt();
         }
     }
+    if(numDecoders<0){
+        // older setup.ini files have no decoder entry
+        numDecoders = 2;
+    }
+    // nor queue capacity entries, 0 in setup.ini leaves a queue unbounded
+    if(frameQueueCapacity<0){
+        frameQueueCapacity = 64;
+    }
+    if(spotQueueCapacity<0){
+        spotQueueCapacity = 16384;
+    }
     if(numThreads<0 || separateFactor<0||threasholdFactor<0 || cutoffFactor<0){
         qDebug() << "Error: Initfile not complete!";
         numThreads = 2;
@@ -213,9 +230,15 @@ void LokalizationThread::readInitFile()
 
 void LokalizationThread::setParameters()
 {
-    Estimator::cutoffFactor     = cutoffFactor;
-    Estimator::threasholdFactor = threasholdFactor;
-    Estimator::separateFactor   = separateFactor;
+    QMutexLocker locker(&mutex);
+    runParams.cutoffFactor     = cutoffFactor;
+    runParams.threasholdFactor = threasholdFactor;
+    runParams.separateFactor   = separateFactor;
+}
+
+void LokalizationThread::wakeAll()
+{
+  lokRun.wakeAll();
 }
 
 void LokalizationThread::firProgress(int sliceNr)
@@ -240,6 +263,9 @@ void LokalizationThread::saveInitFile()
     out << "##### LokMik initialisation File\n";
     out << "########################################\n\n";
     out << "NumberOfThreads:\t" << numThreads << "\n";
+    out << "NumberOfDecoders:\t" << numDecoders << "\n";
+    out << "FrameQueueCapacity:\t" << frameQueueCapacity << "\n";
+    out << "SpotQueueCapacity:\t" << spotQueueCapacity << "\n";
     out << "SeparateFactor:\t" << separateFactor << "\n";
     out << "ThreasholdFactor:\t" << threasholdFactor << "\n";
     out << "CutoffFactor:\t" << cutoffFactor << "\n";
@@ -6,6 +6,7 @@
 #include <QWaitCondition>
 
 #include "ImageStack/img_stack.hpp"
+#include "localizationrun.h"
 
 class Estimator;
 
@@ -27,6 +28,7 @@ signals:
 public slots:
 
     void setNumthreads(int _numThreads){numThreads = _numThreads;}
+    void setNumDecoders(int _numDecoders){numDecoders = _numDecoders;}
     void setSeparateFactor(double factor){separateFactor = factor;}
     void setThresholdFactor(int factor){threasholdFactor = factor;}
     void setCutoffFactor(int factor){cutoffFactor=factor;}
@@ -38,6 +40,7 @@ public slots:
 
     void firProgress(int sliceNr);
     void maxImage(int max);
+    void wakeAll();
 
 protected:
     void connectMoveStart(Estimator *estim, QThread *thread);
@@ -54,7 +57,13 @@ private:
     QMutex mutex;
     QWaitCondition condition;
 
+    LocalizationRun lokRun;
+    LocalizationRun::Parameters runParams;
+
     int numThreads;
+    int numDecoders;
+    int frameQueueCapacity;
+    int spotQueueCapacity;
     int pixelSize;
     double separateFactor;
     int threasholdFactor;
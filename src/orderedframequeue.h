@@ -0,0 +1,130 @@
+#ifndef ORDEREDFRAMEQUEUE_H
+#define ORDEREDFRAMEQUEUE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+
+#include "ImageStack/img_stack.hpp"
+
+/// Hands out frame numbers to parallel decoders and returns the frames in order
+/** Decoders call nextFrame() to get the number of the frame to decode and
+    push() the decoded image, in any order. A single consumer receives the
+    frames in stack order through pop_next(). Decoders never run more than
+    window frames ahead of the consumer, which bounds the memory in flight.
+**/
+class OrderedFrameQueue
+{
+  public:
+
+    OrderedFrameQueue() : m_numFrames(0),
+                          m_window(1),
+                          m_nextDecode(0),
+                          m_nextPop(0),
+                          m_pushCnt(0),
+                          m_closed(true)
+    {}
+
+    ~OrderedFrameQueue()
+    {
+      close();
+    }
+
+    void reset(int numFrames, int window)
+    {
+      close();
+
+      std::unique_lock<std::mutex> lock(m_mt);
+      m_numFrames = numFrames;
+      m_window = (window>0)? window : 1;
+      m_nextDecode = 0;
+      m_nextPop = 0;
+      m_pushCnt = 0;
+      m_closed = false;
+    }
+
+    /// Get the next frame number to decode, false if all frames are handed out
+    bool nextFrame(int & frameNr)
+    {
+      std::unique_lock<std::mutex> lock(m_mt);
+
+      m_waitCondition.wait(lock, [&](){
+        return m_closed || m_nextDecode >= m_numFrames || m_nextDecode < m_nextPop + m_window;
+      });
+
+      if(m_closed || m_nextDecode >= m_numFrames){
+        return false;
+      }
+
+      frameNr = m_nextDecode++;
+      return true;
+    }
+
+    void push(int frameNr, image16_ref * image)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mt);
+        if(m_closed){
+          delete image;
+          return;
+        }
+        m_frames[frameNr] = image;
+        m_pushCnt++;
+      }
+      m_waitCondition.notify_all();
+    }
+
+    /// Get the next frame in stack order, false if all frames are delivered
+    bool pop_next(image16_ref * & image)
+    {
+      std::unique_lock<std::mutex> lock(m_mt);
+
+      m_waitCondition.wait(lock, [&](){
+        return m_closed || m_nextPop >= m_numFrames || m_frames.count(m_nextPop);
+      });
+
+      if(m_closed || m_nextPop >= m_numFrames){
+        image = nullptr;
+        return false;
+      }
+
+      auto it = m_frames.find(m_nextPop);
+      image = it->second;
+      m_frames.erase(it);
+      m_nextPop++;
+
+      lock.unlock();
+      m_waitCondition.notify_all();
+      return true;
+    }
+
+    /// Stop all decoders and the consumer, pending frames are deleted
+    void close()
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mt);
+        m_closed = true;
+        for(auto & frame : m_frames){
+          delete frame.second;
+        }
+        m_frames.clear();
+      }
+      m_waitCondition.notify_all();
+    }
+
+    inline uint32_t getPushes() const { return m_pushCnt; }
+
+  private:
+    std::condition_variable m_waitCondition;
+    std::mutex m_mt;
+    std::map<int, image16_ref*> m_frames;
+    int m_numFrames;
+    int m_window;
+    int m_nextDecode;
+    int m_nextPop;
+    std::atomic<uint32_t> m_pushCnt;
+    bool m_closed;
+};
+
+#endif // ORDEREDFRAMEQUEUE_H
@@ -0,0 +1,220 @@
+#include "qtfiles.h"
+
+#include <QMutexLocker>
+#include <QTextStream>
+
+#include "estimator.h"
+#include "pipelinerunner.h"
+#include "taskpipeline.h"
+#include "workstealingpool.h"
+
+/** @param numThreads workers of the pool the runner creates if none is given, chains with CHAIN; 0 for one per core
+    @param pool shared by several runners, nullptr for a pool of the runner's own
+**/
+PipelineRunner::PipelineRunner(int numThreads, int numDecoders, WorkStealingPool *pool)
+: numThreads((numThreads>0)? numThreads : WorkStealingPool::hardwareWorkers()),
+  totalTime(0),
+  pipelineStart(0),
+  pool(pool)
+{
+  const char * names[NumStages] = {"decode", "read", "filter", "find", "estimate", "insert", "save"};
+
+  lokRun.numDecoders = numDecoders;
+
+  for(int stage=0; stage<NumStages; stage++){
+    StageStats stageStats;
+    stageStats.name    = names[stage];
+    stageStats.threads = 0;
+    stageStats.begin   = -1;
+    stageStats.end     = 0;
+    stageStats.items   = 0;
+    stats << stageStats;
+  }
+}
+
+PipelineRunner::~PipelineRunner()
+{
+  if(reader.joinable() || !workers.empty() || pipeline){
+    lokRun.close();
+    waitForRead();
+    for(auto & worker : workers){
+      worker.join();
+    }
+    pipeline.reset();
+  }
+}
+
+/// Follow a stack that is still being written
+/** @param idleTimeout ms without new frames after which the run ends, 0 for a complete stack
+    @param snapshotInterval ms between snapshots of the localization image
+**/
+void PipelineRunner::setLive(int idleTimeout, int snapshotInterval)
+{
+  lokRun.liveTimeout = idleTimeout;
+  lokRun.snapshotInterval = snapshotInterval;
+}
+
+bool PipelineRunner::run(double camPixelSize, double resPixelSize, const QString &fileName)
+{
+  if(!start(camPixelSize,resPixelSize,fileName)){
+    return false;
+  }
+  wait();
+  return true;
+}
+
+/// Initialize the run and start all stage threads, returns without waiting
+bool PipelineRunner::start(double camPixelSize, double resPixelSize, const QString &fileName)
+{
+  this->fileName = fileName;
+
+  for(auto & stageStats : stats){
+    stageStats.threads = 0;
+    stageStats.begin   = -1;
+    stageStats.end     = 0;
+    stageStats.items   = 0;
+  }
+
+  watch.start();
+
+  if(!lokRun.init(camPixelSize,resPixelSize,fileName)){
+    return false;
+  }
+
+  for(int decoder=0; decoder<lokRun.numDecoders; decoder++){
+    workers.push_back(startStage(Decode, 70+decoder, &Estimator::decode));
+  }
+
+#ifdef CHAIN
+  for(int thread=0; thread<numThreads; thread++){
+    workers.push_back(startStage(Filter, 10+thread, &Estimator::filter));
+  }
+#else
+  if(!pool){
+    ownPool.reset(new WorkStealingPool(numThreads));
+    pool = ownPool.get();
+  }
+
+  pipelineStart = watch.nsecsElapsed();
+  pipeline.reset(new TaskPipeline(pool,&lokRun));
+  pipeline->start();
+#endif
+
+  reader = startStage(Read, 0, &Estimator::read);
+
+  return true;
+}
+
+/// Block until the whole stack has been read, later stages may still be busy
+void PipelineRunner::waitForRead()
+{
+  if(reader.joinable()){
+    reader.join();
+  }
+}
+
+/// Block until all stages are done, then write the localization image
+void PipelineRunner::wait()
+{
+  waitForRead();
+
+  for(auto & worker : workers){
+    worker.join();
+  }
+  workers.clear();
+
+  if(pipeline){
+    pipeline->wait();
+
+    const Stage pipelineStages[] = {Filter, Find, Estimate, Insert, Save};
+    for(int stage = 0; stage < TaskPipeline::NumStages; stage++){
+      const auto times = pipeline->times((TaskPipeline::Stage) stage);
+      StageStats & stageStats = stats[pipelineStages[stage]];
+      stageStats.threads = times.peak;
+      stageStats.begin   = (times.begin<0)? -1 : pipelineStart + times.begin;
+      stageStats.end     = pipelineStart + times.end;
+    }
+
+    pipeline.reset();
+  }
+
+  stats[Decode].items   = lokRun.decodeQueue.getPushes();
+  stats[Read].items     = lokRun.toFilterQueue.getPushes();
+  stats[Filter].items   = lokRun.toFilterQueue.getPops();
+  stats[Find].items     = lokRun.roiQueue.getPushes();
+  stats[Estimate].items = lokRun.toPrintQueue.getPushes();
+  stats[Insert].items   = lokRun.toPrintQueue.getPops();
+  stats[Save].items     = lokRun.toSaveQueue.getPops();
+
+  lokRun.saveResultImage();
+  lokRun.closeFiles();
+
+  totalTime = watch.elapsed();
+}
+
+std::thread PipelineRunner::startStage(Stage stage, int id, void (Estimator::*work)())
+{
+  {
+    QMutexLocker locker(&statsMutex);
+    stats[stage].threads++;
+  }
+
+  return std::thread([this,stage,id,work](){
+    const qint64 begin = watch.nsecsElapsed();
+    {
+      Estimator estim(id,&lokRun);
+      (estim.*work)();
+    }
+    const qint64 end = watch.nsecsElapsed();
+
+    QMutexLocker locker(&statsMutex);
+    StageStats & stageStats = stats[stage];
+    if(stageStats.begin<0 || begin<stageStats.begin){
+      stageStats.begin = begin;
+    }
+    if(end>stageStats.end){
+      stageStats.end = end;
+    }
+  });
+}
+
+void PipelineRunner::printStatistics(QTextStream &out) const
+{
+  QMutexLocker locker(&statsMutex);
+
+  // threads of a stage on the pool are the most slices that ran at the same time
+  out << "stage\tthreads\twall[s]\titems\titems/s\n";
+  for(const auto & stageStats : stats){
+    if(stageStats.threads == 0){
+      continue;
+    }
+    const double seconds = (stageStats.end - stageStats.begin) / 1e9;
+    const double rate = (seconds>0)? stageStats.items/seconds : 0.0;
+
+    out << stageStats.name    << "\t"
+        << stageStats.threads << "\t"
+        << seconds            << "\t"
+        << stageStats.items   << "\t"
+        << rate               << "\n";
+  }
+
+  const double seconds = totalTime / 1000.0;
+  out << "total\t-\t" << seconds << "\t" << lokRun.currResNr << "\t"
+      << ((seconds>0)? lokRun.currResNr/seconds : 0.0) << "\n";
+
+  // peak fill of every queue, a peak at the capacity means its consumer is the bottleneck
+  // frame queues share the filter queue's capacity, the task pipeline keeps it for the later ones,
+  // the spot queues share the run's spot capacity
+  const uint32_t frameCapacity = lokRun.toFilterQueue.getCapacity();
+  out << "queue\tcapacity\tpeak\n";
+  out << "filter\t" << frameCapacity                      << "\t" << lokRun.toFilterQueue.getHighWater() << "\n";
+  out << "find\t"   << frameCapacity                      << "\t" << lokRun.toFindQueue.getHighWater()   << "\n";
+  out << "roi\t"    << lokRun.spotQueueCapacity           << "\t" << lokRun.roiQueue.getHighWater()      << "\n";
+  out << "insert\t" << lokRun.spotQueueCapacity           << "\t" << lokRun.toPrintQueue.getHighWater()  << "\n";
+#ifdef SAVE
+  out << "save\t"   << frameCapacity                      << "\t" << lokRun.toSaveQueue.getHighWater()   << "\n";
+#endif
+  // frames and spots in use at the same time, every other one reused one of them
+  out << "frames allocated\t" << lokRun.framePool.getAllocations() << "\n";
+  out << "spots allocated\t"  << lokRun.roiPool.getAllocations()   << "\n";
+}
@@ -0,0 +1,82 @@
+#ifndef PIPELINERUNNER_H
+#define PIPELINERUNNER_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "localizationrun.h"
+
+class Estimator;
+class QTextStream;
+class TaskPipeline;
+class WorkStealingPool;
+
+/// Drives the localization pipeline of one stack without an event loop
+/** The reader and the decoders run on their own std::threads, all later
+    stages run as tasks of a TaskPipeline on a WorkStealingPool, which may be
+    shared by several runners. With CHAIN every filter thread runs the chain
+    of later stages itself. Wall time and throughput of each stage are
+    recorded so headless batch jobs can be scheduled.
+**/
+class PipelineRunner
+{
+  public:
+    explicit PipelineRunner(int numThreads, int numDecoders = 0, WorkStealingPool *pool = nullptr);
+    ~PipelineRunner();
+
+    inline void setParameters(LocalizationRun::Parameters const& params) { lokRun.setParameters(params); }
+    void setLive(int idleTimeout, int snapshotInterval);
+    inline void setFrameQueueCapacity(int capacity) { lokRun.frameQueueCapacity = capacity; }
+    inline void setSpotQueueCapacity(int capacity) { lokRun.spotQueueCapacity = capacity; }
+    inline void setFuseFilterFind(bool fuse) { lokRun.fuseFilterFind = fuse; }
+
+    bool start(double camPixelSize, double resPixelSize, const QString &fileName);
+    void waitForRead();
+    void wait();
+
+    bool run(double camPixelSize, double resPixelSize, const QString &fileName);
+    void printStatistics(QTextStream &out) const;
+
+    inline qint64 getElapsed() const { return totalTime; }
+    inline int getNumSpots() const { return lokRun.currResNr; }
+    inline QString const& getFileName() const { return fileName; }
+    inline QString const& getTag() const { return lokRun.params.tag; }
+
+  private:
+    enum Stage { Decode, Read, Filter, Find, Estimate, Insert, Save, NumStages };
+
+    struct StageStats{
+      QString name;
+      int threads;
+      qint64 begin;   // ns since start of run
+      qint64 end;     // ns since start of run
+      quint64 items;
+    };
+
+    std::thread startStage(Stage stage, int id, void (Estimator::*work)());
+
+    int numThreads;
+    qint64 totalTime;
+    qint64 pipelineStart;   // ns since start of run
+
+    WorkStealingPool *pool;
+    std::unique_ptr<WorkStealingPool> ownPool;
+    std::unique_ptr<TaskPipeline> pipeline;
+    QString fileName;
+
+    LocalizationRun lokRun;
+
+    QElapsedTimer watch;
+    mutable QMutex statsMutex;
+    QVector<StageStats> stats;
+    std::thread reader;
+    std::vector<std::thread> workers;
+};
+
+#endif // PIPELINERUNNER_H
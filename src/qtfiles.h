@@ -1,6 +1,7 @@
 #ifndef QTFILES_H
 #define QTFILES_H
 
+#ifndef HEADLESS
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QPushButton>
@@ -9,15 +10,18 @@
 #include <QScrollArea>
 #include <QScrollBar>
 #include <QAction>
+#include <QFileDialog>
+#include <QInputDialog>
+#include <QImage>
+#endif
 
 #include <QDebug>
 #include <QThread>
 #include <QVariant>
 #include <QCoreApplication>
-#include <QFileDialog>
-#include <QInputDialog>
+#include <QDir>
+#include <QFileInfo>
 #include <QTime>
-#include <QImage>
 #include <QSemaphore>
 
 
@@ -29,5 +33,6 @@
 //#define CHAIN // chain = not multithreaded
 //#define SAVE
 //#define LOG
+//#define HEADLESS // no widgets, set by sfp-localize.pro
 
 #endif // QTFILES_H
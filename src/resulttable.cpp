@@ -0,0 +1,43 @@
+#include "resulttable.h"
+
+ResultTable::ResultTable()
+{
+}
+
+ResultTable::~ResultTable()
+{
+  clear();
+}
+
+/// An empty chunk, one that was handed back if there is one
+ResultTable::Chunk *ResultTable::acquire()
+{
+  {
+    std::lock_guard<std::mutex> lock(mt);
+    if(!idle.empty()){
+      Chunk *chunk = idle.back();
+      idle.pop_back();
+      return chunk;
+    }
+  }
+  return new Chunk;
+}
+
+/// Hand back a chunk that was printed and rendered, its rows are dropped
+void ResultTable::release(Chunk *chunk)
+{
+  chunk->count = 0;
+
+  std::lock_guard<std::mutex> lock(mt);
+  idle.push_back(chunk);
+}
+
+/// Free all chunks that were handed back
+void ResultTable::clear()
+{
+  std::lock_guard<std::mutex> lock(mt);
+  for(auto chunk : idle){
+    delete chunk;
+  }
+  idle.clear();
+}
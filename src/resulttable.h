@@ -0,0 +1,65 @@
+#ifndef RESULTTABLE_H
+#define RESULTTABLE_H
+
+#include <mutex>
+#include <vector>
+
+#include "roi.h"
+
+/// Results of a run column by column, one chunk per batch of spots
+/** An Estimator takes a chunk from the table, fills it with the results of a
+    batch of spots and hands it to LocalizationRun::releaseResults(), which
+    prints the chunks in batch order. The spot renderer scans a chunk right
+    after it was filled, or takes it from resultQueue once it was printed.
+    A chunk that was printed and rendered is handed back and given out again
+    instead of freed, so a run only holds the chunks of the batches in flight.
+**/
+class ResultTable
+{
+  public:
+    struct Chunk{
+      enum { capacity = 256 };   ///< results of a chunk, at least Estimator::batchSize
+
+      Chunk() : count(0) {}
+
+      inline bool full() const { return count == capacity; }
+
+      /// Append a result, the chunk must not be full
+      inline void append(Roi::Result const& res){
+        mx[count]      = res.mx;
+        my[count]      = res.my;
+        dx2[count]     = res.dx2;
+        dy2[count]     = res.dy2;
+        sx2[count]     = res.sx2;
+        sy2[count]     = res.sy2;
+        gesQ[count]    = res.gesQ;
+        QMax[count]    = res.QMax;
+        sliceNr[count] = res.sliceNr;
+        count++;
+      }
+
+      int count;
+      double mx[capacity];
+      double my[capacity];
+      double dx2[capacity];
+      double dy2[capacity];
+      double sx2[capacity];
+      double sy2[capacity];
+      int gesQ[capacity];
+      int QMax[capacity];
+      int sliceNr[capacity];
+    };
+
+    ResultTable();
+    ~ResultTable();
+
+    Chunk *acquire();
+    void release(Chunk *chunk);
+    void clear();
+
+  private:
+    std::mutex mt;
+    std::vector<Chunk*> idle;
+};
+
+#endif // RESULTTABLE_H
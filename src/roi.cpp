@@ -1,73 +1,98 @@
 #include "qtfiles.h"
 
+#include <algorithm>
 #include <cmath>
 #include "roi.h"
+#include "ImageStack/img_kernels.hpp"
 
 Roi::Roi() :
     dimX(7),dimY(7),
     sliceNr(0),meanbg(0),
-    posX(0),posY(0)
+    posX(0),posY(0),
+    data(inlineData),capacity(inlineSize)
 {
-  const auto dim = dimX*dimY;
-
-  data = new quint16[dim];
-  for(int i=0; i<dim; i++)
-  {
-    data[i]=0;
-  }
+  allocate();
+  std::fill(data, data+dimX*dimY, 0);
 }
 
 Roi::Roi(int _posX, int _posY, int _sliceNr, int _meanbg, int _dimX, int _dimY) :
     dimX(_dimX),dimY(_dimY),
     sliceNr(_sliceNr),meanbg(_meanbg),
-    posX(_posX),posY(_posY)
+    posX(_posX),posY(_posY),
+    data(inlineData),capacity(inlineSize)
 {
-  const auto dim = dimX*dimY;
-  data = new quint16[dim];
-  for(int i=0; i<dim; i++)
-  {
-    data[i]=0;
-  }
+  allocate();
+  std::fill(data, data+dimX*dimY, 0);
 }
 
-Roi::Roi(Roi const& roi)
+Roi::Roi(Roi const& roi) :
+    dimX(roi.dimX),dimY(roi.dimY),
+    sliceNr(roi.sliceNr),meanbg(roi.meanbg),
+    posX(roi.posX),posY(roi.posY),
+    data(inlineData),capacity(inlineSize)
 {
-  dimX = roi.dimX;
-  dimY = roi.dimY;
-
-  data = new quint16[dimX*dimY];
-
-  for(int i=0; i<dimX; ++i){
-    data[i]=roi.data[i];
-  }
+  allocate();
+  std::copy(roi.data, roi.data+dimX*dimY, data);
 }
 
 Roi& Roi::operator =(Roi const& roi)
 {
-  dimX = roi.dimX;
-  dimY = roi.dimY;
-
-  data = new quint16[dimX*dimY];
-
-  for(int i=0; i<dimX; ++i){
-    data[i]=roi.data[i];
+  if(this == &roi){
+    return *this;
   }
 
+  reset(roi.posX,roi.posY,roi.sliceNr,0,roi.dimX,roi.dimY);
+  meanbg = roi.meanbg;
+  std::copy(roi.data, roi.data+dimX*dimY, data);
+
   return *this;
 }
 
 Roi::~Roi()
 {
-    delete [] data;
+    if(data != inlineData){
+      delete [] data;
+    }
     //qDebug() << "Roi deleted!";
 }
 
+/// Make the Roi a new spot, without allocating unless it grows past what it held before
+/** The pixels are left over from the spot before, every one of them has to be set.
+**/
+void Roi::reset(int _posX, int _posY, int _sliceNr, int _meanbg, int _dimX, int _dimY)
+{
+  dimX    = _dimX;
+  dimY    = _dimY;
+  sliceNr = _sliceNr;
+  meanbg  = _meanbg;
+  posX    = _posX;
+  posY    = _posY;
+  allocate();
+}
+
+/// Take over newData, which holds dimX*dimY pixels allocated with new[]
 void Roi::setData(quint16 *newData)
 {
-    if(data){
+    if(data != inlineData){
       delete [] data;
     }
     data=newData;
+    capacity=dimX*dimY;
+}
+
+/// Make room for dimX*dimY pixels, spots up to inlineSize pixels use inlineData
+void Roi::allocate()
+{
+  const int dim = dimX*dimY;
+  if(dim <= capacity){
+    return;
+  }
+
+  if(data != inlineData){
+    delete [] data;
+  }
+  data = new quint16[dim];
+  capacity = dim;
 }
 
 void Roi::setGlobalPos(int _posX, int _posY)
@@ -105,84 +130,218 @@ void Roi::print() const
   }
 }
 
-Roi::Result *Roi::calc() const
+Roi::Result Roi::calc() const
 {
-  Result *res = new Result;
+  spot_sums sums = spot_sums();
 
-  int mxacc  = 0;
-  int myacc  = 0;
-  int sxacc = 0;
-  int syacc = 0;
-  int Qacc  = 0;
-  int QMax  = 0;
+  for(int y=0; y<dimY; y++){
+    for(int x=0; x<dimX; x++){
+      int value = data[y*dimX+x];
 
-  int dxacc = 0;
-  int dyacc = 0;
+      if(value>0){
 
-  int dx2acc = 0;
-  int dy2acc = 0;
+        sums.n++;
 
-  int nacc = 0;
+        sums.x2 += x*x;
+        sums.y2 += y*y;
 
-  for(double y=0; y<dimX; y++){
-    for(double x=0; x<dimX; x++){
-      int value = (int)val(x,y);
+        sums.x += x;
+        sums.y += y;
 
-      if(value>0){
-
-        nacc++;
+        sums.q += value;
+        if(value>sums.q_max){
+          sums.q_max = value;
+        }
 
-        dx2acc += x*x;
-        dy2acc += y*y;
+        sums.mx += value*x;
+        sums.sx += value*x*x;
 
-        dxacc += x;
-        dyacc += y;
+        sums.my += value*y;
+        sums.sy += value*y*y;
+      }
+    }
+  }
 
-        Qacc += value;
-        if(value>QMax){
-          QMax = value;
-        }
+  return moments(sums);
+}
 
-        int xval = value*x;
-        mxacc +=xval;
-        sxacc += x*xval;
+/// calc() of many spots, square ones of a size spot_sums_block() supports are summed up spot_lanes at a time
+/** The sums are exact integers either way, so the results are the same calc() gives.
+    A block holds spots of one size, a spot of another size starts the next one.
+**/
+void Roi::calcBatch(Roi const *const *rois, int count, Result *results)
+{
+  quint16 block[spot_max_size*spot_max_size*spot_lanes] = {0};
+  int spots[spot_lanes];   // index of the spot in every lane
+  int lanes = 0;
+  int size = 0;            // side of the spots in the block
+
+  for(int i=0; i<count; i++){
+    Roi const& roi = *rois[i];
+    if(roi.dimX != roi.dimY || !spot_size_supported(roi.dimX)){
+      results[i] = roi.calc();
+      continue;
+    }
 
-        int yval = value*y;
-        myacc +=yval;
-        syacc += y*yval;
+    if(roi.dimX != size){
+      if(lanes > 0){
+        momentsBlock(rois, block, size, spots, lanes, results);
+        lanes = 0;
       }
+      size = roi.dimX;
     }
+
+    const int pixels = size*size;
+    for(int p=0; p<pixels; p++){
+      block[p*spot_lanes + lanes] = roi.data[p];
+    }
+    spots[lanes++] = i;
+
+    if(lanes == spot_lanes){
+      momentsBlock(rois, block, size, spots, lanes, results);
+      lanes = 0;
+    }
+  }
+
+  if(lanes > 0){
+    momentsBlock(rois, block, size, spots, lanes, results);
   }
+}
 
-  res->my  = ((double)myacc)/Qacc;
-  res->sy2 = ((double)syacc)/Qacc - (res->my*res->my);
-  double dy1 = res->sy2;
+/// Results of the spots of a filled block
+/** @param size side of the spots in the block
+    @param spots index of the spot in every lane
+**/
+void Roi::momentsBlock(Roi const *const *rois, quint16 const *block, int size, int const *spots, int lanes, Result *results)
+{
+  spot_sums sums[spot_lanes];
+  spot_sums_block(block, size, lanes, sums);
+  for(int lane=0; lane<lanes; lane++){
+    results[spots[lane]] = rois[spots[lane]]->moments(sums[lane]);
+  }
+}
+
+/// Position, width and error of the spot from its sums
+Roi::Result Roi::moments(spot_sums const& sums) const
+{
+  Result res;
+
+  const int Qacc = sums.q;
+  const int nacc = sums.n;
+
+  res.my  = ((double)sums.my)/Qacc;
+  res.sy2 = ((double)sums.sy)/Qacc - (res.my*res.my);
+  double dy1 = res.sy2;
   double dy2 = 1.0/12.0;
-  double dy3 = meanbg/Qacc*(dy2acc + (res->my * (nacc * res->my - 2*dyacc)));
+  double dy3 = meanbg/Qacc*(sums.y2 + (res.my * (nacc * res.my - 2*sums.y)));
 
-  res->dy2 = (dy1+dy2+dy3)/Qacc;
+  res.dy2 = (dy1+dy2+dy3)/Qacc;
 
-  res->my += posY;
+  res.my += posY;
 
-  res->mx  = ((double)mxacc)/Qacc;
-  res->sx2 = ((double)sxacc)/Qacc - (res->mx*res->mx);
+  res.mx  = ((double)sums.mx)/Qacc;
+  res.sx2 = ((double)sums.sx)/Qacc - (res.mx*res.mx);
 
-  double dx1 = res->sx2;
+  double dx1 = res.sx2;
   double dx2 = 1.0/12.0;
-  double dx3 = meanbg/Qacc*(dx2acc - res->mx * (2*dxacc - nacc * res->mx));
+  double dx3 = meanbg/Qacc*(sums.x2 - res.mx * (2*sums.x - nacc * res.mx));
 
-  res->dx2 = (dx1+dx2+dx3)/Qacc;
+  res.dx2 = (dx1+dx2+dx3)/Qacc;
 
-  res->mx += posX;
+  res.mx += posX;
 
-  res->gesQ = Qacc;
-  res->QMax = QMax;
-  res->sliceNr = sliceNr;
+  res.gesQ = Qacc;
+  res.QMax = sums.q_max;
+  res.sliceNr = sliceNr;
 
   return res;
 }
 
 
+/*
+  The Kernels are templates on the ROI size. They move spots between a
+  frame, a block of spot_lanes spots side by side like spot_sums_block()
+  takes them, and the Rois.
+*/
+
+/// Copy a spot from a frame into its lane of a block, less the cutoff
+/** @return sum of the pixels
+**/
+template <int Size>
+static int extractFixed(quint16 *block, int lane, uint16_t const *const *frame, int left, int top, double cutoff)
+{
+  int QOld = 0;
+  for(int y=0; y<Size; y++){
+    for(int x=0; x<Size; x++){
+      quint16 value = (quint16) frame[top+y][left+x];
+      value = (value>cutoff)? value-cutoff : 0;
+      QOld += value;
+      block[(y*Size+x)*spot_lanes + lane] = value;
+    }
+  }
+  return QOld;
+}
+
+/// Copy a spot from its lane of a block
+template <int Size>
+static void unpackFixed(quint16 *data, quint16 const *block, int lane)
+{
+  for(int p=0; p<Size*Size; p++){
+    data[p] = block[p*spot_lanes + lane];
+  }
+}
+
+/// The kernels for ROIs of size x size pixels, nullptr if there are none for that size
+Roi::Kernels const* Roi::kernels(int size)
+{
+  static const Kernels fixed[] = {
+    {5,  extractFixed<5>,  unpackFixed<5>},
+    {7,  extractFixed<7>,  unpackFixed<7>},
+    {9,  extractFixed<9>,  unpackFixed<9>},
+    {11, extractFixed<11>, unpackFixed<11>},
+  };
+
+  for(auto const& kernels : fixed){
+    if(kernels.size == size){
+      return &kernels;
+    }
+  }
+  return nullptr;
+}
+
+/// Copy the spots from a frame, less the cutoff, and cut their edges like cutEdges()
+/** The spots are cut spot_lanes at a time by the vector kernel.
+    @param rois Spots of the kernels' size at their place in the frame
+    @param qOld Receives the sum of the pixels of every spot before cutting
+    @param qNew Receives the sum of the pixels of every spot after cutting
+**/
+void Roi::separate(Kernels const& kernels, Roi *const *rois, int count, uint16_t const *const *frame,
+                   double cutoff, int *qOld, int *qNew)
+{
+  quint16 block[spot_max_size*spot_max_size*spot_lanes];
+  int32_t sums[spot_lanes];
+
+  for(int first=0; first<count; first+=spot_lanes){
+    const int lanes = std::min<int>(spot_lanes, count-first);
+
+    // lanes after the last spot cut a copy of the first one
+    for(int lane=0; lane<spot_lanes; lane++){
+      Roi const& roi = *rois[first + ((lane<lanes)? lane : 0)];
+      const int QOld = kernels.extract(block,lane,frame,roi.posX,roi.posY,cutoff);
+      if(lane<lanes){
+        qOld[first+lane] = QOld;
+      }
+    }
+
+    spot_cut_edges_block(block,kernels.size,sums);
+
+    for(int lane=0; lane<lanes; lane++){
+      qNew[first+lane] = sums[lane];
+      kernels.unpack(rois[first+lane]->data,block,lane);
+    }
+  }
+}
+
 int Roi::cutEdges()
 {
   //print();
@@ -3,20 +3,38 @@
 
 #include <QPair>
 
+#include <stdint.h>
+
+struct spot_sums;
+
 class Roi
 {
   public:
+    enum { inlineSize = 7*7 };   ///< pixels a Roi holds without allocating, a 7x7 spot
+
+    /// Spot functions for one ROI size with fixed loop bounds, a run picks them once
+    struct Kernels{
+      int size;
+      int (*extract)(quint16 *block, int lane, uint16_t const *const *frame, int left, int top, double cutoff);
+      void (*unpack)(quint16 *data, quint16 const *block, int lane);
+    };
+    static Kernels const* kernels(int size);
+    static void separate(Kernels const& kernels, Roi *const *rois, int count, uint16_t const *const *frame,
+                         double cutoff, int *qOld, int *qNew);
+
     explicit Roi(int _posX, int _posY, int _sliceNr=0, int _meanbg=0, int _dimX=7, int _dimY=7);
     Roi(Roi const& roi);
     Roi();
     Roi& operator =(Roi const& roi);
     ~Roi();
 
+    void reset(int _posX, int _posY, int _sliceNr=0, int _meanbg=0, int _dimX=7, int _dimY=7);
     void setData(quint16 *newData);
     void setValue(quint16 value,int x, int y);
     void setGlobalPos(int _posX, int _posY);
-    inline QPair<int,int> getGlobalPos(){return QPair<int,int> (posX,posY);}
-    inline QPair<int,int> getSize(){return QPair<int,int>(dimX,dimY);}
+    inline QPair<int,int> getGlobalPos() const {return QPair<int,int> (posX,posY);}
+    inline QPair<int,int> getSize() const {return QPair<int,int>(dimX,dimY);}
+    inline quint16 const* getData() const {return data;}
 
     struct Result{
         void convertMetric(const double dataPixelSize){
@@ -42,11 +60,15 @@ class Roi
 
     quint16 val(int x,int y) const;
     void print() const;
-    Result * calc() const;
+    Result calc() const;
+    static void calcBatch(Roi const *const *rois, int count, Result *results);
     int cutEdges();
     int getQ();
 
   private:
+    void allocate();
+    Result moments(spot_sums const& sums) const;
+    static void momentsBlock(Roi const *const *rois, quint16 const *block, int size, int const *spots, int lanes, Result *results);
     void cutX();
     void cutY();
 
@@ -57,8 +79,9 @@ class Roi
     double meanbg; //value needed for error calculation
     int posX;      //defines left boarder of ROI in global Image
     int posY;      //defines upper boarder of ROI in global Image
-    quint16 *data;
-    
+    quint16 *data; //points to inlineData for spots up to inlineSize pixels
+    int capacity;  //pixels data has room for
+    quint16 inlineData[inlineSize];
 };
 
 #endif // ROI_H
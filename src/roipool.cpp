@@ -0,0 +1,59 @@
+#include "roipool.h"
+
+#include <algorithm>
+
+#include "roi.h"
+
+const size_t RoiPool::chunkSize;
+
+RoiPool::RoiPool()
+: allocations(0)
+{
+}
+
+RoiPool::~RoiPool()
+{
+  clear();
+}
+
+/// Append a chunk of Rois to spare, their size and pixels are left over from their last spot
+void RoiPool::acquire(std::vector<Roi*> &spare)
+{
+  size_t taken = 0;
+  {
+    std::lock_guard<std::mutex> lock(mt);
+    taken = std::min(chunkSize, idle.size());
+    spare.insert(spare.end(), idle.end()-taken, idle.end());
+    idle.resize(idle.size()-taken);
+  }
+
+  for(; taken<chunkSize; taken++){
+    spare.push_back(new Roi());
+    allocations++;
+  }
+}
+
+/// Hand back the Rois of spare beyond the first keep ones
+void RoiPool::release(std::vector<Roi*> &spare, size_t keep)
+{
+  if(spare.size() <= keep){
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mt);
+    idle.insert(idle.end(), spare.begin()+keep, spare.end());
+  }
+  spare.resize(keep);
+}
+
+/// Free all Rois that were handed back and start counting allocations again
+void RoiPool::clear()
+{
+  std::lock_guard<std::mutex> lock(mt);
+  for(auto roi : idle){
+    delete roi;
+  }
+  idle.clear();
+  allocations = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef ROIPOOL_H
+#define ROIPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+class Roi;
+
+/// Rois of one run that are handed back and given out again instead of freed
+/** The find stage makes a Roi for every candidate, the estimate and insert
+    stages free them, always many at a time. Every Estimator keeps the Rois it
+    freed in a spare list and trades them with the pool a chunk at a time, so
+    a candidate costs no allocation and the lock is taken once per chunk.
+    Together with the pixels a 7x7 Roi holds inline, candidate extraction and
+    estimation allocate nothing once the first chunks are made.
+**/
+class RoiPool
+{
+  public:
+    static const size_t chunkSize = 256;   ///< Rois traded at once
+
+    RoiPool();
+    ~RoiPool();
+
+    void acquire(std::vector<Roi*> &spare);
+    void release(std::vector<Roi*> &spare, size_t keep = 0);
+    void clear();
+
+    inline uint32_t getAllocations() const { return allocations; }
+
+  private:
+    std::mutex mt;
+    std::vector<Roi*> idle;
+    std::atomic<uint32_t> allocations;   ///< Rois the pool had to create
+};
+
+#endif // ROIPOOL_H
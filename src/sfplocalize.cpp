@@ -0,0 +1,139 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+
+#include <stdio.h>
+
+#include "batchscheduler.h"
+#include "localizationrun.h"
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("sfp-localize");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Headless SFP localization of TIFF stacks");
+  parser.addHelpOption();
+  parser.addPositionalArgument("stacks", "TIFF stacks or directories of stacks to localize", "<stack|dir>...");
+
+  QCommandLineOption camPixelOption("camera-pixel", "Camera pixel size in nm (default 100).", "nm", "100");
+  QCommandLineOption resPixelOption("result-pixel", "Pixel size of the localization image in nm (default 10).", "nm", "10");
+  QCommandLineOption thresholdOption("threshold", "Threshold factor over sqrt(meanbg) (default 3).", "factor", "3");
+  QCommandLineOption cutoffOption("cutoff", "Cutoff factor: value - factor * sqrt(meanbg) (default 2).", "factor", "2");
+  QCommandLineOption separateOption("separate", "Minimum remaining intensity ratio after separation (default 0.7).", "factor", "0.7");
+  QCommandLineOption estimatorOption("estimator", "Spot estimator: centroid, or mle for a maximum likelihood Gaussian fit (default centroid).", "method", "centroid");
+  QCommandLineOption roiSizeOption("roi-size", "Side of the square ROI cut out around a spot: 5, 7, 9 or 11 (default 7).", "pixels", "7");
+  QCommandLineOption threadsOption("threads", "Worker threads shared by the filter, find, estimate and insert stages of all runs, 0 for one per core (default 0).", "n", "0");
+  QCommandLineOption decodersOption("decoders", "Number of parallel TIFF decoders, 0 decodes on the reader thread (default 2).", "n", "2");
+  QCommandLineOption inFlightOption("runs-in-flight", "Runs processed at the same time in batch mode (default 2).", "n", "2");
+  QCommandLineOption capacityOption("queue-capacity", "Frames the filter, find and save queues hold before the stage feeding them waits, 0 for unbounded (default 64).", "n", "64");
+  QCommandLineOption spotCapacityOption("spot-queue-capacity", "Spots the estimate and insert queues hold before the stage feeding them waits, 0 for unbounded (default 16384).", "n", "16384");
+  QCommandLineOption liveOption("live", "Localize stacks, or directories of frame files, while they are written; a run ends after this many seconds without a new frame (default 0, off).", "s", "0");
+  QCommandLineOption snapshotOption("snapshot-interval", "Seconds between snapshots of the localization image in live mode (default 5).", "s", "5");
+  QCommandLineOption unfusedOption("unfused", "Filter and search frames in two stages instead of one pass over each frame.");
+  QCommandLineOption parameterSetOption("parameter-set", "Localize every stack with this parameter set, can be repeated.", "threshold,cutoff,separate");
+
+  parser.addOption(camPixelOption);
+  parser.addOption(resPixelOption);
+  parser.addOption(thresholdOption);
+  parser.addOption(cutoffOption);
+  parser.addOption(separateOption);
+  parser.addOption(estimatorOption);
+  parser.addOption(roiSizeOption);
+  parser.addOption(threadsOption);
+  parser.addOption(decodersOption);
+  parser.addOption(inFlightOption);
+  parser.addOption(capacityOption);
+  parser.addOption(spotCapacityOption);
+  parser.addOption(liveOption);
+  parser.addOption(snapshotOption);
+  parser.addOption(unfusedOption);
+  parser.addOption(parameterSetOption);
+
+  parser.process(app);
+
+  const int liveTimeout      = qMax(0.0, parser.value(liveOption).toDouble()*1000);
+  const int snapshotInterval = qMax(0.0, parser.value(snapshotOption).toDouble()*1000);
+
+  // in live mode a directory is one stack of frame files
+  const QStringList stacks = (liveTimeout>0)? parser.positionalArguments()
+                                            : BatchScheduler::collectStacks(parser.positionalArguments());
+  if(stacks.isEmpty()){
+    parser.showHelp(1);
+  }
+
+  SpotEstimator::Method method = SpotEstimator::Centroid;
+  if(!SpotEstimator::methodFromName(parser.value(estimatorOption).toLatin1().constData(),method)){
+    QTextStream(stderr) << "error: unknown estimator " << parser.value(estimatorOption) << "\n";
+    return 1;
+  }
+
+  const int roiSize = parser.value(roiSizeOption).toInt();
+  if(!Roi::kernels(roiSize)){
+    QTextStream(stderr) << "error: unsupported ROI size " << parser.value(roiSizeOption) << "\n";
+    return 1;
+  }
+
+  QList<LocalizationRun::Parameters> parameterSets;
+
+  const QStringList setValues = parser.values(parameterSetOption);
+  for(const auto & setValue : setValues){
+    LocalizationRun::Parameters params;
+    params.threasholdFactor = setValue.section(",",0,0).toInt();
+    params.cutoffFactor     = setValue.section(",",1,1).toInt();
+    params.separateFactor   = setValue.section(",",2,2).toDouble();
+    params.method           = method;
+    params.roiSize          = roiSize;
+    if(params.threasholdFactor<=0 || params.cutoffFactor<=0 || params.separateFactor<=0){
+      QTextStream(stderr) << "error: invalid parameter set " << setValue << "\n";
+      return 1;
+    }
+    parameterSets << params;
+  }
+
+  if(parameterSets.isEmpty()){
+    LocalizationRun::Parameters params;
+    bool thresholdOk, cutoffOk, separateOk;
+    params.threasholdFactor = parser.value(thresholdOption).toInt(&thresholdOk);
+    params.cutoffFactor     = parser.value(cutoffOption).toInt(&cutoffOk);
+    params.separateFactor   = parser.value(separateOption).toDouble(&separateOk);
+    params.method           = method;
+    params.roiSize          = roiSize;
+    if(!thresholdOk || !cutoffOk || !separateOk
+       || params.threasholdFactor<=0 || params.cutoffFactor<=0 || params.separateFactor<=0){
+      QTextStream(stderr) << "error: threshold and cutoff must be positive integers, separate a positive number\n";
+      return 1;
+    }
+    parameterSets << params;
+  }else if(parameterSets.size() > 1){
+    // keep the outputs of the parameter sets apart
+    for(auto & params : parameterSets){
+      params.tag = QString("_t%1_c%2_s%3").arg(params.threasholdFactor)
+                                          .arg(params.cutoffFactor)
+                                          .arg(params.separateFactor);
+    }
+  }
+
+  bool camPixelOk, resPixelOk;
+  const double camPixelSize = parser.value(camPixelOption).toDouble(&camPixelOk);
+  const double resPixelSize = parser.value(resPixelOption).toDouble(&resPixelOk);
+  if(!camPixelOk || !resPixelOk || !(camPixelSize>0) || !(resPixelSize>0)){
+    QTextStream(stderr) << "error: camera and result pixel sizes must be positive numbers\n";
+    return 1;
+  }
+  const int numThreads      = qMax(0, parser.value(threadsOption).toInt());
+  const int numDecoders     = qMax(0, parser.value(decodersOption).toInt());
+  const int runsInFlight    = qMax(1, parser.value(inFlightOption).toInt());
+
+  QTextStream out(stdout);
+
+  BatchScheduler scheduler(numThreads,numDecoders,runsInFlight);
+  scheduler.setLive(liveTimeout,snapshotInterval);
+  scheduler.setFrameQueueCapacity(qMax(0, parser.value(capacityOption).toInt()));
+  scheduler.setSpotQueueCapacity(qMax(0, parser.value(spotCapacityOption).toInt()));
+  scheduler.setFuseFilterFind(!parser.isSet(unfusedOption));
+  const int failed = scheduler.run(stacks,parameterSets,camPixelSize,resPixelSize,out);
+
+  return (failed==0)? 0 : 1;
+}
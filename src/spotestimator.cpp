@@ -0,0 +1,372 @@
+#include "spotestimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "ImageStack/img_kernels.hpp"
+
+SpotEstimator *SpotEstimator::create(Method method)
+{
+  switch(method){
+    case GaussMLE: return new GaussMleEstimator;
+    default:       return new CentroidEstimator;
+  }
+}
+
+/// The method of a name that name() gives
+/** @return false iff no method has that name, method is left as it is then
+**/
+bool SpotEstimator::methodFromName(char const *name, Method &method)
+{
+  if(std::strcmp(name,"centroid") == 0){
+    method = Centroid;
+    return true;
+  }
+  if(std::strcmp(name,"mle") == 0){
+    method = GaussMLE;
+    return true;
+  }
+  return false;
+}
+
+
+void CentroidEstimator::estimate(Roi const *const *rois, int count, Roi::Result *results) const
+{
+  Roi::calcBatch(rois,count,results);
+}
+
+
+namespace {
+
+const int lanes = spot_lanes;
+
+enum { X, Y, N, B, S, numParams };   // position, photons, background and sigma
+const int numFisher = numParams*(numParams+1)/2;
+
+/// Spots of size x size pixels fitted side by side, one lane per spot
+template <int size>
+struct Block{
+  double pixels[size*size][lanes];
+  double theta[numParams][lanes];
+};
+
+inline double sq(double value)
+{
+  return value*value;
+}
+
+/// Index of row k, column l >= k of the packed upper triangle of the Fisher matrix
+inline int fisherIndex(int k, int l)
+{
+  return k*numParams - k*(k-1)/2 + (l-k);
+}
+
+/// The Gaussian integrated over every pixel of an axis, and its derivatives by the position and by sigma
+template <int size>
+void axisTerms(double const *pos, double const *sigma, double (*value)[lanes], double (*byPos)[lanes], double (*bySigma)[lanes])
+{
+  for(int lane=0; lane<lanes; lane++){
+    const double scale = 1.0/(M_SQRT2*sigma[lane]);
+    const double norm  = 1.0/(std::sqrt(2*M_PI)*sigma[lane]);
+
+    double edgeLow  = -0.5 - pos[lane];
+    double erfLow   = std::erf(edgeLow*scale);
+    double gaussLow = std::exp(-sq(edgeLow*scale));
+    for(int i=0; i<size; i++){
+      const double edgeHigh  = edgeLow + 1;
+      const double erfHigh   = std::erf(edgeHigh*scale);
+      const double gaussHigh = std::exp(-sq(edgeHigh*scale));
+
+      value[i][lane]   = 0.5*(erfHigh - erfLow);
+      byPos[i][lane]   = norm*(gaussLow - gaussHigh);
+      bySigma[i][lane] = norm/sigma[lane]*(edgeLow*gaussLow - edgeHigh*gaussHigh);
+
+      edgeLow  = edgeHigh;
+      erfLow   = erfHigh;
+      gaussLow = gaussHigh;
+    }
+  }
+}
+
+/// Poisson log-likelihood of the spots under the model theta, without the terms that do not depend on it
+/** @param gradient Receives the gradient of the log-likelihood if not nullptr
+    @param fisher Receives the packed Fisher information if gradient is set
+**/
+template <int size>
+void evaluate(Block<size> const& block, double const (*theta)[lanes], double *logLikelihood,
+              double (*gradient)[lanes], double (*fisher)[lanes])
+{
+  double ax[size][lanes], axPos[size][lanes], axSigma[size][lanes];
+  double ay[size][lanes], ayPos[size][lanes], aySigma[size][lanes];
+  axisTerms<size>(theta[X], theta[S], ax, axPos, axSigma);
+  axisTerms<size>(theta[Y], theta[S], ay, ayPos, aySigma);
+
+  std::fill(logLikelihood, logLikelihood+lanes, 0.0);
+  if(gradient){
+    std::fill(&gradient[0][0], &gradient[0][0] + numParams*lanes, 0.0);
+    std::fill(&fisher[0][0], &fisher[0][0] + numFisher*lanes, 0.0);
+  }
+
+  for(int y=0; y<size; y++){
+    for(int x=0; x<size; x++){
+      double const *data = block.pixels[y*size + x];
+
+      for(int lane=0; lane<lanes; lane++){
+        const double photons = theta[N][lane];
+        const double model = photons*ax[x][lane]*ay[y][lane] + theta[B][lane];
+        // the cut spots have many empty pixels, they need no log
+        logLikelihood[lane] += ((data[lane] > 0)? data[lane]*std::log(model) : 0) - model;
+      }
+
+      if(!gradient){
+        continue;
+      }
+
+      for(int lane=0; lane<lanes; lane++){
+        const double photons = theta[N][lane];
+        const double model = photons*ax[x][lane]*ay[y][lane] + theta[B][lane];
+        const double inverse = 1/model;
+        const double weight = data[lane]*inverse - 1;
+
+        double jacobian[numParams];
+        jacobian[X] = photons*axPos[x][lane]*ay[y][lane];
+        jacobian[Y] = photons*ax[x][lane]*ayPos[y][lane];
+        jacobian[N] = ax[x][lane]*ay[y][lane];
+        jacobian[B] = 1;
+        jacobian[S] = photons*(axSigma[x][lane]*ay[y][lane] + ax[x][lane]*aySigma[y][lane]);
+
+        for(int k=0; k<numParams; k++){
+          gradient[k][lane] += weight*jacobian[k];
+          const double scaled = jacobian[k]*inverse;
+          for(int l=k; l<numParams; l++){
+            fisher[fisherIndex(k,l)][lane] += scaled*jacobian[l];
+          }
+        }
+      }
+    }
+  }
+}
+
+/// Solve (F + damping*diag(F)) step = rhs for one lane with a Cholesky decomposition
+/** @return false iff the matrix is not positive definite
+**/
+bool solve(double const (*fisher)[lanes], int lane, double damping, double const *rhs, double *step)
+{
+  double lower[numParams][numParams];
+  for(int k=0; k<numParams; k++){
+    for(int l=0; l<=k; l++){
+      double sum = fisher[fisherIndex(l,k)][lane];
+      if(l == k){
+        sum *= 1 + damping;
+      }
+      for(int m=0; m<l; m++){
+        sum -= lower[k][m]*lower[l][m];
+      }
+      if(l == k){
+        if(!(sum > 0)){
+          return false;
+        }
+        lower[k][k] = std::sqrt(sum);
+      }else{
+        lower[k][l] = sum/lower[l][l];
+      }
+    }
+  }
+
+  double forward[numParams];
+  for(int k=0; k<numParams; k++){
+    double sum = rhs[k];
+    for(int m=0; m<k; m++){
+      sum -= lower[k][m]*forward[m];
+    }
+    forward[k] = sum/lower[k][k];
+  }
+  for(int k=numParams-1; k>=0; k--){
+    double sum = forward[k];
+    for(int m=k+1; m<numParams; m++){
+      sum -= lower[m][k]*step[m];
+    }
+    step[k] = sum/lower[k][k];
+  }
+  return true;
+}
+
+/// Keep the parameters where the model is defined and the spot stays near the ROI
+void clampParams(double (*theta)[lanes], int lane, int size)
+{
+  theta[X][lane] = std::min(std::max(theta[X][lane], -1.0), (double) size);
+  theta[Y][lane] = std::min(std::max(theta[Y][lane], -1.0), (double) size);
+  theta[N][lane] = std::max(theta[N][lane], 1.0);
+  theta[B][lane] = std::max(theta[B][lane], 1e-3);
+  theta[S][lane] = std::min(std::max(theta[S][lane], 0.3), (double) size);
+}
+
+/// Levenberg-Marquardt steps on all lanes, a step is taken iff it raises the likelihood
+/** The likelihood, gradient and Fisher information of a trial are taken in one
+    pass, so a lane that takes its step has them for the next one already.
+    A lane stops once its position moves by no more than tolerance, so the fit
+    of a spot does not depend on the spots in the other lanes. The block stops
+    when all lanes have.
+    @param fisher Receives the Fisher information at the fitted parameters
+**/
+template <int size>
+void fitBlock(Block<size> & block, double (*fisher)[lanes])
+{
+  const double tolerance = 1e-4;
+
+  double damping[lanes];
+  std::fill(damping, damping+lanes, 1e-2);
+  bool converged[lanes];
+  std::fill(converged, converged+lanes, false);
+
+  double logLikelihood[lanes], gradient[numParams][lanes];
+  evaluate(block, block.theta, logLikelihood, gradient, fisher);
+
+  double trial[numParams][lanes];
+  double trialLikelihood[lanes], trialGradient[numParams][lanes], trialFisher[numFisher][lanes];
+
+  for(int iteration=0; iteration<GaussMleEstimator::iterations; iteration++){
+    bool moving = false;
+    for(int lane=0; lane<lanes; lane++){
+      double rhs[numParams], step[numParams];
+      for(int k=0; k<numParams; k++){
+        rhs[k] = gradient[k][lane];
+      }
+      // a lane that cannot solve retries with more damping
+      const bool solved = !converged[lane] && solve(fisher, lane, damping[lane], rhs, step);
+      if(!solved){
+        std::fill(step, step+numParams, 0.0);
+      }
+      for(int k=0; k<numParams; k++){
+        trial[k][lane] = block.theta[k][lane] + step[k];
+      }
+      clampParams(trial, lane, size);
+      converged[lane] = converged[lane] || (solved && std::fabs(step[X]) < tolerance && std::fabs(step[Y]) < tolerance);
+      moving |= !converged[lane];
+    }
+    if(!moving){
+      break;
+    }
+
+    evaluate(block, trial, trialLikelihood, trialGradient, trialFisher);
+
+    for(int lane=0; lane<lanes; lane++){
+      const bool better = !converged[lane] && trialLikelihood[lane] > logLikelihood[lane];
+      logLikelihood[lane] = better? trialLikelihood[lane] : logLikelihood[lane];
+      for(int k=0; k<numParams; k++){
+        block.theta[k][lane] = better? trial[k][lane] : block.theta[k][lane];
+        gradient[k][lane]    = better? trialGradient[k][lane] : gradient[k][lane];
+      }
+      for(int k=0; k<numFisher; k++){
+        fisher[k][lane] = better? trialFisher[k][lane] : fisher[k][lane];
+      }
+      damping[lane] *= better? 0.1 : 10;
+    }
+  }
+}
+
+/// Fit the filled lanes of a block and replace the centroids of the spots whose fit stayed in the ROI
+/** @param spots index of the spot in every filled lane
+**/
+template <int size>
+void fitAndStore(Block<size> & block, Roi const *const *rois, int const *spots, int filled, Roi::Result *results)
+{
+  // the unused lanes fit a copy of the first spot
+  for(int lane=filled; lane<lanes; lane++){
+    for(int p=0; p<size*size; p++){
+      block.pixels[p][lane] = block.pixels[p][0];
+    }
+    for(int k=0; k<numParams; k++){
+      block.theta[k][lane] = block.theta[k][0];
+    }
+  }
+
+  double fisher[numFisher][lanes];
+  fitBlock(block, fisher);
+
+  for(int lane=0; lane<filled; lane++){
+    // the Cramer-Rao bound of the position is the diagonal of the inverse Fisher information
+    double unitX[numParams] = {0}, unitY[numParams] = {0};
+    double columnX[numParams], columnY[numParams];
+    unitX[X] = 1;
+    unitY[Y] = 1;
+    if(!solve(fisher, lane, 0, unitX, columnX) || !solve(fisher, lane, 0, unitY, columnY)){
+      continue;
+    }
+
+    const double x = block.theta[X][lane];
+    const double y = block.theta[Y][lane];
+    if(!(x >= 0 && x <= size-1 && y >= 0 && y <= size-1 && columnX[X] > 0 && columnY[Y] > 0)){
+      continue;
+    }
+
+    const auto pos = rois[spots[lane]]->getGlobalPos();
+    Roi::Result & res = results[spots[lane]];
+    res.mx   = x + pos.first;
+    res.my   = y + pos.second;
+    res.sx2  = sq(block.theta[S][lane]);
+    res.sy2  = res.sx2;
+    res.dx2  = columnX[X];
+    res.dy2  = columnY[Y];
+    res.gesQ = (int) std::lround(block.theta[N][lane]);
+  }
+}
+
+/// Fit the spots of size x size pixels, the others are left as they are
+template <int size>
+void fitSpots(Roi const *const *rois, int count, Roi::Result *results)
+{
+  Block<size> block;
+  int spots[lanes];
+  int filled = 0;
+
+  for(int i=0; i<count; i++){
+    Roi const& roi = *rois[i];
+    const auto roiSize = roi.getSize();
+    if(roiSize.first != size || roiSize.second != size){
+      continue;
+    }
+
+    const auto pos = roi.getGlobalPos();
+    Roi::Result const& centroid = results[i];
+    quint16 const *data = roi.getData();
+
+    double minimum = data[0];
+    for(int p=0; p<size*size; p++){
+      block.pixels[p][filled] = data[p];
+      minimum = std::min(minimum, (double) data[p]);
+    }
+
+    const double background = std::max(minimum, 0.1);
+    block.theta[X][filled] = centroid.mx - pos.first;
+    block.theta[Y][filled] = centroid.my - pos.second;
+    block.theta[B][filled] = background;
+    block.theta[N][filled] = centroid.gesQ - size*size*background;
+    block.theta[S][filled] = std::min(std::sqrt(std::max(0.5*(centroid.sx2 + centroid.sy2), 0.25)), 3.0);
+    clampParams(block.theta, filled, size);
+    spots[filled++] = i;
+
+    if(filled == lanes){
+      fitAndStore(block, rois, spots, filled, results);
+      filled = 0;
+    }
+  }
+
+  if(filled > 0){
+    fitAndStore(block, rois, spots, filled, results);
+  }
+}
+
+}
+
+void GaussMleEstimator::estimate(Roi const *const *rois, int count, Roi::Result *results) const
+{
+  // the centroids seed the fits and stay for the spots that cannot be fitted
+  Roi::calcBatch(rois,count,results);
+
+  fitSpots<5>(rois,count,results);
+  fitSpots<7>(rois,count,results);
+  fitSpots<9>(rois,count,results);
+  fitSpots<11>(rois,count,results);
+}
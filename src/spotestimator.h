@@ -0,0 +1,58 @@
+#ifndef SPOTESTIMATOR_H
+#define SPOTESTIMATOR_H
+
+#include "roi.h"
+
+/// Turns separated spots into results, one implementation per estimation method
+/** A run creates one estimator from its parameters and every estimate slice
+    uses it, so estimate() must not change the estimator. The spots are passed
+    in batches so an implementation can work on several spots at once.
+**/
+class SpotEstimator
+{
+  public:
+    enum Method { Centroid, GaussMLE };
+
+    virtual ~SpotEstimator() {}
+
+    /// Results of count spots, in the order of the spots
+    virtual void estimate(Roi const *const *rois, int count, Roi::Result *results) const = 0;
+    virtual const char *name() const = 0;
+
+    static SpotEstimator *create(Method method);
+    static bool methodFromName(char const *name, Method &method);
+};
+
+/// The moments of the spot, what Roi::calc() gives
+class CentroidEstimator : public SpotEstimator
+{
+  public:
+    void estimate(Roi const *const *rois, int count, Roi::Result *results) const;
+    const char *name() const { return "centroid"; }
+};
+
+/// Maximum likelihood fit of a 2D Gaussian under Poisson noise
+/** The model of a pixel is N times the Gaussian of width sigma integrated over
+    the pixel, plus a background b. Position, N, b and sigma are fitted with
+    Levenberg-Marquardt steps on the Poisson log-likelihood, starting from the
+    centroid. Eight spots are fitted side by side in the lanes of a block, a
+    lane stops once its own position step is below the tolerance, so the fit
+    of a spot does not depend on the other spots of its block. Only the data
+    layout is batched: erf, exp and log are still taken one lane at a time,
+    the compiler does not vectorize the lane loops under the project's flags.
+
+    sx2 and sy2 of a result are sigma squared, dx2 and dy2 the Cramer-Rao
+    bound of the position. The fits are compiled for square spots of 5, 7, 9
+    and 11 pixels. A spot of another size, or whose fit fails or leaves the
+    spot, keeps its centroid.
+**/
+class GaussMleEstimator : public SpotEstimator
+{
+  public:
+    static const int iterations = 10;
+
+    void estimate(Roi const *const *rois, int count, Roi::Result *results) const;
+    const char *name() const { return "mle"; }
+};
+
+#endif // SPOTESTIMATOR_H
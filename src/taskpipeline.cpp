@@ -0,0 +1,361 @@
+#include "qtfiles.h"
+
+#include "estimator.h"
+#include "localizationrun.h"
+#include "taskpipeline.h"
+#include "workstealingpool.h"
+
+/// steps a slice takes before it makes way for the tasks queued behind it
+static const int sliceSteps = 16;
+
+/// Items pushed and not yet popped, the counters can be read while the queue is in use
+template <typename Queue>
+static inline uint32_t queued(Queue & queue)
+{
+  const int32_t fill = (int32_t) (queue.getPushes() - queue.getPops());
+  return (fill > 0)? fill : 0;
+}
+
+/// A queue is drained once its producers finished and it is empty, or once it was closed
+template <typename Queue>
+static inline bool isDrained(Queue & queue)
+{
+  return queue.isDone() || (queue.isFinished() && queued(queue) == 0);
+}
+
+template <typename Value>
+static inline void storeMax(std::atomic<Value> & target, Value value)
+{
+  Value current = target;
+  while(value > current && !target.compare_exchange_weak(current, value)){}
+}
+
+TaskPipeline::TaskPipeline(WorkStealingPool *pool, LocalizationRun *run)
+: pool(pool),
+  run(run),
+  openStages(0),
+  runningSlices(0)
+{
+  const int firstId[NumStages] = {10, 20, 30, 50, 60};
+  const int limit[NumStages]   = {pool->size(), pool->size(), pool->size(), 1, 1};
+
+  for(int stage=0; stage<NumStages; stage++){
+    StageState & state = stages[stage];
+    state.limit  = limit[stage];
+    state.active = 0;
+    state.closed = true;
+    state.begin  = -1;
+    state.end    = 0;
+    state.peak   = 0;
+
+    for(int slot=0; slot<state.limit; slot++){
+      state.all.push_back(new Estimator(firstId[stage]+slot, run));
+    }
+  }
+}
+
+TaskPipeline::~TaskPipeline()
+{
+  // stages without a running slice would not notice a closed run
+  for(int stage=0; stage<NumStages; stage++){
+    tryClose(stage);
+  }
+  wait();
+
+  for(auto & state : stages){
+    for(auto estim : state.all){
+      delete estim;
+    }
+  }
+}
+
+/// Open all stages, the reader may start pushing frames afterwards
+void TaskPipeline::start()
+{
+  watch.start();
+
+  openStages = 0;
+  for(int stage=0; stage<NumStages; stage++){
+    StageState & state = stages[stage];
+    state.active = 0;
+    state.closed = false;
+    state.begin  = -1;
+    state.end    = 0;
+    state.peak   = 0;
+    state.idle   = state.all;
+    openStages++;
+  }
+
+#ifndef SAVE
+  stages[Save].closed = true;
+  openStages--;
+#endif
+
+  // a worker must never wait on a full queue, ready() keeps the capacity instead
+  run->toFindQueue.setCapacity(0);
+  run->toSaveQueue.setCapacity(0);
+  run->roiQueue.setCapacity(0);
+  run->toPrintQueue.setCapacity(0);
+
+  // every stage is one producer of its output queue
+  run->toFindQueue.signUp();
+  run->roiQueue.signUp();
+  run->toPrintQueue.signUp();
+#ifdef SAVE
+  run->toSaveQueue.signUp();
+#endif
+
+  run->toFilterQueue.setListener([this](){ schedule(Filter); });
+  run->toFindQueue.setListener([this](){ schedule(Find); });
+  run->roiQueue.setListener([this](){ schedule(Estimate); });
+  run->toPrintQueue.setListener([this](){ schedule(Insert); });
+#ifdef SAVE
+  run->toSaveQueue.setListener([this](){ schedule(Save); });
+#endif
+
+  for(int stage=0; stage<NumStages; stage++){
+    schedule(stage);
+  }
+}
+
+/// Block until every stage is done, the reader must have returned before
+void TaskPipeline::wait()
+{
+  {
+    std::unique_lock<std::mutex> lock(doneMt);
+    doneCondition.wait(lock, [&](){ return openStages == 0 && runningSlices == 0; });
+  }
+
+  run->toFilterQueue.setListener(nullptr);
+  run->toFindQueue.setListener(nullptr);
+  run->roiQueue.setListener(nullptr);
+  run->toPrintQueue.setListener(nullptr);
+  run->toSaveQueue.setListener(nullptr);
+}
+
+/// All estimators the slices run on, to connect their signals before start()
+QList<Estimator*> TaskPipeline::estimators() const
+{
+  QList<Estimator*> estims;
+  for(const auto & state : stages){
+    for(auto estim : state.all){
+      estims << estim;
+    }
+  }
+  return estims;
+}
+
+TaskPipeline::StageTimes TaskPipeline::times(Stage stage) const
+{
+  const StageState & state = stages[stage];
+
+  StageTimes stageTimes;
+  stageTimes.begin = state.begin;
+  stageTimes.end   = state.end;
+  stageTimes.peak  = state.peak;
+  return stageTimes;
+}
+
+/// Start a slice of the stage if it has work and is below its limit, close it once its input is drained
+void TaskPipeline::schedule(int stage)
+{
+  StageState & state = stages[stage];
+
+  // a closed run leaves items behind, they are not worked on
+  int active = state.active;
+  while(!state.closed && active < state.limit && ready(stage) && !drained(stage)){
+    if(state.active.compare_exchange_weak(active, active+1)){
+      {
+        std::lock_guard<std::mutex> lock(doneMt);
+        runningSlices++;
+      }
+      pool->submit([this,stage](){ runSlice(stage); });
+      return;
+    }
+  }
+
+  tryClose(stage);
+}
+
+void TaskPipeline::runSlice(int stage)
+{
+  StageState & state = stages[stage];
+
+  storeMax(state.peak, (int) state.active);
+  qint64 unset = -1;
+  state.begin.compare_exchange_strong(unset, watch.nsecsElapsed());
+
+  Estimator *estim = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(state.idleMt);
+    estim = state.idle.back();
+    state.idle.pop_back();
+  }
+
+  for(int steps=0; steps<sliceSteps && step(stage, estim); steps++){}
+
+  {
+    std::lock_guard<std::mutex> lock(state.idleMt);
+    state.idle.push_back(estim);
+  }
+
+  storeMax(state.end, watch.nsecsElapsed());
+  state.active--;
+
+  // items that arrived after the last step, or the rest of a used up slice
+  schedule(stage);
+
+  std::lock_guard<std::mutex> lock(doneMt);
+  runningSlices--;
+  doneCondition.notify_all();
+}
+
+void TaskPipeline::tryClose(int stage)
+{
+  StageState & state = stages[stage];
+
+  if(state.active > 0 || state.closed || !drained(stage)){
+    return;
+  }
+
+  if(!state.closed.exchange(true)){
+    end(stage);
+  }
+}
+
+/// The stage has input and room for its output
+bool TaskPipeline::ready(int stage)
+{
+  const uint32_t capacity = (run->frameQueueCapacity > 0)? run->frameQueueCapacity : UINT32_MAX;
+  const uint32_t spotCapacity = (run->spotQueueCapacity > 0)? run->spotQueueCapacity : UINT32_MAX;
+
+  switch(stage){
+    case Filter:
+#ifndef SAVE
+      if(run->fuseFilterFind){
+        // the filter slices search the frames and pass the spots on themselves
+        return queued(run->toFilterQueue) > 0 && queued(run->roiQueue) < spotCapacity;
+      }
+#endif
+      return queued(run->toFilterQueue) > 0 && queued(run->toFindQueue) < capacity;
+    case Find:
+#ifdef SAVE
+      return queued(run->toFindQueue) > 0 && queued(run->toSaveQueue) < capacity
+             && queued(run->roiQueue) < spotCapacity;
+#else
+      return queued(run->toFindQueue) > 0 && queued(run->roiQueue) < spotCapacity;
+#endif
+    case Estimate:
+      return queued(run->roiQueue) > 0 && queued(run->toPrintQueue) < spotCapacity;
+    case Insert:
+      return queued(run->toPrintQueue) > 0;
+    case Save:
+      return queued(run->toSaveQueue) > 0;
+  }
+  return false;
+}
+
+bool TaskPipeline::drained(int stage)
+{
+  switch(stage){
+    case Filter:   return isDrained(run->toFilterQueue);
+    case Find:     return isDrained(run->toFindQueue);
+    case Estimate: return isDrained(run->roiQueue);
+    case Insert:   return isDrained(run->toPrintQueue);
+    case Save:     return isDrained(run->toSaveQueue);
+  }
+  return true;
+}
+
+/// Process one frame or one batch of spots
+/** @return false iff the stage has nothing to do or no room for its output
+**/
+bool TaskPipeline::step(int stage, Estimator *estim)
+{
+  if(!ready(stage)){
+    return false;
+  }
+
+  switch(stage){
+    case Filter:{
+      std::vector<image16_ref*> frames;
+      if(!run->toFilterQueue.try_pop_many(frames,1)){
+        return false;
+      }
+      estim->filterFrame(frames.front());
+      return true;
+    }
+    case Find:{
+      std::vector< QPair< image16_ref*,image16_ref* >* > pairs;
+      if(!run->toFindQueue.try_pop_many(pairs,1)){
+        return false;
+      }
+      schedule(Filter);
+      estim->findFrame(pairs.front());
+      return true;
+    }
+    case Estimate:{
+      std::vector<Roi*> rois;
+      uint64_t batchNr;
+      if(!run->takeSpots(rois,Estimator::batchSize,false,batchNr)){
+        return false;
+      }
+      schedule(Filter);
+      schedule(Find);
+      estim->estimateGenerateBatch(rois,batchNr);
+      return true;
+    }
+    case Insert:{
+      std::vector<Roi*> rois;
+      if(!run->toPrintQueue.try_pop_many(rois,Estimator::batchSize)){
+        return false;
+      }
+      schedule(Estimate);
+      estim->insertBatch(rois);
+      return true;
+    }
+    case Save:{
+      std::vector< QPair< image16_ref*,image16_ref* >* > pairs;
+      if(!run->toSaveQueue.try_pop_many(pairs,1)){
+        return false;
+      }
+      schedule(Find);
+      estim->saveFrame(pairs.front());
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Hand on the end of the stage the way its stage loop in Estimator does
+void TaskPipeline::end(int stage)
+{
+  switch(stage){
+    case Filter:
+      run->toFilterQueue.close();
+      run->toFindQueue.finish();
+      break;
+    case Find:
+      run->toFindQueue.close();
+      run->roiQueue.finish();
+#ifdef SAVE
+      run->toSaveQueue.finish();
+#endif
+      break;
+    case Estimate:
+      run->roiQueue.close();
+      run->toPrintQueue.finish();
+      break;
+    case Insert:
+      run->toPrintQueue.close();
+      break;
+    case Save:
+      run->toSaveQueue.close();
+      stages[Save].all.front()->closeSavedStacks();
+      break;
+  }
+
+  std::lock_guard<std::mutex> lock(doneMt);
+  openStages--;
+  doneCondition.notify_all();
+}
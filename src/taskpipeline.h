@@ -0,0 +1,87 @@
+#ifndef TASKPIPELINE_H
+#define TASKPIPELINE_H
+
+#include <QElapsedTimer>
+#include <QList>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+class Estimator;
+class LocalizationRun;
+class WorkStealingPool;
+
+/// Runs the stages after the reader of one LocalizationRun as tasks on a WorkStealingPool
+/** A stage is split into slices: a slice takes items from the stage's input
+    queue and processes them until the input is empty, the output is full or
+    it has taken a few items, then makes way for the tasks queued behind it.
+    A push to a queue schedules a slice of the stage reading it, a pop
+    schedules the stage feeding it, so idle workers always pick up the stages
+    that are behind. Filter, find and estimate run as many slices as the pool
+    has workers, insert and save one at a time. In a run that fuses filter
+    and find the filter slices search the frames and find gets no input.
+
+    Reading and decoding keep their own threads since they wait for the disk.
+    The run's frame and spot queue capacities are kept by the stages checking
+    their output before taking more input, a worker never waits on a full
+    queue.
+**/
+class TaskPipeline
+{
+  public:
+    enum Stage { Filter, Find, Estimate, Insert, Save, NumStages };
+
+    struct StageTimes{
+      qint64 begin;   // ns since start(), -1 if the stage never ran
+      qint64 end;     // ns since start()
+      int peak;       // slices that ran at the same time
+    };
+
+    TaskPipeline(WorkStealingPool *pool, LocalizationRun *run);
+    ~TaskPipeline();
+
+    void start();
+    void wait();
+
+    QList<Estimator*> estimators() const;
+    StageTimes times(Stage stage) const;
+
+  private:
+    struct StageState{
+      int limit;                       ///< slices at the same time
+      std::atomic<int> active;
+      std::atomic<bool> closed;
+      std::atomic<qint64> begin;
+      std::atomic<qint64> end;
+      std::atomic<int> peak;
+
+      std::mutex idleMt;
+      std::vector<Estimator*> idle;    ///< one per possible slice, a slice keeps its state
+      std::vector<Estimator*> all;
+    };
+
+    void schedule(int stage);
+    void runSlice(int stage);
+    void tryClose(int stage);
+
+    bool ready(int stage);
+    bool drained(int stage);
+    bool step(int stage, Estimator *estim);
+    void end(int stage);
+
+    WorkStealingPool *pool;
+    LocalizationRun *run;
+
+    StageState stages[NumStages];
+
+    QElapsedTimer watch;
+    std::mutex doneMt;
+    std::condition_variable doneCondition;
+    int openStages;
+    int runningSlices;   ///< submitted slices that have not returned yet
+};
+
+#endif // TASKPIPELINE_H
@@ -4,7 +4,9 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <queue>
+#include <vector>
 
 //#define DEBUG
 
@@ -24,7 +26,10 @@ class ThreadSaveQueue : public std::queue<Type *>
                         m_done(false),
                         m_finish(false),
                         m_lockedUsers(0),
-                        m_threashold(0)
+                        m_threashold(0),
+                        m_thld(0),
+                        m_capacity(0),
+                        m_highWater(0)
     {}
 
     virtual ~ThreadSaveQueue()    {
@@ -34,8 +39,10 @@ class ThreadSaveQueue : public std::queue<Type *>
       m_done = true;
       m_finish = true;
       m_waitCondition.notify_all();
+      m_spaceCondition.notify_all();
     }
 
+    /// Append an item, waits while a bounded queue is full
     void push_back(Type * dataPtr)
     {
 #ifdef DEBUG
@@ -45,11 +52,30 @@ class ThreadSaveQueue : public std::queue<Type *>
 
       {
         std::unique_lock<std::mutex> lock(m_mt);
-        this->push(dataPtr);
-        m_pushCnt++;
+        enqueue(lock, dataPtr);
       }
 
       m_waitCondition.notify_one();
+      notifyListener();
+    }
+
+    /// Append all items in one critical section, the vector is emptied
+    void push_many(std::vector<Type *> & dataPtrs)
+    {
+      if(dataPtrs.empty()){
+        return;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(m_mt);
+        for(auto dataPtr : dataPtrs){
+          enqueue(lock, dataPtr);
+        }
+      }
+
+      dataPtrs.clear();
+      m_waitCondition.notify_all();
+      notifyListener();
     }
 
     bool pop_front(Type* & dataPtr)
@@ -62,10 +88,19 @@ class ThreadSaveQueue : public std::queue<Type *>
       // lock mutex
       std::unique_lock<std::mutex> lock(m_mt);
 
-      while(this->size()<=m_thld){
+      // a full queue counts as over the threashold, its producers can not add more
+      while(this->size()<=m_thld && !isFull()){
+        // the producers finished while the queue was already empty
+        if(m_done || (m_finish && this->size() == 0)){
+          m_done = true;
+          dataPtr = nullptr;
+          m_waitCondition.notify_all();
+          return false;
+        }
+
         auto now = std::chrono::system_clock::now();
         // wait for notify as long as the PacketQueue is empty
-        m_waitCondition.wait_until(lock,now+std::chrono::milliseconds(10), [&](){return (m_done || (this->size() > m_thld)); } );
+        m_waitCondition.wait_until(lock,now+std::chrono::milliseconds(10), [&](){return (m_done || m_finish || (this->size() > m_thld) || isFull()); } );
       }
 
 #ifdef DEBUG
@@ -83,27 +118,109 @@ class ThreadSaveQueue : public std::queue<Type *>
         m_popCnt++;
         dataPtr = this->front();
         this->pop();
+        if(m_capacity > 0){
+          m_spaceCondition.notify_one();
+        }
       }else{
         dataPtr = nullptr;
         return false;
       }
 
-      if(this->size() == 0){
-        m_thld = m_threashold;
-        if(m_finish){
+      checkDrained();
+      return true;
+    }
+
+    /// Take up to maxItems items in one critical section, waits like pop_front for the first
+    /** @return false iff the queue is done, dataPtrs is empty then
+    **/
+    bool pop_many(std::vector<Type *> & dataPtrs, size_t maxItems)
+    {
+      dataPtrs.clear();
+
+      if(m_done){
+        m_waitCondition.notify_all();
+        return false;
+      }
+
+      std::unique_lock<std::mutex> lock(m_mt);
+
+      while(this->size()<=m_thld && !isFull()){
+        if(m_done || (m_finish && this->size() == 0)){
           m_done = true;
-#ifdef DEBUG
-          std::cout << "QUEUE is done after finish" << std::endl;
-#endif
           m_waitCondition.notify_all();
+          return false;
         }
+
+        auto now = std::chrono::system_clock::now();
+        m_waitCondition.wait_until(lock,now+std::chrono::milliseconds(10), [&](){return (m_done || m_finish || (this->size() > m_thld) || isFull()); } );
+      }
+
+      m_thld = 0;
+
+      if(m_done){
+        return false;
+      }
+
+      while(!this->empty() && dataPtrs.size() < maxItems){
+        dataPtrs.push_back(this->front());
+        this->pop();
+      }
+      m_popCnt += dataPtrs.size();
+
+      if(m_capacity > 0){
+        m_spaceCondition.notify_all();
       }
+
+      checkDrained();
       return true;
     }
 
+    /// Take up to maxItems items without waiting, the threashold does not apply
+    /** @return false iff no item was taken
+    **/
+    bool try_pop_many(std::vector<Type *> & dataPtrs, size_t maxItems)
+    {
+      dataPtrs.clear();
+
+      std::unique_lock<std::mutex> lock(m_mt);
+      if(m_done){
+        return false;
+      }
+
+      while(!this->empty() && dataPtrs.size() < maxItems){
+        dataPtrs.push_back(this->front());
+        this->pop();
+      }
+      m_popCnt += dataPtrs.size();
+
+      if(dataPtrs.empty()){
+        return false;
+      }
+
+      if(m_capacity > 0){
+        m_spaceCondition.notify_all();
+      }
+
+      checkDrained();
+      return true;
+    }
+
+    /// Called after every push and once the producers finished, lets a scheduler follow the queue
+    /** Set while no producer is running, the listener must not push to this queue.
+    **/
+    inline void setListener(std::function<void()> listener){
+      m_listener = listener;
+    }
+
     inline void setThreashold(uint32_t threashold){
       m_threashold = threashold;
-      m_thld = m_threashold;
+      m_thld = (uint32_t) m_threashold;
+    }
+
+    /// Number of items the queue holds before push_back waits, 0 for unbounded
+    inline void setCapacity(uint32_t capacity){
+      m_capacity = capacity;
+      m_spaceCondition.notify_all();
     }
 
     inline void reset() {
@@ -112,12 +229,16 @@ class ThreadSaveQueue : public std::queue<Type *>
       m_finish = false;
       m_pushCnt = 0;
       m_popCnt = 0;
+      m_highWater = 0;
     }
 
     inline uint32_t getPushes() const { return m_pushCnt; }
     inline uint32_t getPops()   const { return m_popCnt;  }
+    inline uint32_t getCapacity()  const { return m_capacity;  }
+    inline uint32_t getHighWater() const { return m_highWater; }
 
     bool isDone(){return m_done;}
+    bool isFinished(){return m_finish || m_done;}
 
     void signUp(){
       m_lockedUsers++;
@@ -134,19 +255,65 @@ class ThreadSaveQueue : public std::queue<Type *>
 #endif
       }      
       m_waitCondition.notify_all();
+      notifyListener();
     }
 
-    void wake(){m_waitCondition.notify_all();}
+    void wake(){
+      m_waitCondition.notify_all();
+      m_spaceCondition.notify_all();
+    }
 
     void close(){
       m_lockedUsers = 0;
       m_done = true;
       setThreashold(0);
       m_waitCondition.notify_all();
+      m_spaceCondition.notify_all();
     }
 
   private:
+    inline bool isFull() const { return m_capacity > 0 && this->size() >= m_capacity; }
+
+    /// Push one item with m_mt held, waits while a bounded queue is full
+    void enqueue(std::unique_lock<std::mutex> & lock, Type * dataPtr)
+    {
+      // back-pressure: the producer waits for a consumer, a closed queue takes everything
+      while(isFull() && !m_done){
+        auto now = std::chrono::system_clock::now();
+        m_spaceCondition.wait_until(lock,now+std::chrono::milliseconds(10), [&](){return (m_done || !isFull()); } );
+      }
+
+      this->push(dataPtr);
+      m_pushCnt++;
+
+      if(this->size() > m_highWater){
+        m_highWater = this->size();
+      }
+    }
+
+    inline void notifyListener(){
+      if(m_listener){
+        m_listener();
+      }
+    }
+
+    /// After a pop with m_mt held: rearm the threashold, the queue is done once it is drained after finish
+    void checkDrained()
+    {
+      if(this->size() == 0){
+        m_thld = (uint32_t) m_threashold;
+        if(m_finish){
+          m_done = true;
+#ifdef DEBUG
+          std::cout << "QUEUE is done after finish" << std::endl;
+#endif
+          m_waitCondition.notify_all();
+        }
+      }
+    }
+
     std::condition_variable m_waitCondition;
+    std::condition_variable m_spaceCondition;
     std::atomic<uint32_t> m_pushCnt;
     std::atomic<uint32_t> m_popCnt;
     std::mutex m_mt;
@@ -154,7 +321,10 @@ class ThreadSaveQueue : public std::queue<Type *>
     std::atomic<bool> m_finish;
     std::atomic<int> m_lockedUsers;
     std::atomic<uint32_t> m_threashold;
-    uint32_t m_thld;
+    std::atomic<uint32_t> m_thld;
+    std::atomic<uint32_t> m_capacity;
+    std::atomic<uint32_t> m_highWater;
+    std::function<void()> m_listener;
 };
 
 #endif // THREADSAVEQUEUE_H
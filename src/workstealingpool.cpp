@@ -0,0 +1,111 @@
+#include "workstealingpool.h"
+
+/// pool and worker index of the calling thread, nullptr outside of a pool
+static thread_local WorkStealingPool *currentPool = nullptr;
+static thread_local int currentWorker = -1;
+
+/** @param numWorkers worker threads, 0 for one per core
+**/
+WorkStealingPool::WorkStealingPool(int numWorkers)
+: pending(0),
+  sleepers(0),
+  stop(false),
+  nextWorker(0)
+{
+  if(numWorkers <= 0){
+    numWorkers = hardwareWorkers();
+  }
+
+  for(int index = 0; index < numWorkers; index++){
+    workers.emplace_back(new Worker);
+  }
+  for(int index = 0; index < numWorkers; index++){
+    threads.emplace_back(&WorkStealingPool::work, this, index);
+  }
+}
+
+/// Runs the tasks still pending, then stops the workers
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleepMt);
+    stop = true;
+  }
+  sleepCondition.notify_all();
+
+  for(auto & thread : threads){
+    thread.join();
+  }
+}
+
+int WorkStealingPool::hardwareWorkers()
+{
+  const int cores = (int) std::thread::hardware_concurrency();
+  return (cores > 0)? cores : 2;
+}
+
+void WorkStealingPool::submit(std::function<void()> task)
+{
+  const int index = (currentPool == this)? currentWorker
+                                          : (int) (nextWorker++ % workers.size());
+  {
+    std::lock_guard<std::mutex> lock(workers[index]->mt);
+    workers[index]->tasks.push_back(std::move(task));
+  }
+  pending++;
+
+  if(sleepers > 0){
+    std::lock_guard<std::mutex> lock(sleepMt);
+    sleepCondition.notify_one();
+  }
+}
+
+void WorkStealingPool::work(int index)
+{
+  currentPool = this;
+  currentWorker = index;
+
+  std::function<void()> task;
+  for(;;){
+    if(take(index, task)){
+      pending--;
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleepMt);
+    if(stop && pending <= 0){
+      return;
+    }
+    sleepers++;
+    sleepCondition.wait(lock, [&](){ return stop || pending > 0; });
+    sleepers--;
+  }
+}
+
+/// Own tasks first, oldest first, then the newest task of the next busy worker
+bool WorkStealingPool::take(int index, std::function<void()> &task)
+{
+  const int numWorkers = (int) workers.size();
+
+  for(int offset = 0; offset < numWorkers; offset++){
+    Worker & worker = *workers[(index + offset) % numWorkers];
+
+    std::lock_guard<std::mutex> lock(worker.mt);
+    if(worker.tasks.empty()){
+      continue;
+    }
+
+    if(offset == 0){
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    }else{
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+    return true;
+  }
+
+  return false;
+}
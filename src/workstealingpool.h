@@ -0,0 +1,52 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of worker threads that run submitted tasks
+/** Every worker has its own task list. A task submitted by a worker goes to
+    that worker's list, other tasks are dealt out in turn. A worker runs its
+    own tasks oldest first and steals the newest task of another worker when
+    its list is empty, so no core idles while there is work anywhere. Tasks
+    must not block on each other, they may submit new tasks.
+**/
+class WorkStealingPool
+{
+  public:
+    explicit WorkStealingPool(int numWorkers = 0);
+    ~WorkStealingPool();
+
+    void submit(std::function<void()> task);
+
+    inline int size() const { return (int) threads.size(); }
+
+    static int hardwareWorkers();
+
+  private:
+    struct Worker{
+      std::mutex mt;
+      std::deque< std::function<void()> > tasks;
+    };
+
+    void work(int index);
+    bool take(int index, std::function<void()> &task);
+
+    std::vector< std::unique_ptr<Worker> > workers;
+    std::vector<std::thread> threads;
+
+    std::mutex sleepMt;
+    std::condition_variable sleepCondition;
+    std::atomic<int> pending;     ///< submitted tasks not taken yet
+    std::atomic<int> sleepers;
+    std::atomic<bool> stop;
+    std::atomic<unsigned> nextWorker;
+};
+
+#endif // WORKSTEALINGPOOL_H